@@ -0,0 +1,303 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_async.c
+//  Description    : This is the implementation of the asynchronous IO
+//                   interface to the CART storage system.  A small pool of IO
+//                   threads takes requests off the submission queue, runs them
+//                   through the blocking driver calls (which pipeline their
+//                   bus operations) and posts the results to the completion
+//                   queue.  Requests on different files run at the same time,
+//                   those on the same file handle one after another in
+//                   submission order.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Includes
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Project Includes
+#include "cart_async.h"
+#include "cart_driver.h"
+#include "cmpsc311_log.h"
+
+// Defines
+#define CART_ASYNC_WORKERS 4    // IO threads in the pool
+
+// A queued request
+typedef struct cartAsyncReq {
+    int write;                  //1 for a write, 0 for a read
+    int16_t fd;
+    void *buf;
+    int32_t count;
+    uint64_t tag;
+    int32_t result;
+    struct cartAsyncReq *next;
+} CartAsyncReq;
+
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncSubmitted = PTHREAD_COND_INITIALIZER;  //signalled on submit and stop
+static pthread_cond_t asyncCompleted = PTHREAD_COND_INITIALIZER;  //signalled on completion
+static pthread_cond_t asyncDrained = PTHREAD_COND_INITIALIZER;    //signalled when a drain is over
+static pthread_t asyncThreads[CART_ASYNC_WORKERS];
+static int16_t asyncBusy[CART_ASYNC_WORKERS];              //fd each IO thread is working on, -1 if none
+static int asyncRunning = 0;
+static int asyncStopping = 0;                              //set by the drain under way, submissions are refused
+static CartAsyncReq *subHead = NULL, *subTail = NULL;      //submission queue
+static CartAsyncReq *compHead = NULL, *compTail = NULL;    //completion queue
+static int asyncInFlight = 0;                              //submitted but not yet completed
+static int asyncCompletions = 0;                           //completions not yet reaped
+
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_take
+// Description  : take the oldest queued request whose file handle no IO
+//                thread is working on (lock held)
+//
+// Inputs       : none
+// Outputs      : the request, NULL if there is none
+
+static CartAsyncReq *async_take(void) {
+    CartAsyncReq *prev = NULL;
+    
+    for (CartAsyncReq *req = subHead; req != NULL; prev = req, req = req->next) {
+        int busy = 0;
+        for (int w = 0; w < CART_ASYNC_WORKERS && !busy; w++)
+            busy = (asyncBusy[w] == req->fd);
+        if (busy)
+            continue;
+        if (prev != NULL)
+            prev->next = req->next;
+        else
+            subHead = req->next;
+        if (subTail == req)
+            subTail = prev;
+        return(req);
+    }
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_main
+// Description  : an IO thread, runs the oldest request it may, keeping the
+//                requests on each file handle in submission order
+//
+// Inputs       : arg - the index of the thread in the pool
+// Outputs      : NULL
+
+static void *async_main(void *arg) {
+    const int w = (int)(intptr_t)arg;
+    CartAsyncReq *req;
+    
+    pthread_mutex_lock(&asyncLock);
+    for (;;) {
+        while ((req = async_take()) == NULL && !(asyncStopping && subHead == NULL))
+            pthread_cond_wait(&asyncSubmitted, &asyncLock);
+        if (req == NULL)
+            break;
+        asyncBusy[w] = req->fd;
+        pthread_mutex_unlock(&asyncLock);
+        
+        if (req->write)
+            req->result = cart_write(req->fd, req->buf, req->count);
+        else
+            req->result = cart_read(req->fd, req->buf, req->count);
+        
+        pthread_mutex_lock(&asyncLock);
+        asyncBusy[w] = -1;
+        req->next = NULL;
+        if (compTail != NULL)
+            compTail->next = req;
+        else
+            compHead = req;
+        compTail = req;
+        asyncInFlight--;
+        asyncCompletions++;
+        pthread_cond_broadcast(&asyncCompleted);
+        pthread_cond_broadcast(&asyncSubmitted);    //the next request on the fd may go
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_submit
+// Description  : queue a request, starting the IO threads if needed; while
+//                a drain is under way requests are refused
+//
+// Inputs       : write - 1 for a write, 0 for a read
+//                fd, buf, count - as for cart_read / cart_write
+//                tag - the caller's tag for the completion
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t async_submit(int write, int16_t fd, void *buf, int32_t count, uint64_t tag) {
+    
+    CartAsyncReq *req = malloc(sizeof(CartAsyncReq));
+    if (req == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART async failed: cannot allocate request.");
+        return(-1);
+    }
+    req->write = write;
+    req->fd = fd;
+    req->buf = buf;
+    req->count = count;
+    req->tag = tag;
+    req->next = NULL;
+    
+    pthread_mutex_lock(&asyncLock);
+    if (asyncStopping) {
+        pthread_mutex_unlock(&asyncLock);
+        logMessage(LOG_ERROR_LEVEL, "CART async failed: IO threads are stopping.");
+        free(req);
+        return(-1);
+    }
+    while (asyncRunning < CART_ASYNC_WORKERS) {
+        asyncBusy[asyncRunning] = -1;
+        if (pthread_create(&asyncThreads[asyncRunning], NULL, async_main, (void *)(intptr_t)asyncRunning)) {
+            if (asyncRunning > 0)
+                break;                  //make do with the threads there are
+            pthread_mutex_unlock(&asyncLock);
+            logMessage(LOG_ERROR_LEVEL, "CART async failed: cannot start IO thread.");
+            free(req);
+            return(-1);
+        }
+        asyncRunning++;
+    }
+    if (subTail != NULL)
+        subTail->next = req;
+    else
+        subHead = req;
+    subTail = req;
+    asyncInFlight++;
+    pthread_cond_broadcast(&asyncSubmitted);
+    pthread_mutex_unlock(&asyncLock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_read_async / cart_write_async
+// Description  : Queue a read / write on the IO threads
+//
+// Inputs       : fd - the file handle
+//                buf - the buffer to read into / write from, which must stay
+//                      valid until the request completes
+//                count - number of bytes to transfer
+//                tag - value returned with the completion
+// Outputs      : 0 if queued, -1 if failure
+
+int32_t cart_read_async(int16_t fd, void *buf, int32_t count, uint64_t tag) {
+    return(async_submit(0, fd, buf, count, tag));
+}
+
+int32_t cart_write_async(int16_t fd, void *buf, int32_t count, uint64_t tag) {
+    return(async_submit(1, fd, buf, count, tag));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_reap
+// Description  : move up to max completions to the caller (lock held)
+//
+// Inputs       : cqe - the caller's completion array
+//                max - its size
+// Outputs      : the number of completions reaped
+
+static int32_t async_reap(CartCompletion *cqe, int32_t max) {
+    int32_t n = 0;
+    while (compHead != NULL && n < max) {
+        CartAsyncReq *req = compHead;
+        compHead = req->next;
+        if (compHead == NULL)
+            compTail = NULL;
+        cqe[n].tag = req->tag;
+        cqe[n].result = req->result;
+        free(req);
+        asyncCompletions--;
+        n++;
+    }
+    return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poll
+// Description  : Reap completions without blocking
+//
+// Inputs       : cqe - array receiving the completions
+//                max - size of the array
+// Outputs      : the number of completions reaped
+
+int32_t cart_poll(CartCompletion *cqe, int32_t max) {
+    pthread_mutex_lock(&asyncLock);
+    int32_t n = async_reap(cqe, max);
+    pthread_mutex_unlock(&asyncLock);
+    return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_wait
+// Description  : Block until min completions are ready, or until nothing
+//                more is in flight, then reap up to max of them
+//
+// Inputs       : cqe - array receiving the completions
+//                min - number of completions to wait for
+//                max - size of the array
+// Outputs      : the number of completions reaped
+
+int32_t cart_wait(CartCompletion *cqe, int32_t min, int32_t max) {
+    if (min > max)
+        min = max;
+    pthread_mutex_lock(&asyncLock);
+    while (asyncCompletions < min && asyncInFlight > 0)
+        pthread_cond_wait(&asyncCompleted, &asyncLock);
+    int32_t n = async_reap(cqe, max);
+    pthread_mutex_unlock(&asyncLock);
+    return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_async_drain
+// Description  : Wait for all submitted requests and stop the IO threads
+//                (completions stay queued until reaped); requests submitted
+//                meanwhile are refused.  The first caller joins the threads,
+//                any other waits for it to finish.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_async_drain(void) {
+    pthread_mutex_lock(&asyncLock);
+    if (asyncStopping) {
+        while (asyncStopping)
+            pthread_cond_wait(&asyncDrained, &asyncLock);
+        pthread_mutex_unlock(&asyncLock);
+        return(0);
+    }
+    int running = asyncRunning;
+    if (running == 0) {
+        pthread_mutex_unlock(&asyncLock);
+        return(0);
+    }
+    asyncStopping = 1;
+    pthread_cond_broadcast(&asyncSubmitted);
+    pthread_mutex_unlock(&asyncLock);
+    
+    for (int w = 0; w < running; w++)
+        pthread_join(asyncThreads[w], NULL);
+    pthread_mutex_lock(&asyncLock);
+    asyncRunning = 0;
+    asyncStopping = 0;
+    pthread_cond_broadcast(&asyncDrained);
+    pthread_mutex_unlock(&asyncLock);
+    return(0);
+}
@@ -0,0 +1,45 @@
+#ifndef CART_ASYNC_INCLUDED
+#define CART_ASYNC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_async.h
+//  Description    : This is the header file for the asynchronous IO
+//                   interface to the CART storage system.  Requests are
+//                   queued to a pool of IO threads, those on the same file
+//                   handle executed in submission order; their results are
+//                   collected from a completion queue.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Include files
+#include <stdint.h>
+
+// Type definitions
+typedef struct {
+	uint64_t tag;     // Tag given when the request was submitted
+	int32_t  result;  // Bytes transferred, -1 if the request failed
+} CartCompletion;
+
+//
+// Interface functions
+
+int32_t cart_read_async(int16_t fd, void *buf, int32_t count, uint64_t tag);
+	// Queue a read of "count" bytes from "fd" into "buf"
+
+int32_t cart_write_async(int16_t fd, void *buf, int32_t count, uint64_t tag);
+	// Queue a write of "count" bytes to "fd" from "buf"
+
+int32_t cart_poll(CartCompletion *cqe, int32_t max);
+	// Reap up to "max" completions without blocking, returns the number reaped
+
+int32_t cart_wait(CartCompletion *cqe, int32_t min, int32_t max);
+	// Block until "min" completions are available (or nothing is in flight),
+	// then reap up to "max" of them
+
+int32_t cart_async_drain(void);
+	// Wait for all submitted requests to finish and stop the IO threads
+
+#endif
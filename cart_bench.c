@@ -0,0 +1,762 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_bench.c
+//  Description    : This is the end-to-end benchmark of the CART driver.  It
+//                   replays workloads through cart_client against a fresh
+//                   cart_server (or the in-process controller) for every
+//                   cache size and policy asked for, reads the driver
+//                   counters the client publishes (-s), writes the results
+//                   as JSON and compares them with a stored baseline.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Project Include Files
+#include <cart_network.h>
+#include <cart_stats.h>
+
+// Defines
+#define CART_WORKLOAD_DIR "workload"
+#define CART_BENCH_ARGUMENTS "hvwlc:r:b:o:t:s:d:"
+#define CART_BENCH_MAX_CONFIGS 16           // Cache sizes / policies in one sweep
+#define CART_BENCH_MAX_FILES 1024           // Data files a generated workload uses
+#define CART_BENCH_CHUNK 900                // Longest text on one workload line
+#define CART_BENCH_SEED 311                 // Seed of the generated workload
+#define CART_BENCH_THRESHOLD 10.0           // Default regression threshold (%)
+#define USAGE \
+	"USAGE: cart_bench [-h] [-v] [-w] [-l] [-c <sizes>] [-r <policies>] [-b <baseline>] [-o <json>]\n" \
+	"                  [-t <pct>] [-s <seed>] [-d <ldcart>,<rdfrme>,<wrfrme>] [<workload-file> ...]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - show the client log of a failed run\n" \
+	"    -w - also run every configuration with the write-back cache\n" \
+	"    -l - run the driver against the in-process controller, not cart_server\n" \
+	"    -c - comma separated cache sizes (default 1024)\n" \
+	"    -r - comma separated replacement policies (default lru)\n" \
+	"    -b - compare with the results in <baseline>, exit 1 on a regression, fail if it is missing\n" \
+	"    -o - write the results to <json> (default cart_bench.json)\n" \
+	"    -t - regression threshold in percent (default 10)\n" \
+	"    -s - seed of the generated workload\n" \
+	"    -d - microseconds the in-process controller charges per operation (implies -l)\n" \
+	"\n" \
+	"    <workload-file> - workloads to replay; without any, one is generated\n" \
+	"                      from every data file in " CART_WORKLOAD_DIR "/\n" \
+	"\n" \
+
+// The outcome of one run
+typedef struct {
+	const char *workload;   // Workload file replayed (its name in the results)
+	int         cache;      // Cache size (frames)
+	const char *policy;     // Replacement policy
+	int         writeBack;  // Write-back cache used
+	const char *backend;    // Bus backend ("net" or "local")
+	const char *latency;    // Latency model of the local backend ("" if none)
+	int         ok;         // The client validated every file
+	double      seconds;    // Wall time of the client
+	uint64_t    ops;        // cart_read and cart_write calls
+	uint64_t    bytes;      // Bytes they moved
+	uint64_t    busOps;     // Bus requests of all opcodes
+	uint64_t    loads;      // LDCART requests
+	uint64_t    hits;       // Cache hits
+	uint64_t    misses;     // Cache demand misses
+	double      readUs[3];  // cart_read p50, p99, p99.9 (us)
+	double      writeUs[3]; // cart_write p50, p99, p99.9 (us)
+} CartBenchResult;
+
+//
+// Global Data
+int verbose = 0;
+const char *backend = "net";    // Bus backend the client is run with
+const char *latency = "";       // Latency model passed to the client (-d)
+
+//
+// Functional Prototypes
+
+int generate_workload(const char *dir, const char *out, uint64_t seed);      // make a workload from data files
+int run_bench(const char *wload, CartBenchResult *r);                        // run one configuration
+int split_list(char *list, char **items, int max);                          // split a comma separated list
+void write_result(FILE *fh, const CartBenchResult *r, int last);            // write one result as JSON
+int compare_baseline(const char *baseline, CartBenchResult *res, int n, double threshold); // flag regressions
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the CART benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if every run passed without regression, 1 on a
+//                regression, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, writeBack = 0, ncaches, npolicies, nfiles, nresults = 0, ret = 0;
+	char defCaches[] = "1024", defPolicies[] = "lru", genName[] = "/tmp/cart_bench.wl.XXXXXX";
+	char *cacheList = defCaches, *policyList = defPolicies, *caches[CART_BENCH_MAX_CONFIGS];
+	char *policies[CART_BENCH_MAX_CONFIGS], *baseline = NULL, *output = "cart_bench.json";
+	char **files, *generated[1];
+	double threshold = CART_BENCH_THRESHOLD;
+	uint64_t seed = CART_BENCH_SEED;
+	CartBenchResult *results;
+	FILE *fh;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_BENCH_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'w': // Write-back cache Flag
+			writeBack = 1;
+			break;
+
+		case 'l': // In-process controller Flag
+			backend = "local";
+			break;
+
+		case 'd': // Latency model of the in-process controller
+			backend = "local";
+			latency = optarg;
+			break;
+
+		case 'c': // Cache sizes
+			cacheList = optarg;
+			break;
+
+		case 'r': // Replacement policies
+			policyList = optarg;
+			break;
+
+		case 'b': // Baseline to compare with
+			baseline = optarg;
+			break;
+
+		case 'o': // Results file
+			output = optarg;
+			break;
+
+		case 't': // Regression threshold
+			if ( sscanf(optarg, "%lf", &threshold) != 1 || threshold <= 0 ) {
+				fprintf( stderr, "Bad threshold [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 's': // Seed of the generated workload
+			if ( sscanf(optarg, "%llu", (unsigned long long *)&seed) != 1 ) {
+				fprintf( stderr, "Bad seed [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+	ncaches = split_list( cacheList, caches, CART_BENCH_MAX_CONFIGS );
+	npolicies = split_list( policyList, policies, CART_BENCH_MAX_CONFIGS );
+	for ( int i = 0; i < ncaches; i++ ) {
+		if ( atoi(caches[i]) <= 0 ) {
+			fprintf( stderr, "Bad cache size [%s]\n", caches[i] );
+			return( -1 );
+		}
+	}
+
+	// The workloads given, or one generated from all of the data files
+	if ( optind < argc ) {
+		files = &argv[optind];
+		nfiles = argc - optind;
+	} else {
+		int fd = mkstemp( genName );
+		if ( fd == -1 ) {
+			fprintf( stderr, "Cannot create a workload file: %s\n", strerror(errno) );
+			return( -1 );
+		}
+		close( fd );
+		if ( generate_workload(CART_WORKLOAD_DIR, genName, seed) ) {
+			unlink( genName );
+			return( -1 );
+		}
+		generated[0] = genName;
+		files = generated;
+		nfiles = 1;
+	}
+
+	// Run every workload with every configuration
+	results = calloc( nfiles * ncaches * npolicies * (writeBack + 1), sizeof(CartBenchResult) );
+	if ( results == NULL ) {
+		fprintf( stderr, "Cannot allocate the results.\n" );
+		return( -1 );
+	}
+	printf( "%-24s %6s %-5s %2s %4s %8s %9s %8s %7s %7s %8s %8s %8s %8s\n", "workload", "cache",
+		"pol", "wb", "ok", "ops/s", "MB/s", "bus/op", "ldcart", "miss%", "rd_p50", "rd_p99",
+		"wr_p50", "wr_p99" );
+	for ( int f = 0; f < nfiles; f++ ) {
+		for ( int w = 0; w <= writeBack; w++ ) {
+			for ( int c = 0; c < ncaches; c++ ) {
+				for ( int p = 0; p < npolicies; p++ ) {
+					CartBenchResult *r = &results[nresults++];
+					const char *name = (files == generated) ? CART_WORKLOAD_DIR "/" : files[f];
+					r->workload = name;
+					r->cache = atoi( caches[c] );
+					r->policy = policies[p];
+					r->writeBack = w;
+					r->backend = backend;
+					r->latency = latency;
+					run_bench( files[f], r );
+					if ( ! r->ok ) {
+						ret = -1;
+					}
+					printf( "%-24.24s %6d %-5s %2d %4s %8.0f %9.3f %8.3f %7llu %7.2f %8.1f %8.1f %8.1f %8.1f\n",
+						name, r->cache, r->policy, r->writeBack, r->ok ? "PASS" : "FAIL",
+						r->seconds > 0 ? r->ops / r->seconds : 0.0,
+						r->seconds > 0 ? r->bytes / 1e6 / r->seconds : 0.0,
+						r->ops ? (double)r->busOps / r->ops : 0.0, (unsigned long long)r->loads,
+						(r->hits + r->misses) ? 100.0 * r->misses / (r->hits + r->misses) : 0.0,
+						r->readUs[0], r->readUs[1], r->writeUs[0], r->writeUs[1] );
+					fflush( stdout );
+				}
+			}
+		}
+	}
+	if ( files == generated ) {
+		unlink( genName );
+	}
+
+	// Save the results, then compare them with the baseline
+	if ( (fh = fopen(output, "w")) == NULL ) {
+		fprintf( stderr, "Cannot write %s: %s\n", output, strerror(errno) );
+		free( results );
+		return( -1 );
+	}
+	fprintf( fh, "{\"runs\": [\n" );
+	for ( int i = 0; i < nresults; i++ ) {
+		write_result( fh, &results[i], i == nresults - 1 );
+	}
+	fprintf( fh, "]}\n" );
+	fclose( fh );
+	printf( "Results written to %s.\n", output );
+	if ( baseline != NULL && ret == 0 ) {
+		ret = compare_baseline( baseline, results, nresults, threshold );
+	}
+
+	free( results );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : split_list
+// Description  : Split a comma separated list in place
+//
+// Inputs       : list - the list (modified)
+//                items - the items (output)
+//                max - the most items kept
+// Outputs      : the number of items
+
+int split_list(char *list, char **items, int max) {
+	int n = 0;
+	for ( char *tok = strtok(list, ","); tok != NULL && n < max; tok = strtok(NULL, ",") ) {
+		items[n++] = tok;
+	}
+	return( n );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_rand
+// Description  : A small deterministic generator (xorshift64*), so a seed
+//                gives the same workload on every system
+//
+// Inputs       : state - the generator state
+// Outputs      : the next random number
+
+static uint64_t bench_rand(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return( *state * 2685821657736338717ULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : emit_line
+// Description  : Write one workload line, with newlines in the text as '^'
+//
+// Inputs       : fh - the workload file
+//                name, cmd, len, off - the command
+//                text - the text to write (NULL for none)
+// Outputs      : none
+
+static void emit_line(FILE *fh, const char *name, const char *cmd, int len, int off, const char *text) {
+	fprintf( fh, "%s %s %d %d :", name, cmd, len, off );
+	for ( int i = 0; text != NULL && i < len; i++ ) {
+		fputc( (text[i] == '\n') ? '^' : text[i], fh );
+	}
+	fputc( '\n', fh );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : is_data_file
+// Description  : Select the data files of the workload directory (not the
+//                copies cart_client writes back when validating)
+//
+// Inputs       : d - the directory entry
+// Outputs      : 1 for a data file, 0 otherwise
+
+static int is_data_file(const struct dirent *d) {
+	size_t len = strlen( d->d_name );
+	return( len > 4 && strcmp(d->d_name + len - 4, ".txt") == 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : generate_workload
+// Description  : Write a workload that builds every data file of a
+//                directory: files grow by appends of varying size, in a
+//                random interleaving, with rewrites of earlier parts and
+//                read-backs mixed in
+//
+// Inputs       : dir - the data directory
+//                out - the workload file to write
+//                seed - the random seed
+// Outputs      : 0 if successful, -1 if failure
+
+int generate_workload(const char *dir, const char *out, uint64_t seed) {
+
+	// Local variables
+	struct dirent **list;
+	char *data[CART_BENCH_MAX_FILES], *names[CART_BENCH_MAX_FILES], path[512];
+	int len[CART_BENCH_MAX_FILES], written[CART_BENCH_MAX_FILES], active[CART_BENCH_MAX_FILES];
+	int n, nfiles = 0, nactive = 0;
+	uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+	FILE *fh;
+
+	// Load the data files
+	if ( (n = scandir(dir, &list, is_data_file, alphasort)) < 0 ) {
+		fprintf( stderr, "Cannot list %s: %s\n", dir, strerror(errno) );
+		return( -1 );
+	}
+	for ( int i = 0; i < n; i++ ) {
+		FILE *df;
+		struct stat st;
+		snprintf( path, sizeof(path), "%s/%s", dir, list[i]->d_name );
+		if ( nfiles < CART_BENCH_MAX_FILES && stat(path, &st) == 0 && st.st_size > 0 &&
+		     (df = fopen(path, "r")) != NULL ) {
+			data[nfiles] = malloc( st.st_size );
+			if ( data[nfiles] != NULL && fread(data[nfiles], 1, st.st_size, df) == (size_t)st.st_size ) {
+				names[nfiles] = strdup( list[i]->d_name );
+				len[nfiles] = st.st_size;
+				written[nfiles] = 0;
+				active[nactive++] = nfiles;
+				nfiles++;
+			} else {
+				free( data[nfiles] );
+			}
+			fclose( df );
+		}
+		free( list[i] );
+	}
+	free( list );
+	if ( nfiles == 0 || (fh = fopen(out, "w")) == NULL ) {
+		fprintf( stderr, "No data files in %s to build a workload from.\n", dir );
+		return( -1 );
+	}
+
+	// Grow the files in a random order until all are complete
+	while ( nactive > 0 ) {
+		int a = bench_rand(&state) % nactive, f = active[a], w = written[f];
+		int r = bench_rand(&state) % 100, chunk;
+		if ( w > 0 && r < 15 ) {                      // rewrite an earlier part
+			int off = bench_rand(&state) % w;
+			chunk = 1 + bench_rand(&state) % (w - off < CART_BENCH_CHUNK ? w - off : CART_BENCH_CHUNK);
+			emit_line( fh, names[f], "WRITEAT", chunk, off, data[f] + off );
+			emit_line( fh, names[f], "SEEK", 0, w, NULL );
+		} else if ( w > 0 && r < 25 ) {               // read an earlier part back
+			int off = bench_rand(&state) % w;
+			chunk = 1 + bench_rand(&state) % (w - off < 1000 ? w - off : 1000);
+			emit_line( fh, names[f], "SEEK", 0, off, NULL );
+			emit_line( fh, names[f], "READ", chunk, off, NULL );
+			emit_line( fh, names[f], "SEEK", 0, w, NULL );
+		} else {                                      // append
+			static const int sizes[] = { 50, 300, CART_BENCH_CHUNK };
+			int most = sizes[bench_rand(&state) % 3];
+			chunk = 1 + bench_rand(&state) % (len[f] - w < most ? len[f] - w : most);
+			emit_line( fh, names[f], "WRITE", chunk, 0, data[f] + w );
+			written[f] += chunk;
+			if ( written[f] == len[f] ) {
+				active[a] = active[--nactive];
+			}
+		}
+	}
+
+	fclose( fh );
+	for ( int i = 0; i < nfiles; i++ ) {
+		free( data[i] );
+		free( names[i] );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_now
+// Description  : Get a monotonic timestamp
+//
+// Inputs       : none
+// Outputs      : the current time in seconds
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : port_listening
+// Description  : Check whether the server port is being listened on,
+//                without connecting (the server serves the first connection)
+//
+// Inputs       : none
+// Outputs      : 1 if listening, 0 if not
+
+static int port_listening(void) {
+	char line[256];
+	unsigned int lport, state;
+	int found = 0;
+	FILE *fh = fopen( "/proc/net/tcp", "r" );
+
+	while ( fh != NULL && ! found && fgets(line, sizeof(line), fh) != NULL ) {
+		if ( sscanf(line, " %*d: %*x:%x %*x:%*x %x", &lport, &state) == 2 &&
+		     lport == CART_DEFAULT_PORT && state == 0x0A ) {         // TCP_LISTEN
+			found = 1;
+		}
+	}
+	if ( fh != NULL ) {
+		fclose( fh );
+	}
+	return( found );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_server
+// Description  : Start a cart_server and wait until it listens
+//
+// Inputs       : none
+// Outputs      : the server process id, -1 if failure
+
+static pid_t start_server(void) {
+
+	// Local variables
+	pid_t pid;
+
+	if ( (pid = fork()) == 0 ) {
+		int null = open( "/dev/null", O_WRONLY );
+		dup2( null, STDOUT_FILENO );
+		dup2( null, STDERR_FILENO );
+		execl( "./cart_server", "cart_server", (char *)NULL );
+		_exit( 127 );
+	}
+	if ( pid == -1 ) {
+		return( -1 );
+	}
+
+	for ( int tries = 0; tries < 200; tries++ ) {
+		if ( port_listening() ) {
+			return( pid );
+		}
+		if ( waitpid(pid, NULL, WNOHANG) == pid ) {
+			break;
+		}
+		usleep( 50000 );
+	}
+	kill( pid, SIGKILL );
+	waitpid( pid, NULL, 0 );
+	fprintf( stderr, "cart_server did not start on port %d.\n", CART_DEFAULT_PORT );
+	return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_bench
+// Description  : Replay a workload with one configuration.  The segment the
+//                client publishes its counters in is opened before the
+//                client starts, so the final counters can be read after it
+//                exits and removes the name.
+//
+// Inputs       : wload - the workload file
+//                r - the configuration (in) and its results (out)
+// Outputs      : 0 if the run passed, -1 if failure
+
+int run_bench(const char *wload, CartBenchResult *r) {
+
+	// Local variables
+	char cacheArg[16], name[32], logName[] = "/tmp/cart_bench.log.XXXXXX", line[1024];
+	char *args[16];
+	int sync[2], statsFd, logFd, status, nargs = 0;
+	CartStats *stats;
+	pid_t server = -1, client;
+	double start;
+	FILE *log;
+
+	snprintf( cacheArg, sizeof(cacheArg), "%d", r->cache );
+	args[nargs++] = "cart_client";
+	args[nargs++] = "-s";
+	if ( r->writeBack ) {
+		args[nargs++] = "-w";
+	}
+	args[nargs++] = "-c";
+	args[nargs++] = cacheArg;
+	args[nargs++] = "-r";
+	args[nargs++] = (char *)r->policy;
+	args[nargs++] = "-b";
+	args[nargs++] = (char *)r->backend;
+	if ( r->latency[0] != '\0' ) {
+		args[nargs++] = "-d";
+		args[nargs++] = (char *)r->latency;
+	}
+	args[nargs++] = (char *)wload;
+	args[nargs] = NULL;
+	if ( (logFd = mkstemp(logName)) == -1 || pipe(sync) == -1 ) {
+		fprintf( stderr, "Cannot set up a run: %s\n", strerror(errno) );
+		return( -1 );
+	}
+	if ( strcmp(r->backend, "net") == 0 && (server = start_server()) == -1 ) {
+		close( logFd );
+		unlink( logName );
+		return( -1 );
+	}
+
+	// Start the client, held until its statistics segment is open
+	if ( (client = fork()) == 0 ) {
+		char go;
+		close( sync[1] );
+		if ( read(sync[0], &go, 1) != 1 ) {
+			_exit( 127 );
+		}
+		dup2( logFd, STDOUT_FILENO );
+		dup2( logFd, STDERR_FILENO );
+		execv( "./cart_client", args );
+		_exit( 127 );
+	}
+	close( sync[0] );
+	snprintf( name, sizeof(name), CART_STATS_NAME, (int)client );
+	statsFd = shm_open( name, O_CREAT | O_RDWR, 0600 );
+	start = bench_now();
+	if ( write(sync[1], "g", 1) != 1 ) {
+		kill( client, SIGKILL );
+	}
+	close( sync[1] );
+	waitpid( client, &status, 0 );
+	r->seconds = bench_now() - start;
+	if ( server != -1 ) {
+		kill( server, SIGTERM );
+		waitpid( server, NULL, 0 );
+	}
+	unlink( "cart_memsys.bck" );
+
+	// Check the client validated every file, and collect its counters
+	if ( (log = fdopen(logFd, "r")) != NULL ) {
+		rewind( log );
+		while ( fgets(line, sizeof(line), log) != NULL ) {
+			if ( strstr(line, "all tests successful") != NULL ) {
+				r->ok = 1;
+			}
+			if ( verbose && ! r->ok ) {
+				fputs( line, stderr );
+			}
+		}
+		fclose( log );
+	}
+	unlink( logName );
+	stats = ( statsFd == -1 ) ? MAP_FAILED :
+		mmap( NULL, sizeof(CartStats), PROT_READ, MAP_SHARED, statsFd, 0 );
+	if ( stats != MAP_FAILED && stats->magic == CART_STATS_MAGIC && stats->version == CART_STATS_VERSION ) {
+		r->ops = stats->reads + stats->writes;
+		r->bytes = stats->bytesRead + stats->bytesWritten;
+		for ( int op = 0; op < CART_OP_MAXVAL; op++ ) {
+			r->busOps += stats->busOps[op];
+		}
+		r->loads = stats->busOps[CART_OP_LDCART];
+		r->hits = stats->cacheHits;
+		r->misses = stats->cacheMisses;
+		r->readUs[0] = cart_hist_percentile( &stats->readLatency, 50.0 ) / 1000.0;
+		r->readUs[1] = cart_hist_percentile( &stats->readLatency, 99.0 ) / 1000.0;
+		r->readUs[2] = cart_hist_percentile( &stats->readLatency, 99.9 ) / 1000.0;
+		r->writeUs[0] = cart_hist_percentile( &stats->writeLatency, 50.0 ) / 1000.0;
+		r->writeUs[1] = cart_hist_percentile( &stats->writeLatency, 99.0 ) / 1000.0;
+		r->writeUs[2] = cart_hist_percentile( &stats->writeLatency, 99.9 ) / 1000.0;
+	} else {
+		r->ok = 0;
+	}
+	if ( stats != MAP_FAILED ) {
+		munmap( stats, sizeof(CartStats) );
+	}
+	if ( statsFd != -1 ) {
+		close( statsFd );
+		shm_unlink( name );     // already gone unless the client failed
+	}
+	return( r->ok ? 0 : -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_result
+// Description  : Write one result as a JSON object on a line of its own
+//
+// Inputs       : fh - the results file
+//                r - the result
+//                last - no comma after it
+// Outputs      : none
+
+void write_result(FILE *fh, const CartBenchResult *r, int last) {
+	fprintf( fh, "  {\"workload\": \"%s\", \"cache\": %d, \"policy\": \"%s\", \"write_back\": %d, "
+		"\"backend\": \"%s\", \"latency\": \"%s\", "
+		"\"ok\": %d, \"seconds\": %.6f, \"ops\": %llu, \"bytes\": %llu, \"ops_per_s\": %.1f, "
+		"\"mb_per_s\": %.4f, \"bus_ops\": %llu, \"bus_ops_per_op\": %.4f, \"ldcart\": %llu, "
+		"\"cache_hits\": %llu, \"cache_misses\": %llu, "
+		"\"read_p50_us\": %.1f, \"read_p99_us\": %.1f, \"read_p999_us\": %.1f, "
+		"\"write_p50_us\": %.1f, \"write_p99_us\": %.1f, \"write_p999_us\": %.1f}%s\n",
+		r->workload, r->cache, r->policy, r->writeBack, r->backend, r->latency, r->ok, r->seconds,
+		(unsigned long long)r->ops, (unsigned long long)r->bytes,
+		r->seconds > 0 ? r->ops / r->seconds : 0.0,
+		r->seconds > 0 ? r->bytes / 1e6 / r->seconds : 0.0, (unsigned long long)r->busOps,
+		r->ops ? (double)r->busOps / r->ops : 0.0, (unsigned long long)r->loads,
+		(unsigned long long)r->hits, (unsigned long long)r->misses,
+		r->readUs[0], r->readUs[1], r->readUs[2], r->writeUs[0], r->writeUs[1], r->writeUs[2],
+		last ? "" : "," );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : json_number / json_string
+// Description  : Get a field of a result line written by write_result
+//
+// Inputs       : line - the line
+//                key - the field name
+//                val / buf, len - the value (output)
+// Outputs      : 0 if found, -1 if not
+
+static int json_number(const char *line, const char *key, double *val) {
+	char pattern[64];
+	snprintf( pattern, sizeof(pattern), "\"%s\": ", key );
+	const char *p = strstr( line, pattern );
+	return( (p != NULL && sscanf(p + strlen(pattern), "%lf", val) == 1) ? 0 : -1 );
+}
+
+static int json_string(const char *line, const char *key, char *buf, size_t len) {
+	char pattern[64];
+	snprintf( pattern, sizeof(pattern), "\"%s\": \"", key );
+	const char *p = strstr( line, pattern ), *end;
+	if ( p == NULL || (end = strchr(p + strlen(pattern), '"')) == NULL ) {
+		return( -1 );
+	}
+	p += strlen( pattern );
+	snprintf( buf, len, "%.*s", (int)(end - p), p );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_baseline
+// Description  : Compare every result with the same configuration and bus
+//                backend in the baseline, flagging a fall in ops/s or a
+//                rise in bus requests per operation or in p99 latency
+//                beyond the threshold
+//
+// Inputs       : baseline - the baseline results file
+//                res, n - the results of this run
+//                threshold - the change tolerated, in percent
+// Outputs      : 0 if nothing regressed, 1 if something did, -1 if the
+//                baseline is missing or has no run to compare with
+
+int compare_baseline(const char *baseline, CartBenchResult *res, int n, double threshold) {
+
+	// Local variables
+	char line[2048], wl[512], policy[32], bus[16], model[64];
+	double cache, wb, base[4], cur[4];
+	static const char *metric[4] = { "ops_per_s", "bus_ops_per_op", "read_p99_us", "write_p99_us" };
+	static const int higherIsWorse[4] = { 0, 1, 1, 1 };
+	int regressions = 0, compared = 0;
+	FILE *fh;
+
+	if ( (fh = fopen(baseline, "r")) == NULL ) {
+		fprintf( stderr, "No baseline %s to compare with (use make bench-baseline to store one).\n", baseline );
+		return( -1 );
+	}
+	while ( fgets(line, sizeof(line), fh) != NULL ) {
+		if ( json_string(line, "workload", wl, sizeof(wl)) || json_string(line, "policy", policy, sizeof(policy)) ||
+		     json_number(line, "cache", &cache) || json_number(line, "write_back", &wb) ) {
+			continue;
+		}
+		if ( json_string(line, "backend", bus, sizeof(bus)) ) {
+			strcpy( bus, "net" );       // results from before there was a choice
+		}
+		if ( json_string(line, "latency", model, sizeof(model)) ) {
+			model[0] = '\0';
+		}
+		for ( int i = 0; i < n; i++ ) {
+			CartBenchResult *r = &res[i];
+			if ( strcmp(r->workload, wl) || strcmp(r->policy, policy) || r->cache != (int)cache ||
+			     r->writeBack != (int)wb || strcmp(r->backend, bus) || strcmp(r->latency, model) ) {
+				continue;
+			}
+			cur[0] = r->seconds > 0 ? r->ops / r->seconds : 0.0;
+			cur[1] = r->ops ? (double)r->busOps / r->ops : 0.0;
+			cur[2] = r->readUs[1];
+			cur[3] = r->writeUs[1];
+			compared++;
+			for ( int m = 0; m < 4; m++ ) {
+				if ( json_number(line, metric[m], &base[m]) || base[m] <= 0 ) {
+					continue;
+				}
+				double change = 100.0 * (cur[m] - base[m]) / base[m];
+				if ( (higherIsWorse[m] && change > threshold) || (!higherIsWorse[m] && -change > threshold) ) {
+					printf( "REGRESSION %s cache %d %s%s: %s %.3f -> %.3f (%+.1f%%)\n", wl, r->cache,
+						policy, r->writeBack ? " write-back" : "", metric[m], base[m], cur[m], change );
+					regressions++;
+				}
+			}
+		}
+	}
+	fclose( fh );
+	if ( compared == 0 ) {
+		fprintf( stderr, "No run in baseline %s matches this sweep (use make bench-baseline to store one).\n",
+			baseline );
+		return( -1 );
+	}
+	printf( "Compared %d runs with %s: %d regressions beyond %.0f%%.\n", compared, baseline,
+		regressions, threshold );
+	return( regressions ? 1 : 0 );
+}
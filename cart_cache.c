@@ -10,25 +10,668 @@
 
 // Includes
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 // Project includes
 #include "cart_cache.h"
+#include "cart_stats.h"
 #include "cmpsc311_log.h"
 
 // Defines
+#define CART_CACHE_NO_ENTRY -1                  // end marker for index links
+#define CART_CACHE_LISTS 2                      // lists a replacement policy may use
+#define CART_CACHE_ALIGN 64                     // alignment of the frame slab (a cache line)
+#define CART_CACHE_FLUSH_BATCH 256              // dirty frames written back in one batch
+
+// Policy list numbers (2Q: A1in/Am and A1out; ARC: T1/T2 and B1/B2)
+#define CART_2Q_A1IN 0
+#define CART_2Q_AM   1
+#define CART_ARC_T1  0
+#define CART_ARC_T2  1
+
+struct cacheList {
+    int head;       //most recently inserted or used entry
+    int tail;       //next candidate for replacement
+    int count;      //number of entries on the list
+};
+
 int cacheSize = DEFAULT_CART_FRAME_CACHE_SIZE*2;
-int current;        //current size of cache
-struct elem{
+int current;        //entries handed out so far, the rest were never used
+struct key{         //what the hash chains walk, kept apart from everything else
+    int memCart;
+    int memFrm;
+    int hnext;      //next entry in the same hash bucket
+};
+struct elem{        //replacement and write-back state of an entry
+    int list;       //policy list holding the entry, CART_CACHE_NO_ENTRY if none
+    int prev;       //more recently used neighbour in its list
+    int next;       //less recently used neighbour in its list, or next free entry
+    int ref;        //used since the clock hand last passed it (CLOCK)
+    int dirty;      //frame modified since it was last written to the device
+    int prefetched; //frame brought in by read-ahead and not used yet
+    int pins;       //outstanding pins, a pinned frame is never evicted
+    int flushing;   //being written back, with a pin and without the cache lock
+    int redirtied;  //modified again while being written back
+    int dprev;      //more recently dirtied neighbour in the dirty list
+    int dnext;      //less recently dirtied neighbour in the dirty list
+    uint64_t dirtyTime; //when the frame became dirty (ms)
+};
+struct ghost{       //a recently evicted frame, remembered by 2Q and ARC
     int memCart;
     int memFrm;
-    int time;
-    char memContent[CART_FRAME_SIZE];
+    int list;       //ghost list holding it
+    int prev;       //more recently evicted neighbour in its list
+    int next;       //less recently evicted neighbour in its list, or next free ghost
+    int hnext;      //next ghost in the same hash bucket
 };
-struct elem *cache;
+typedef struct {
+    const char *name;
+    void (*admit)(int cart, int frm);   //a missing frame is about to be inserted
+    int (*victim)(void);                //pick an unpinned entry to replace
+    void (*insert)(int i);              //entry i now holds the admitted frame
+    void (*hit)(int i);                 //entry i was used
+    void (*remove)(int i, int evicted); //entry i leaves the cache
+} CartCachePolicyOps;
+struct key *keys = NULL;        //frame identity of each entry
+struct elem *cache = NULL;      //state of each entry
+char *slab = NULL;              //frame contents, entry i at i * CART_FRAME_SIZE
+int *buckets = NULL;    //hash table of (cart, frame) -> entry index
+int bucketMask;         //number of buckets minus one (power of two)
+struct cacheList lists[CART_CACHE_LISTS];   //resident entries, as the policy orders them
+int freeHead;           //entries holding no frame, reused before any replacement
+struct ghost *ghosts = NULL;    //history of evicted frames (2Q, ARC)
+int *ghostBuckets = NULL;       //hash table of (cart, frame) -> ghost index
+struct cacheList ghostLists[CART_CACHE_LISTS];
+int ghostFree;          //unused ghosts
+int clockHand;          //next entry the CLOCK hand looks at
+int arcTarget;          //ARC's adaptive target size of T1
+int pendingList;        //list the frame being admitted goes on
+int pendingFromB2;      //the frame being admitted was in ARC's B2
+int dirtyHead;          //most recently dirtied entry
+int dirtyTail;          //oldest dirty entry
+uint32_t dirtyCount;    //number of dirty entries
+uint32_t flushingCount; //number of dirty entries being written back
+CartCacheWriteback writeback = NULL;    //writes dirty frames to the device
+uint64_t hitsBase = 0;          //cartStats->cacheHits when the cache was initialized
+uint64_t missesBase = 0;        //cartStats->cacheMisses when the cache was initialized
+uint64_t prefetchHits = 0;      //prefetched frames used before eviction
+uint64_t prefetchEvicted = 0;   //prefetched frames evicted unused
+uint64_t prefetchResident = 0;  //prefetched frames in the cache, not used yet
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;  //held by every lookup and update
+pthread_cond_t unpinCond = PTHREAD_COND_INITIALIZER;    //signalled when a frame becomes unpinned
+int unpinWaiters = 0;   //threads waiting for a frame to be unpinned
+pthread_cond_t flushedCond = PTHREAD_COND_INITIALIZER;  //signalled when a write-back batch completes
+CartCachePolicy policyKind = CART_CACHE_LRU;            //chosen with set_cart_cache_policy
+static const CartCachePolicyOps *policy;                //replacement policy in use
 
 // Functions
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_frame
+// Description  : Get the contents of an entry in the frame slab
+//
+// Inputs       : i - the entry index
+// Outputs      : pointer to the frame
+
+static inline char *cache_frame(int i) {
+    return slab + (size_t)i * CART_FRAME_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_hash
+// Description  : Compute the hash bucket of a (cartridge, frame) pair
+//
+// Inputs       : cart - the cartridge number
+//                frm - the frame number
+// Outputs      : the bucket index
+
+static int cache_hash(int cart, int frm) {
+    uint32_t key = (uint32_t)cart * CART_CARTRIDGE_SIZE + (uint32_t)frm;
+    return (int)((key * 2654435761u) >> 7) & bucketMask;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_lookup
+// Description  : Find the entry holding a (cartridge, frame) pair
+//
+// Inputs       : cart - the cartridge number
+//                frm - the frame number
+// Outputs      : the entry index, or CART_CACHE_NO_ENTRY if not cached
+
+static int cache_lookup(int cart, int frm) {
+    for (int i = buckets[cache_hash(cart, frm)]; i != CART_CACHE_NO_ENTRY; i = keys[i].hnext) {
+        if (keys[i].memCart == cart && keys[i].memFrm == frm)
+            return i;
+    }
+    return CART_CACHE_NO_ENTRY;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unlink / cache_push_front
+// Description  : Remove an entry from its policy list / make it the most
+//                recently used entry of a list
+//
+// Inputs       : i - the entry index
+//                list - the list to add it to
+// Outputs      : none
+
+static void cache_unlink(int i) {
+    if (cache[i].list == CART_CACHE_NO_ENTRY)
+        return;
+    struct cacheList *l = &lists[cache[i].list];
+    if (cache[i].prev != CART_CACHE_NO_ENTRY)
+        cache[cache[i].prev].next = cache[i].next;
+    else
+        l->head = cache[i].next;
+    if (cache[i].next != CART_CACHE_NO_ENTRY)
+        cache[cache[i].next].prev = cache[i].prev;
+    else
+        l->tail = cache[i].prev;
+    l->count--;
+    cache[i].list = CART_CACHE_NO_ENTRY;
+}
+
+static void cache_push_front(int i, int list) {
+    struct cacheList *l = &lists[list];
+    cache[i].list = list;
+    cache[i].prev = CART_CACHE_NO_ENTRY;
+    cache[i].next = l->head;
+    if (l->head != CART_CACHE_NO_ENTRY)
+        cache[l->head].prev = i;
+    l->head = i;
+    if (l->tail == CART_CACHE_NO_ENTRY)
+        l->tail = i;
+    l->count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_tail_unpinned
+// Description  : Find the least recently used unpinned entry of a list
+//
+// Inputs       : list - the list to search
+// Outputs      : the entry index, or CART_CACHE_NO_ENTRY if there is none
+
+static int cache_tail_unpinned(int list) {
+    int i;
+    for (i = lists[list].tail; i != CART_CACHE_NO_ENTRY && cache[i].pins > 0; i = cache[i].prev)
+        ;
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_lookup
+// Description  : Find the ghost of a recently evicted (cartridge, frame) pair
+//
+// Inputs       : cart - the cartridge number
+//                frm - the frame number
+// Outputs      : the ghost index, or CART_CACHE_NO_ENTRY if not remembered
+
+static int ghost_lookup(int cart, int frm) {
+    for (int g = ghostBuckets[cache_hash(cart, frm)]; g != CART_CACHE_NO_ENTRY; g = ghosts[g].hnext) {
+        if (ghosts[g].memCart == cart && ghosts[g].memFrm == frm)
+            return g;
+    }
+    return CART_CACHE_NO_ENTRY;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_remove
+// Description  : Forget a ghost and return it to the free ghosts
+//
+// Inputs       : g - the ghost index
+// Outputs      : none
+
+static void ghost_remove(int g) {
+    struct cacheList *l = &ghostLists[ghosts[g].list];
+    if (ghosts[g].prev != CART_CACHE_NO_ENTRY)
+        ghosts[ghosts[g].prev].next = ghosts[g].next;
+    else
+        l->head = ghosts[g].next;
+    if (ghosts[g].next != CART_CACHE_NO_ENTRY)
+        ghosts[ghosts[g].next].prev = ghosts[g].prev;
+    else
+        l->tail = ghosts[g].prev;
+    l->count--;
+    
+    int *link = &ghostBuckets[cache_hash(ghosts[g].memCart, ghosts[g].memFrm)];
+    while (*link != g)
+        link = &ghosts[*link].hnext;
+    *link = ghosts[g].hnext;
+    
+    ghosts[g].next = ghostFree;
+    ghostFree = g;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_drop_oldest
+// Description  : Forget the least recently evicted ghost of a list
+//
+// Inputs       : list - the ghost list
+// Outputs      : none
+
+static void ghost_drop_oldest(int list) {
+    if (ghostLists[list].tail != CART_CACHE_NO_ENTRY)
+        ghost_remove(ghostLists[list].tail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_add
+// Description  : Remember an evicted frame at the head of a ghost list; if
+//                every ghost is in use the oldest one of that list (or of
+//                the other list) is forgotten
+//
+// Inputs       : list - the ghost list
+//                i - the entry being evicted
+// Outputs      : none
+
+static void ghost_add(int list, int i) {
+    if (ghostFree == CART_CACHE_NO_ENTRY)
+        ghost_drop_oldest(ghostLists[list].count > 0 ? list : !list);
+    int g = ghostFree;
+    ghostFree = ghosts[g].next;
+    
+    int b = cache_hash(keys[i].memCart, keys[i].memFrm);
+    ghosts[g].memCart = keys[i].memCart;
+    ghosts[g].memFrm = keys[i].memFrm;
+    ghosts[g].hnext = ghostBuckets[b];
+    ghostBuckets[b] = g;
+    
+    struct cacheList *l = &ghostLists[list];
+    ghosts[g].list = list;
+    ghosts[g].prev = CART_CACHE_NO_ENTRY;
+    ghosts[g].next = l->head;
+    if (l->head != CART_CACHE_NO_ENTRY)
+        ghosts[l->head].prev = g;
+    l->head = g;
+    if (l->tail == CART_CACHE_NO_ENTRY)
+        l->tail = g;
+    l->count++;
+}
+
+//
+// Replacement policies
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_admit / lru_victim / lru_insert / lru_hit / lru_remove
+// Description  : LRU: one list, used frames move to the front and the back
+//                is replaced.  lru_insert, lru_hit and lru_remove are also
+//                used by 2Q and ARC for their lists.
+//
+// Inputs       : cart, frm - the frame being admitted
+//                i - the entry index
+//                evicted - the entry is being replaced (not dropped)
+// Outputs      : lru_victim returns the entry index, or CART_CACHE_NO_ENTRY
+
+static void lru_admit(int cart, int frm) {
+    pendingList = 0;
+}
+
+static int lru_victim(void) {
+    return cache_tail_unpinned(0);
+}
+
+static void lru_insert(int i) {
+    cache_push_front(i, pendingList);
+}
+
+static void lru_hit(int i) {
+    int list = cache[i].list;
+    if (i != lists[list].head) {
+        cache_unlink(i);
+        cache_push_front(i, list);
+    }
+}
+
+static void lru_remove(int i, int evicted) {
+    cache_unlink(i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_victim / clock_insert / clock_hit / clock_remove
+// Description  : CLOCK: entries are kept in array order and a hit only sets
+//                a reference bit; the hand clears set bits as it sweeps and
+//                replaces the first unreferenced entry.  A new frame starts
+//                unreferenced, so it gets its second chance only once used.
+//
+// Inputs       : i - the entry index
+//                evicted - the entry is being replaced (not dropped)
+// Outputs      : clock_victim returns the entry index, or CART_CACHE_NO_ENTRY
+
+static int clock_victim(void) {
+    for (int n = 0; n < 2 * current; n++) {
+        int i = clockHand;
+        clockHand = (clockHand + 1) % current;
+        if (keys[i].memCart == -1 || cache[i].pins > 0)
+            continue;
+        if (cache[i].ref) {
+            cache[i].ref = 0;
+            continue;
+        }
+        return i;
+    }
+    return CART_CACHE_NO_ENTRY;
+}
+
+static void clock_insert(int i) {
+    cache[i].ref = 0;
+}
+
+static void clock_hit(int i) {
+    cache[i].ref = 1;
+}
+
+static void clock_remove(int i, int evicted) {
+    cache[i].ref = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : twoq_admit / twoq_victim / twoq_hit / twoq_remove
+// Description  : 2Q: new frames enter the A1in FIFO (a quarter of the cache)
+//                and only a frame seen again after leaving it, i.e. found in
+//                the A1out history (half the cache), enters the Am LRU list,
+//                so a scan passes through A1in without touching Am
+//
+// Inputs       : cart, frm - the frame being admitted
+//                i - the entry index
+//                evicted - the entry is being replaced (not dropped)
+// Outputs      : twoq_victim returns the entry index, or CART_CACHE_NO_ENTRY
+
+static void twoq_admit(int cart, int frm) {
+    int g = ghost_lookup(cart, frm);
+    pendingList = CART_2Q_A1IN;
+    if (g != CART_CACHE_NO_ENTRY) {
+        ghost_remove(g);
+        pendingList = CART_2Q_AM;
+    }
+}
+
+static int twoq_victim(void) {
+    int kin = (cacheSize / 4 > 0) ? cacheSize / 4 : 1;
+    int first = (lists[CART_2Q_A1IN].count > kin) ? CART_2Q_A1IN : CART_2Q_AM;
+    int i = cache_tail_unpinned(first);
+    return (i != CART_CACHE_NO_ENTRY) ? i : cache_tail_unpinned(!first);
+}
+
+static void twoq_hit(int i) {
+    if (cache[i].list == CART_2Q_AM)    //A1in stays FIFO, correlated reuse is not promoted
+        lru_hit(i);
+}
+
+static void twoq_remove(int i, int evicted) {
+    int kout = (cacheSize / 2 > 0) ? cacheSize / 2 : 1;
+    if (evicted && cache[i].list == CART_2Q_A1IN) {
+        if (ghostLists[0].count >= kout)
+            ghost_drop_oldest(0);
+        ghost_add(0, i);
+    }
+    cache_unlink(i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_admit / arc_victim / arc_hit / arc_remove
+// Description  : ARC: T1 holds frames seen once and T2 frames seen again,
+//                with ghost lists B1/B2 of frames evicted from each; a miss
+//                found in B1 (B2) grows (shrinks) the target size of T1, and
+//                the victim is taken from T1 while it is above the target
+//
+// Inputs       : cart, frm - the frame being admitted
+//                i - the entry index
+//                evicted - the entry is being replaced (not dropped)
+// Outputs      : arc_victim returns the entry index, or CART_CACHE_NO_ENTRY
+
+static void arc_admit(int cart, int frm) {
+    int g = ghost_lookup(cart, frm);
+    int b1 = ghostLists[CART_ARC_T1].count, b2 = ghostLists[CART_ARC_T2].count;
+    
+    pendingList = CART_ARC_T2;
+    pendingFromB2 = 0;
+    if (g != CART_CACHE_NO_ENTRY && ghosts[g].list == CART_ARC_T1) {
+        arcTarget += (b2 > b1) ? b2 / b1 : 1;
+        if (arcTarget > cacheSize)
+            arcTarget = cacheSize;
+        ghost_remove(g);
+    } else if (g != CART_CACHE_NO_ENTRY) {
+        arcTarget -= (b1 > b2) ? b1 / b2 : 1;
+        if (arcTarget < 0)
+            arcTarget = 0;
+        ghost_remove(g);
+        pendingFromB2 = 1;
+    } else {
+        pendingList = CART_ARC_T1;
+        if (lists[CART_ARC_T1].count + b1 >= cacheSize)
+            ghost_drop_oldest(CART_ARC_T1);
+        else if (lists[CART_ARC_T1].count + lists[CART_ARC_T2].count + b1 + b2 >= 2 * cacheSize)
+            ghost_drop_oldest(CART_ARC_T2);
+    }
+}
+
+static int arc_victim(void) {
+    int t1 = lists[CART_ARC_T1].count;
+    int first = (t1 > 0 && (t1 > arcTarget || (pendingFromB2 && t1 == arcTarget))) ?
+                CART_ARC_T1 : CART_ARC_T2;
+    int i = cache_tail_unpinned(first);
+    return (i != CART_CACHE_NO_ENTRY) ? i : cache_tail_unpinned(!first);
+}
+
+static void arc_hit(int i) {
+    cache_unlink(i);
+    cache_push_front(i, CART_ARC_T2);
+}
+
+static void arc_remove(int i, int evicted) {
+    if (evicted)
+        ghost_add(cache[i].list, i);    //T1 -> B1, T2 -> B2
+    cache_unlink(i);
+}
+
+static const CartCachePolicyOps cachePolicies[] = {
+    [CART_CACHE_LRU]   = { "lru",   lru_admit,  lru_victim,   lru_insert,   lru_hit,   lru_remove },
+    [CART_CACHE_CLOCK] = { "clock", lru_admit,  clock_victim, clock_insert, clock_hit, clock_remove },
+    [CART_CACHE_2Q]    = { "2q",    twoq_admit, twoq_victim,  lru_insert,   twoq_hit,  twoq_remove },
+    [CART_CACHE_ARC]   = { "arc",   arc_admit,  arc_victim,   lru_insert,   arc_hit,   arc_remove },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_unhash
+// Description  : Remove an entry from its hash bucket chain
+//
+// Inputs       : i - the entry index
+// Outputs      : none
+
+static void cache_unhash(int i) {
+    int *link = &buckets[cache_hash(keys[i].memCart, keys[i].memFrm)];
+    while (*link != i)
+        link = &keys[*link].hnext;
+    *link = keys[i].hnext;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_now_ms
+// Description  : Get a monotonic timestamp for dirty frame ageing
+//
+// Inputs       : none
+// Outputs      : the current time in milliseconds
+
+static uint64_t cache_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_mark_dirty / cache_mark_clean
+// Description  : Add an entry to / remove an entry from the dirty list
+//
+// Inputs       : i - the entry index
+// Outputs      : none
+
+static void cache_mark_dirty(int i) {
+    if (cache[i].dirty) {
+        if (cache[i].flushing)
+            cache[i].redirtied = 1;
+        return;
+    }
+    cache[i].dirty = 1;
+    cache[i].dirtyTime = cache_now_ms();
+    cache[i].dprev = CART_CACHE_NO_ENTRY;
+    cache[i].dnext = dirtyHead;
+    if (dirtyHead != CART_CACHE_NO_ENTRY)
+        cache[dirtyHead].dprev = i;
+    dirtyHead = i;
+    if (dirtyTail == CART_CACHE_NO_ENTRY)
+        dirtyTail = i;
+    dirtyCount++;
+}
+
+static void cache_mark_clean(int i) {
+    if (!cache[i].dirty)
+        return;
+    if (cache[i].dprev != CART_CACHE_NO_ENTRY)
+        cache[cache[i].dprev].dnext = cache[i].dnext;
+    else
+        dirtyHead = cache[i].dnext;
+    if (cache[i].dnext != CART_CACHE_NO_ENTRY)
+        cache[cache[i].dnext].dprev = cache[i].dprev;
+    else
+        dirtyTail = cache[i].dprev;
+    cache[i].dirty = 0;
+    dirtyCount--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flush_begin / cache_flush_cmp
+// Description  : Pin a dirty entry for a write-back batch / order the
+//                entries of a batch by cartridge and frame
+//
+// Inputs       : i - the entry index / a, b - pointers to entry indexes
+// Outputs      : none / the comparison
+
+static void cache_flush_begin(int i) {
+    cache[i].pins++;
+    cache[i].flushing = 1;
+    cache[i].redirtied = 0;
+    flushingCount++;
+}
+
+static int cache_flush_cmp(const void *a, const void *b) {
+    const struct key *x = &keys[*(const int *)a], *y = &keys[*(const int *)b];
+    if (x->memCart != y->memCart)
+        return x->memCart - y->memCart;
+    return x->memFrm - y->memFrm;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flush_run
+// Description  : Write a batch of entries pinned by cache_flush_begin to
+//                the device in one call, with the cache lock dropped, then
+//                unpin them and mark clean those not modified meanwhile
+//                (called with the cache lock held)
+//
+// Inputs       : idx - the entry indexes
+//                n - the number of entries
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_flush_run(int *idx, int n) {
+    CartCacheFrameRef refs[CART_CACHE_FLUSH_BATCH];
+    int ret = 0;
+    
+    qsort(idx, n, sizeof(int), cache_flush_cmp);
+    for (int k = 0; k < n; k++) {
+        refs[k].cart = keys[idx[k]].memCart;
+        refs[k].frm = keys[idx[k]].memFrm;
+        refs[k].frame = cache_frame(idx[k]);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    if (writeback == NULL || writeback(refs, n)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to write back %d cached frames from [%d/%d].",
+                   n, refs[0].cart, refs[0].frm);
+        ret = -1;
+    }
+    pthread_mutex_lock(&cacheLock);
+    
+    for (int k = 0; k < n; k++) {
+        int i = idx[k];
+        cache[i].pins--;
+        cache[i].flushing = 0;
+        flushingCount--;
+        if (ret == 0) {
+            cache_mark_clean(i);
+            if (cache[i].redirtied)         //dirty again, as of now
+                cache_mark_dirty(i);
+            else
+                CART_STAT_INC(cacheWritebacks);
+        }
+        if (cache[i].pins == 0 && unpinWaiters > 0)
+            pthread_cond_broadcast(&unpinCond);
+    }
+    pthread_cond_broadcast(&flushedCond);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_reset
+// Description  : Empty the hash tables, the policy lists and the history
+//
+// Inputs       : none
+// Outputs      : none
+
+static void cache_reset(void) {
+    for (int i = 0; i <= bucketMask; i++)
+        buckets[i] = ghostBuckets[i] = CART_CACHE_NO_ENTRY;
+    for (int i = 0; i < cacheSize; i++) {
+        keys[i].memCart = -1;
+        keys[i].memFrm = -1;
+        keys[i].hnext = CART_CACHE_NO_ENTRY;
+        cache[i].list = CART_CACHE_NO_ENTRY;
+        cache[i].prev = cache[i].next = CART_CACHE_NO_ENTRY;
+        cache[i].ref = 0;
+        cache[i].dirty = 0;
+        cache[i].prefetched = 0;
+        cache[i].pins = 0;
+        cache[i].flushing = cache[i].redirtied = 0;
+        cache[i].dprev = cache[i].dnext = CART_CACHE_NO_ENTRY;
+    }
+    prefetchEvicted += prefetchResident;
+    prefetchResident = 0;
+    for (int l = 0; l < CART_CACHE_LISTS; l++) {
+        lists[l].head = lists[l].tail = CART_CACHE_NO_ENTRY;
+        lists[l].count = 0;
+        ghostLists[l].head = ghostLists[l].tail = CART_CACHE_NO_ENTRY;
+        ghostLists[l].count = 0;
+    }
+    for (int g = 0; g < cacheSize; g++)
+        ghosts[g].next = (g + 1 < cacheSize) ? g + 1 : CART_CACHE_NO_ENTRY;
+    ghostFree = 0;
+    freeHead = CART_CACHE_NO_ENTRY;
+    clockHand = 0;
+    arcTarget = 0;
+    dirtyHead = dirtyTail = CART_CACHE_NO_ENTRY;
+    dirtyCount = flushingCount = 0;
+    current = 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : set_cart_cache_size
@@ -38,10 +681,48 @@ struct elem *cache;
 // Outputs      : 0 if successful, -1 if failure
 
 int set_cart_cache_size(uint32_t max_frames) {
+    if (max_frames == 0) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid cache size.");
+        return -1;
+    }
     cacheSize = max_frames;
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_policy
+// Description  : Set the replacement policy of the cache (must be called
+//                before init)
+//
+// Inputs       : kind - CART_CACHE_LRU, _CLOCK, _2Q or _ARC
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_policy(CartCachePolicy kind) {
+    if (kind < CART_CACHE_LRU || kind > CART_CACHE_ARC) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid cache replacement policy.");
+        return -1;
+    }
+    policyKind = kind;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parse_cart_cache_policy
+// Description  : Find the replacement policy with a given name
+//
+// Inputs       : name - "lru", "clock", "2q" or "arc"
+// Outputs      : the policy, or -1 if the name is unknown
+
+int parse_cart_cache_policy(const char *name) {
+    for (int k = CART_CACHE_LRU; k <= CART_CACHE_ARC; k++) {
+        if (strcmp(name, cachePolicies[k].name) == 0)
+            return k;
+    }
+    return -1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : init_cart_cache
@@ -52,13 +733,29 @@ int set_cart_cache_size(uint32_t max_frames) {
 
 int init_cart_cache(void) {
     
+    int nbuckets = 1;
+    while (nbuckets < cacheSize * 2)        //keep chains short, load <= 0.5
+        nbuckets <<= 1;
+    
+    close_cart_cache();
+    keys = (struct key *) calloc(cacheSize, sizeof(struct key));
     cache = (struct elem *) calloc(cacheSize, sizeof(struct elem));
-    for (int i = 0; i < cacheSize; i++) {
-        cache[i].memCart = -1;
-        cache[i].memFrm = -1;
-        cache[i].time = 0;
+    slab = (char *) aligned_alloc(CART_CACHE_ALIGN, (size_t)cacheSize * CART_FRAME_SIZE);
+    buckets = (int *) malloc(nbuckets * sizeof(int));
+    ghosts = (struct ghost *) calloc(cacheSize, sizeof(struct ghost));
+    ghostBuckets = (int *) malloc(nbuckets * sizeof(int));
+    if (keys == NULL || cache == NULL || slab == NULL || buckets == NULL ||
+        ghosts == NULL || ghostBuckets == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to allocate the frame cache.");
+        close_cart_cache();
+        return -1;
     }
-    current = 0;
+    bucketMask = nbuckets - 1;
+    policy = &cachePolicies[policyKind];
+    hitsBase = cartStats->cacheHits;
+    missesBase = cartStats->cacheMisses;
+    prefetchHits = prefetchEvicted = prefetchResident = 0;
+    cache_reset();
     return 0;
 }
 
@@ -72,16 +769,179 @@ int init_cart_cache(void) {
 
 int close_cart_cache(void) {
     
-    for (int i = 0; i < cacheSize; i++) {
-        cache[i].memCart = -1;
-        cache[i].memFrm = -1;
-        cache[i].time = 0;
-        memset(cache[i].memContent, '\0', sizeof(cache[i].memContent));
-    }
+    free(keys);
+    free(cache);
+    free(slab);
+    free(buckets);
+    free(ghosts);
+    free(ghostBuckets);
+    keys = NULL;
+    cache = NULL;
+    slab = NULL;
+    buckets = NULL;
+    ghosts = NULL;
+    ghostBuckets = NULL;
+    current = 0;
+    dirtyCount = flushingCount = 0;
+    
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scrub_cart_cache
+// Description  : Zero the contents of every cached frame
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int scrub_cart_cache(void) {
+    
+    if (cache == NULL)
+        return 0;
+    memset(slab, '\0', (size_t)current * CART_FRAME_SIZE);
+    cache_reset();
     
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_use
+// Description  : Note that a prefetched entry has been used
+//
+// Inputs       : i - the entry index
+// Outputs      : none
+
+static void cache_use(int i) {
+    if (cache[i].prefetched) {
+        cache[i].prefetched = 0;
+        prefetchResident--;
+        prefetchHits++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_forget
+// Description  : Drop an entry's frame identity (the policy must have
+//                removed it already)
+//
+// Inputs       : i - the entry index
+// Outputs      : none
+
+static void cache_forget(int i) {
+    if (keys[i].memCart != -1)
+        cache_unhash(i);
+    cache_mark_clean(i);
+    if (cache[i].prefetched) {
+        cache[i].prefetched = 0;
+        prefetchResident--;
+        prefetchEvicted++;
+    }
+    keys[i].memCart = -1;
+    keys[i].memFrm = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_release
+// Description  : Take an entry out of the cache without replacing it, so
+//                it is reused before any other entry is replaced
+//
+// Inputs       : i - the entry index
+// Outputs      : none
+
+static void cache_release(int i) {
+    policy->remove(i, 0);
+    cache_forget(i);
+    cache[i].next = freeHead;
+    freeHead = i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_slot
+// Description  : Find the entry of a frame, or make room for it in a free
+//                entry or by replacing the policy's victim (a dirty victim
+//                is written back with the lock dropped, then everything is
+//                looked at again); if every entry is pinned, wait for
+//                another thread to unpin one and look again
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+// Outputs      : the entry index if successful, -1 if failure
+
+static int cache_slot(CartridgeIndex cart, CartFrameIndex frm) {
+    
+    int i, admitted = 0;
+    
+    for (;;) {
+        if ((i = cache_lookup(cart, frm)) != CART_CACHE_NO_ENTRY) {    //already cached, update
+            CART_STAT_INC(cacheHits);
+            policy->hit(i);
+            return i;
+        }
+        if (!admitted) {
+            policy->admit(cart, frm);
+            admitted = 1;
+        }
+        if (freeHead != CART_CACHE_NO_ENTRY) {     //reuse a dropped entry
+            i = freeHead;
+            freeHead = cache[i].next;
+            break;
+        }
+        if (current < cacheSize) {                  //not full, just insert
+            i = current++;
+            break;
+        }
+        if ((i = policy->victim()) != CART_CACHE_NO_ENTRY) {   //full, replace
+            if (cache[i].dirty) {
+                cache_flush_begin(i);
+                if (cache_flush_run(&i, 1))
+                    return -1;
+                continue;
+            }
+            policy->remove(i, 1);
+            cache_forget(i);
+            CART_STAT_INC(cacheEvictions);
+            break;
+        }
+        unpinWaiters++;
+        pthread_cond_wait(&unpinCond, &cacheLock);
+        unpinWaiters--;
+    }
+    
+    int b = cache_hash(cart, frm);
+    keys[i].memCart = cart;
+    keys[i].memFrm = frm;
+    keys[i].hnext = buckets[b];
+    buckets[b] = i;
+    policy->insert(i);
+    CART_STAT_INC(cacheInsertions);
+    CART_STAT_INC(cacheMisses);
+    
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_insert
+// Description  : Find or make room for a frame and copy the buffer into it
+//
+// Inputs       : cart - the cartridge number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : the entry index if successful, -1 if failure
+
+static int cache_insert(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
+    
+    int i = cache_slot(cart, frm);
+    if (i != -1)
+        memcpy(cache_frame(i), buf, CART_FRAME_SIZE);
+    return i;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : put_cart_cache
@@ -94,43 +954,77 @@ int close_cart_cache(void) {
 
 int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
     
-    for (int i = 0; i < current; i++)
-        cache[i].time++;
+    pthread_mutex_lock(&cacheLock);
+    int i = cache_insert(cart, frm, buf);
+    if (i != -1)
+        cache_mark_clean(i);        //contents match the device
+    pthread_mutex_unlock(&cacheLock);
     
-    //if already in the cache, update
-    for (int i = 0; i < cacheSize; i++) {
-        if (cache[i].memCart == cart && cache[i].memFrm == frm) {
-            memcpy(cache[i].memContent, buf, CART_FRAME_SIZE);
-            cache[i].time = 0;
-            return 0;
-        }
-    }
+    return (i == -1) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_cart_cache_dirty
+// Description  : Put a modified frame into the cache, to be written back to
+//                the device when evicted or flushed
+//
+// Inputs       : cart - the cartridge number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int put_cart_cache_dirty(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
     
-    //else insert
-    if (current == cacheSize) {         //if full, find LRU, replace
-        int max = cache[0].time;
-        int maxIndex = 0;
-        for (int i = 1; i < cacheSize; i++){
-            if (max < cache[i].time){
-                max = cache[i].time;
-                maxIndex = i;
-            }
-        }
-        cache[maxIndex].memCart = cart;
-        cache[maxIndex].memFrm = frm;
-        cache[maxIndex].time = 0;
-        memcpy(cache[maxIndex].memContent, buf, CART_FRAME_SIZE);
-        
-        
-    }else{                              //not full, just insert
-        
-        cache[current].memCart = cart;
-        cache[current].memFrm = frm;
-        memcpy(cache[current].memContent, buf, CART_FRAME_SIZE);
-        current++;
+    pthread_mutex_lock(&cacheLock);
+    int i = cache_insert(cart, frm, buf);
+    if (i != -1)
+        cache_mark_dirty(i);
+    pthread_mutex_unlock(&cacheLock);
+    
+    return (i == -1) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_cart_cache_prefetch
+// Description  : Put a frame fetched by read-ahead into the cache, counting
+//                whether it is used before it is evicted
+//
+// Inputs       : cart - the cartridge number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int put_cart_cache_prefetch(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
+    
+    int i = 0;
+    pthread_mutex_lock(&cacheLock);
+    //never replace a resident (maybe dirty) frame
+    if (cache_lookup(cart, frm) == CART_CACHE_NO_ENTRY && (i = cache_insert(cart, frm, buf)) != -1) {
+        cache[i].prefetched = 1;
+        prefetchResident++;
+        CART_STAT_SUB(cacheMisses, 1);      //not a demand miss
     }
+    pthread_mutex_unlock(&cacheLock);
     
-    return 0;
+    return (i == -1) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : has_cart_cache
+// Description  : Check whether a frame is cached, without using it
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+// Outputs      : 1 if the frame is cached, 0 if not
+
+int has_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+    pthread_mutex_lock(&cacheLock);
+    int found = cache_lookup(cart, frm) != CART_CACHE_NO_ENTRY;
+    pthread_mutex_unlock(&cacheLock);
+    return found;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -140,28 +1034,296 @@ int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
 //
 // Inputs       : cart - the cartridge number of the cartridge to find
 //                frm - the number of the frame to find
-// Outputs      : pointer to cached frame or NULL if not found
+// Outputs      : pointer to cached frame or NULL if not found (only valid
+//                until the next cache update, see pin_cart_cache)
 
 void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
     
-    for (int i = 0; i < current; i++)
-        cache[i].time++;
+    pthread_mutex_lock(&cacheLock);
+    int i = cache_lookup(cart, frm);
+    if (i != CART_CACHE_NO_ENTRY) {
+        CART_STAT_INC(cacheHits);
+        cache_use(i);
+        policy->hit(i);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return (i == CART_CACHE_NO_ENTRY) ? NULL : cache_frame(i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pin_cart_cache
+// Description  : Get a pointer to a cached frame and pin it, so it stays in
+//                place until unpinned.  If created is not NULL a missing
+//                frame gets a new entry whose contents the caller must fill
+//                in (*created is set to 1), otherwise NULL is returned.
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+//                created - set to 1 if a new entry was made (may be NULL)
+// Outputs      : pointer to the cached frame, NULL if not cached or failure
+
+void * pin_cart_cache(CartridgeIndex cart, CartFrameIndex frm, int *created) {
     
-    for (int i = 0; i < current; i++) {
-        
-        if (cache[i].memCart == cart && cache[i].memFrm == frm) {
-            cache[i].time = 0;
-            return cache[i].memContent;
+    void *frame = NULL;
+    pthread_mutex_lock(&cacheLock);
+    int i = cache_lookup(cart, frm);
+    if (i == CART_CACHE_NO_ENTRY) {
+        if (created != NULL && (i = cache_slot(cart, frm)) != -1)
+            *created = 1;
+    } else {
+        if (created != NULL)
+            *created = 0;
+        CART_STAT_INC(cacheHits);
+        cache_use(i);
+        policy->hit(i);
+    }
+    if (i >= 0) {
+        cache[i].pins++;
+        frame = cache_frame(i);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return frame;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unpin_cart_cache
+// Description  : Release a pinned frame, noting what happened to it
+//
+// Inputs       : frame - pointer returned by pin_cart_cache
+//                state - CART_CACHE_UNCHANGED, _CLEAN (matches the device),
+//                        _DIRTY (to be written back), _PREFETCH (fetched by
+//                        read-ahead) or _INVALID (contents are garbage)
+// Outputs      : 0 if successful, -1 if failure
+
+int unpin_cart_cache(void *frame, CartCacheState state) {
+    
+    ptrdiff_t off = (char *)frame - slab;
+    int i = (off % CART_FRAME_SIZE == 0) ? (int)(off / CART_FRAME_SIZE) : -1;
+    pthread_mutex_lock(&cacheLock);
+    if (i < 0 || i >= current || cache[i].pins == 0) {
+        pthread_mutex_unlock(&cacheLock);
+        logMessage(LOG_ERROR_LEVEL, "Unpin of a frame that is not pinned.");
+        return -1;
+    }
+    cache[i].pins--;
+    
+    switch (state) {
+    case CART_CACHE_CLEAN:
+        cache_mark_clean(i);
+        break;
+    case CART_CACHE_DIRTY:
+        cache_mark_dirty(i);
+        break;
+    case CART_CACHE_PREFETCH:
+        if (!cache[i].prefetched) {
+            cache[i].prefetched = 1;
+            prefetchResident++;
+            CART_STAT_SUB(cacheMisses, 1);  //read-ahead, not a demand miss
         }
+        break;
+    case CART_CACHE_INVALID:            //recycle the entry first
+        if (cache[i].pins == 0)
+            cache_release(i);
+        break;
+    default:
+        break;
     }
+    if (cache[i].pins == 0 && unpinWaiters > 0)
+        pthread_cond_broadcast(&unpinCond);
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drop_cart_cache
+// Description  : Remove a frame from the cache without writing it back, for
+//                frames that no longer belong to any file.  A frame another
+//                thread has pinned (being written back, say) is waited for,
+//                so no copy of it outlives the call.
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+int drop_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
     
-    return NULL;
+    pthread_mutex_lock(&cacheLock);
+    int i;
+    while ((i = cache_lookup(cart, frm)) != CART_CACHE_NO_ENTRY && cache[i].pins > 0) {
+        unpinWaiters++;
+        pthread_cond_wait(&unpinCond, &cacheLock);
+        unpinWaiters--;
+    }
+    if (i != CART_CACHE_NO_ENTRY)
+        cache_release(i);
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_writeback
+// Description  : Set the function used to write dirty frames to the device
+//
+// Inputs       : fn - the write-back function
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_writeback(CartCacheWriteback fn) {
+    writeback = fn;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_cart_cache_run
+// Description  : Write back the dirty frames of a run of frames, in batches,
+//                and wait for those another thread is writing back
+//
+// Inputs       : cart - the cartridge number of the run
+//                frm - the first frame of the run
+//                count - the number of frames in the run
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_cart_cache_run(CartridgeIndex cart, CartFrameIndex frm, uint32_t count) {
+    
+    int idx[CART_CACHE_FLUSH_BATCH], ret = 0;
+    uint32_t j = 0;
+    pthread_mutex_lock(&cacheLock);
+    while (j < count && ret == 0 && dirtyCount > 0) {
+        int n = 0, busy = 0;
+        uint32_t from = j;
+        for (; j < count && n < CART_CACHE_FLUSH_BATCH; j++) {
+            int i = cache_lookup(cart, frm + j);
+            if (i == CART_CACHE_NO_ENTRY || !cache[i].dirty)
+                continue;
+            if (cache[i].flushing) {
+                busy = 1;
+                continue;
+            }
+            cache_flush_begin(i);
+            idx[n++] = i;
+        }
+        if (n > 0)
+            ret = cache_flush_run(idx, n);
+        if (busy && ret == 0) {             //look at the same frames again
+            if (n == 0)
+                pthread_cond_wait(&flushedCond, &cacheLock);
+            j = from;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_cart_cache
+// Description  : Write back dirty frames, oldest first, while more than
+//                max_dirty are dirty or the oldest is at least max_age_ms
+//                old (0 disables the age check).  The frames are pinned and
+//                written in batches with the cache lock dropped, so readers
+//                and writers carry on meanwhile; batches other threads are
+//                writing are waited for before returning.
+//
+// Inputs       : max_dirty - number of dirty frames allowed to remain
+//                max_age_ms - age at which a dirty frame is written back
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_cart_cache(uint32_t max_dirty, uint32_t max_age_ms) {
+    
+    int idx[CART_CACHE_FLUSH_BATCH], ret = 0;
+    uint64_t now = (max_age_ms != 0) ? cache_now_ms() : 0;
+    pthread_mutex_lock(&cacheLock);
+    while (ret == 0) {
+        uint32_t waiting = dirtyCount - flushingCount;
+        int n = 0;
+        for (int i = dirtyTail; i != CART_CACHE_NO_ENTRY && n < CART_CACHE_FLUSH_BATCH; i = cache[i].dprev) {
+            if (cache[i].flushing)
+                continue;
+            if (waiting - n <= max_dirty &&
+                (max_age_ms == 0 || now - cache[i].dirtyTime < max_age_ms))
+                break;
+            cache_flush_begin(i);
+            idx[n++] = i;
+        }
+        if (n > 0)
+            ret = cache_flush_run(idx, n);
+        else if (flushingCount > 0)
+            pthread_cond_wait(&flushedCond, &cacheLock);
+        else
+            break;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_size / get_cart_cache_dirty
+// Description  : Get the capacity of the cache / number of dirty frames
+//
+// Inputs       : none
+// Outputs      : the number of frames
+
+uint32_t get_cart_cache_size(void) {
+    return cacheSize;
+}
+
+uint32_t get_cart_cache_dirty(void) {
+    return dirtyCount;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_prefetch_stats
+// Description  : Get the read-ahead counters; frames still cached but not
+//                used count as wasted
+//
+// Inputs       : hits - prefetched frames that were used (output)
+//                wasted - prefetched frames that were not (output)
+// Outputs      : 0 if successful, -1 if failure
+
+int get_cart_cache_prefetch_stats(uint64_t *hits, uint64_t *wasted) {
+    pthread_mutex_lock(&cacheLock);
+    *hits = prefetchHits;
+    *wasted = prefetchEvicted + prefetchResident;
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_stats
+// Description  : Get the lookups that found their frame and the frames
+//                inserted on demand (read-ahead is not counted as a miss)
+//                since the cache was initialized
+//
+// Inputs       : hits - lookups served from the cache (output)
+//                misses - frames that were not cached (output)
+// Outputs      : the name of the replacement policy
+
+const char *get_cart_cache_stats(uint64_t *hits, uint64_t *misses) {
+    pthread_mutex_lock(&cacheLock);
+    *hits = cartStats->cacheHits - hitsBase;
+    *misses = cartStats->cacheMisses - missesBase;
+    pthread_mutex_unlock(&cacheLock);
+    return cachePolicies[policyKind].name;
+}
 
 //
 // Unit test
 
+static int testWritebacks;      //frames written back during the unit test
+
+static int test_writeback(CartCacheFrameRef *frames, int count) {
+    testWritebacks += count;
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : cartCacheUnitTest
@@ -171,14 +1333,12 @@ void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
 // Outputs      : 0 if successful, -1 if failure
 
 int cartCacheUnitTest(void) {
+    CartCachePolicy kind = policyKind;
     set_cart_cache_size(50);
+    set_cart_cache_policy(CART_CACHE_LRU);
     init_cart_cache();
     
-    for (int i=0; i<cacheSize; i++) {
-        logMessage(LOG_OUTPUT_LEVEL, "1-> %s,2->%d,3->%d, %d", cache[i].memContent,cache[i].memCart,cache[i].memFrm,cache[i].time);
-        
-    }
-    char a[50] = "anddddddddddddd";
+    char a[CART_FRAME_SIZE] = "anddddddddddddd";
     put_cart_cache(0, 0, a);
     
     char *aget = get_cart_cache(0, 0);
@@ -187,7 +1347,7 @@ int cartCacheUnitTest(void) {
     int acom = strcmp(a, aget);
     logMessage(LOG_OUTPUT_LEVEL, "equal: %d", acom);
     
-    char b[50] = "xxxxxxxxxxxxxx";
+    char b[CART_FRAME_SIZE] = "xxxxxxxxxxxxxx";
     put_cart_cache(0, 1, b);
     
     char *bget = get_cart_cache(0, 1);
@@ -196,7 +1356,7 @@ int cartCacheUnitTest(void) {
     int bcom = strcmp(b, bget);
     logMessage(LOG_OUTPUT_LEVEL, "equal: %d", bcom);
     
-    char c[50] = "tttttttttttttt";
+    char c[CART_FRAME_SIZE] = "tttttttttttttt";
     put_cart_cache(0, 1, c);
     
     char *cget = get_cart_cache(0, 1);
@@ -205,18 +1365,122 @@ int cartCacheUnitTest(void) {
     int ccom = strcmp(c, cget);
     logMessage(LOG_OUTPUT_LEVEL, "equal: %d", ccom);
     
-    for (int i=0; i<current; i++) {
-        logMessage(LOG_OUTPUT_LEVEL, "1-> %s,2->%d,3->%d, %d", cache[i].memContent,cache[i].memCart,cache[i].memFrm,cache[i].time);
+    if (acom || bcom || ccom || current != 2) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on put/get.");
+        return(-1);
+    }
+    
+    //fill the cache, touch (0, 0), then check that the LRU frame (0, 1) is evicted
+    char d[CART_FRAME_SIZE] = "dddddddddddddd";
+    for (int i = 2; i < cacheSize; i++)
+        put_cart_cache(1, i, d);
+    get_cart_cache(0, 0);
+    put_cart_cache(2, 0, d);
+    if (get_cart_cache(0, 1) != NULL || get_cart_cache(0, 0) == NULL ||
+        get_cart_cache(1, 2) == NULL || current != cacheSize) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on LRU eviction.");
+        return(-1);
+    }
+    
+    //dirty frames are written back once, on eviction or on flush
+    init_cart_cache();
+    set_cart_cache_writeback(test_writeback);
+    testWritebacks = 0;
+    put_cart_cache_dirty(3, 0, d);
+    put_cart_cache_dirty(3, 1, d);
+    put_cart_cache_dirty(3, 0, d);
+    for (int i = 2; i < cacheSize; i++)
+        put_cart_cache(1, i, d);
+    get_cart_cache(3, 1);
+    put_cart_cache(4, 0, d);            //evicts the dirty (3, 0)
+    if (testWritebacks != 1 || get_cart_cache_dirty() != 1) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on dirty eviction.");
+        return(-1);
+    }
+    flush_cart_cache(0, 0);
+    flush_cart_cache(0, 0);
+    if (testWritebacks != 2 || get_cart_cache_dirty() != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on flush.");
+        return(-1);
+    }
+    set_cart_cache_writeback(NULL);
+    
+    //a pinned frame is never evicted, and an invalidated one is dropped on unpin
+    init_cart_cache();
+    int created;
+    char *pinned = pin_cart_cache(5, 0, &created);
+    memcpy(pinned, d, CART_FRAME_SIZE);
+    for (int i = 0; i < cacheSize; i++)
+        put_cart_cache(1, i, d);
+    if (!created || get_cart_cache(5, 0) != pinned || unpin_cart_cache(pinned, CART_CACHE_CLEAN)) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on pinning.");
+        return(-1);
+    }
+    pinned = pin_cart_cache(5, 0, &created);
+    unpin_cart_cache(pinned, CART_CACHE_INVALID);
+    if (created || has_cart_cache(5, 0)) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on invalidation.");
+        return(-1);
+    }
+    
+    //a dropped dirty frame is never written back
+    set_cart_cache_writeback(test_writeback);
+    testWritebacks = 0;
+    put_cart_cache_dirty(6, 0, d);
+    drop_cart_cache(6, 0);
+    flush_cart_cache(0, 0);
+    if (testWritebacks != 0 || has_cart_cache(6, 0) || get_cart_cache_dirty() != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on drop.");
+        return(-1);
+    }
+    set_cart_cache_writeback(NULL);
+    
+    for (int i = lists[0].head; i != CART_CACHE_NO_ENTRY; i = cache[i].next) {
+        logMessage(LOG_OUTPUT_LEVEL, "1-> %s,2->%d,3->%d", cache_frame(i),keys[i].memCart,keys[i].memFrm);
         
     }
     
+    //CLOCK gives a used frame a second chance over an unused one
+    set_cart_cache_policy(CART_CACHE_CLOCK);
+    init_cart_cache();
+    for (int i = 0; i < cacheSize; i++)
+        put_cart_cache(1, i, d);
+    get_cart_cache(1, 0);
+    put_cart_cache(2, 0, d);
+    if (!has_cart_cache(1, 0) || has_cart_cache(1, 1) || !has_cart_cache(2, 0)) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on CLOCK replacement.");
+        return(-1);
+    }
+    
+    //2Q and ARC keep a reused hot set while long scans go through the cache
+    for (CartCachePolicy k = CART_CACHE_2Q; k <= CART_CACHE_ARC; k++) {
+        uint64_t hits, misses;
+        set_cart_cache_policy(k);
+        init_cart_cache();
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < 10; i++) {
+                put_cart_cache(7, i, d);
+                get_cart_cache(7, i);
+            }
+            for (int i = 0; i < cacheSize * (pass + 1); i++)
+                put_cart_cache(8 + pass, i, d);
+        }
+        for (int i = 0; i < 10; i++) {
+            if (!has_cart_cache(7, i)) {
+                logMessage(LOG_ERROR_LEVEL, "Cache unit test failed on %s scan resistance.",
+                           cachePolicies[k].name);
+                return(-1);
+            }
+        }
+        get_cart_cache_stats(&hits, &misses);
+        logMessage(LOG_OUTPUT_LEVEL, "%s: %llu hits, %llu misses", cachePolicies[k].name,
+                   (unsigned long long)hits, (unsigned long long)misses);
+    }
+    
     close_cart_cache();
+    set_cart_cache_policy(kind);
     
     // Return successfully
     logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
     return(0);
 }
-
-
-
-
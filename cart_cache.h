@@ -17,23 +17,100 @@
 // Defines
 #define DEFAULT_CART_FRAME_CACHE_SIZE 1024  // Default size for cache
 
+// Type definitions
+typedef enum {
+	CART_CACHE_UNCHANGED = 0,  // Pinned frame was only read
+	CART_CACHE_CLEAN     = 1,  // Frame contents match the device
+	CART_CACHE_DIRTY     = 2,  // Frame modified, write back later
+	CART_CACHE_PREFETCH  = 3,  // Frame fetched by read-ahead
+	CART_CACHE_INVALID   = 4,  // Frame contents are garbage, drop it
+} CartCacheState;
+
+typedef enum {
+	CART_CACHE_LRU       = 0,  // Replace the least recently used frame
+	CART_CACHE_CLOCK     = 1,  // Reference bits swept by a clock hand
+	CART_CACHE_2Q        = 2,  // FIFO for new frames, LRU for reused ones
+	CART_CACHE_ARC       = 3,  // Adaptive split between recency and frequency
+} CartCachePolicy;
+
+typedef struct {
+	CartridgeIndex cart;  // Cartridge of the frame
+	CartFrameIndex frm;   // Frame number
+	void          *frame; // Its contents in the cache (pinned)
+} CartCacheFrameRef;
+
+typedef int (*CartCacheWriteback)(CartCacheFrameRef *frames, int count);
+	// Writes dirty frames back to the device, ordered by cartridge and
+	// frame, 0 if successful
+
 ///
 // Cache Interfaces
 
 int set_cart_cache_size(uint32_t max_frames);
 	// Set the size of the cache (must be called before init)
 
+int set_cart_cache_policy(CartCachePolicy kind);
+	// Set the replacement policy of the cache (must be called before init)
+
+int parse_cart_cache_policy(const char *name);
+	// Get the policy named "lru", "clock", "2q" or "arc", -1 if unknown
+
 int init_cart_cache(void);
 	// Initialize the cache 
 
 int close_cart_cache(void);
 	// Clear all of the contents of the cache, cleanup
 
+int scrub_cart_cache(void);
+	// Zero the contents of every cached frame
+
 int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame);
 	// Put an object into the object cache, evicting other items as necessary
 
 void * get_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
-	// Get an object from the cache (and return it)
+	// Get an object from the cache (and return it); with several threads
+	// the frame may be replaced at any time, pin it instead
+
+void * pin_cart_cache(CartridgeIndex cart, CartFrameIndex frm, int *created);
+	// Get a cached frame in place and pin it; with created != NULL a missing
+	// frame gets a new entry for the caller to fill
+
+int unpin_cart_cache(void *frame, CartCacheState state);
+	// Release a pinned frame, noting whether it was cleaned, dirtied, etc.
+
+int put_cart_cache_dirty(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+	// Put a modified frame into the cache, written back on eviction or flush
+
+int put_cart_cache_prefetch(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+	// Put a frame fetched by read-ahead into the cache
+
+int has_cart_cache(CartridgeIndex cart, CartFrameIndex frm);
+	// Check whether a frame is cached without touching its recency
+
+int drop_cart_cache(CartridgeIndex cart, CartFrameIndex frm);
+	// Remove a frame from the cache without writing it back, waiting out any pins
+
+int set_cart_cache_writeback(CartCacheWriteback fn);
+	// Set the function used to write dirty frames back to the device
+
+int flush_cart_cache_run(CartridgeIndex cart, CartFrameIndex frm, uint32_t count);
+	// Write back the dirty frames of a run of frames
+
+int flush_cart_cache(uint32_t max_dirty, uint32_t max_age_ms);
+	// Write back oldest dirty frames until at most max_dirty remain and
+	// none is older than max_age_ms (0 = no age limit)
+
+uint32_t get_cart_cache_size(void);
+	// Get the maximum number of frames the cache holds
+
+uint32_t get_cart_cache_dirty(void);
+	// Get the number of dirty frames in the cache
+
+int get_cart_cache_prefetch_stats(uint64_t *hits, uint64_t *wasted);
+	// Get the number of prefetched frames used / never used
+
+const char *get_cart_cache_stats(uint64_t *hits, uint64_t *misses);
+	// Get the number of cache hits / demand misses, returns the policy name
 
 //
 // Unit test
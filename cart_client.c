@@ -9,122 +9,487 @@
 
 // Include Files
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 
 // Project Include Files
 #include "cart_network.h"
+#include "cart_stats.h"
 #include "cmpsc311_util.h"
 #include "cmpsc311_log.h"
 
+// A server cartridges are striped across, connected to by one caller at a
+// time (the driver bus lock)
+typedef struct {
+    struct in_addr addr;
+    unsigned short port;        // 0 = cart_network_port or the default
+    int            fd;          // Connection, -1 until connected
+} CartServer;
+
 //
 //  Global data
-int                socket_fd;
-int                client_socket = -1;
+static CartServer  servers[CART_MAX_SERVERS];   // Servers of set_cart_servers
+static int         serverCount = 0;             // 0 = the one at cart_network_address
+static CartridgeIndex routeCart = CART_NO_CARTRIDGE; // Last cartridge loaded, routes requests naming none
 int                cart_network_shutdown = 0;   // Flag indicating shutdown
 unsigned char     *cart_network_address = NULL; // Address of CART server
 unsigned short     cart_network_port = 0;       // Port of CART serve
 unsigned long      CartControllerLLevel = LOG_INFO_LEVEL; // Controller log level (global)
 unsigned long      CartDriverLLevel = 0;     // Driver log level (global)
 unsigned long      CartSimulatorLLevel = 0;  // Driver log level (global)
+static CartBusBackend busBackend = CART_BUS_NETWORK;   // Where requests are executed
 
 //
 // Functions
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : client_cart_bus_request
-// Description  : This the client operation that sends a request to the CART
-//                server process.   It will:
+// Function     : set_cart_bus_backend
+// Description  : Select whether bus requests go to cart_server or to the
+//                in-process controller
 //
-//                1) if INIT make a connection to the server
-//                2) send any request to the server, returning results
-//                3) if CLOSE, will close the connection
+// Inputs       : backend - CART_BUS_NETWORK or CART_BUS_LOCAL
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_bus_backend(CartBusBackend backend) {
+    if (backend != CART_BUS_NETWORK && backend != CART_BUS_LOCAL) {
+        logMessage(LOG_ERROR_LEVEL, "Unknown bus backend %d.", (int)backend);
+        return( -1 );
+    }
+    busBackend = backend;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
 //
-// Inputs       : reg - the request reqisters for the command
-//                buf - the block to be read/written from (READ/WRITE)
-// Outputs      : the response structure encoded as needed
+// Function     : parse_cart_bus_backend
+// Description  : Look up a bus backend by its command line name
+//
+// Inputs       : name - "net" or "local"
+// Outputs      : the backend, -1 if the name is unknown
 
-CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
+int parse_cart_bus_backend(const char *name) {
+    if (strcmp(name, "net") == 0)
+        return( CART_BUS_NETWORK );
+    if (strcmp(name, "local") == 0)
+        return( CART_BUS_LOCAL );
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_servers
+// Description  : Set the servers the cartridges are striped across, cartridge
+//                c going to server c % count
+//
+// Inputs       : list - "<ip>[:<port>],<ip>[:<port>]...", servers without a
+//                       port use cart_network_port or the default one
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_servers(const char *list) {
     
-    struct sockaddr_in caddr;
-    char *ip = CART_DEFAULT_IP;
-    caddr.sin_family = AF_INET;
-    caddr.sin_port = htons(CART_DEFAULT_PORT);
+    CartServer parsed[CART_MAX_SERVERS];
+    char entry[64];
+    int count = 0;
     
-    if (client_socket == -1) {
-        if ( inet_aton(ip, &caddr.sin_addr) == 0 ) {         //Setup the address
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        if (count == CART_MAX_SERVERS || len == 0 || len >= sizeof(entry)) {
+            logMessage(LOG_ERROR_LEVEL, "Bad server list, at most %d servers as <ip>[:<port>].",
+                       CART_MAX_SERVERS);
             return( -1 );
         }
+        memcpy(entry, list, len);
+        entry[len] = '\0';
+        list += len + (list[len] == ',');
         
-        socket_fd = socket(PF_INET, SOCK_STREAM, 0);        //Create the socket
-        if (socket_fd == -1) {
-            printf( "Error on socket creation \n" );
-            return( -1 );
+        char *colon = strchr(entry, ':');
+        parsed[count].port = 0;
+        parsed[count].fd = -1;
+        if (colon != NULL) {
+            *colon = '\0';
+            if (sscanf(colon + 1, "%hu", &parsed[count].port) != 1 || parsed[count].port == 0) {
+                logMessage(LOG_ERROR_LEVEL, "Bad server port [%s].", colon + 1);
+                return( -1 );
+            }
         }
-                                                            //Create the connection
-        if ( connect(socket_fd, (const struct sockaddr *)&caddr, sizeof(caddr)) == -1 ) {
-            printf( "Error on socket connect \n");
+        if (inet_aton(entry, &parsed[count].addr) == 0) {
+            logMessage(LOG_ERROR_LEVEL, "Bad server address [%s].", entry);
             return( -1 );
         }
-        client_socket = 1;
+        count++;
     }
-    
-    uint64_t ky1 = (reg >> 56) & 0xff;
-    uint64_t value = htonll64(reg);
-    
-    if (ky1 == CART_OP_RDFRME) {             // read
-        if ( write( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
+    if (count == 0) {
+        logMessage(LOG_ERROR_LEVEL, "Empty server list.");
+        return( -1 );
+    }
+    memcpy(servers, parsed, count * sizeof(CartServer));
+    serverCount = count;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_server_count / get_cart_server
+// Description  : Get the number of servers the cartridges are striped
+//                across / the server a cartridge is on
+//
+// Inputs       : cart - the cartridge
+// Outputs      : the number of servers / the index of the server
+
+int get_cart_server_count(void) {
+    if (busBackend == CART_BUS_LOCAL || serverCount == 0)
+        return( 1 );
+    return( serverCount );
+}
+
+int get_cart_server(CartridgeIndex cart) {
+    return( (cart < CART_MAX_CARTRIDGES) ? cart % get_cart_server_count() : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_write_all / client_read_all
+// Description  : Write / read exactly len bytes on a server socket
+//
+// Inputs       : fd - the connection
+//                buf - the data to send / the buffer to receive into
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+static int client_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
             printf( "Error writing network data\n");
             return( -1 );
         }
-        if ( read( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
+        p += n;
+        len -= n;
+    }
+    return( 0 );
+}
+
+static int client_read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    int one = 1;
+    while (len > 0) {
+        //the server sends a frame response as two writes, ack at once so its
+        //Nagle timer does not hold back the second one
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
             printf( "Error reading network data \n" );
             return( -1 );
         }
-        if ( read( socket_fd, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE ) {
-            printf( "Error reading network data \n" );
+        p += n;
+        len -= n;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_connect
+// Description  : Connect to every CART server not already connected; without
+//                a server list, the one at cart_network_address
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int client_connect(void) {
+    
+    if (serverCount == 0) {
+        char *ip = cart_network_address ? (char *)cart_network_address : CART_DEFAULT_IP;
+        if ( inet_aton(ip, &servers[0].addr) == 0 ) {         //Setup the address
             return( -1 );
         }
+        servers[0].port = 0;
+        servers[0].fd = -1;
+        serverCount = 1;
+    }
+    
+    for (int s = 0; s < serverCount; s++) {
+        struct sockaddr_in caddr;
+        int one = 1;
+        if (servers[s].fd != -1)
+            continue;
+        caddr.sin_family = AF_INET;
+        caddr.sin_port = htons(servers[s].port ? servers[s].port :
+                               cart_network_port ? cart_network_port : CART_DEFAULT_PORT);
+        caddr.sin_addr = servers[s].addr;
         
-    }else if (ky1 == CART_OP_WRFRME) {             //write
-        if ( write( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
-            printf( "Error writing network data\n");
-            return( -1 );
-        }
-        if ( write( socket_fd, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE ) {
-            printf( "Error writing network data\n");
+        int fd = socket(PF_INET, SOCK_STREAM, 0);       //Create the socket
+        if (fd == -1) {
+            printf( "Error on socket creation \n" );
             return( -1 );
         }
-        if ( read( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
-            printf( "Error reading network data \n" );
+                                                        //Create the connection
+        if ( connect(fd, (const struct sockaddr *)&caddr, sizeof(caddr)) == -1 ) {
+            printf( "Error on socket connect \n");
+            close(fd);
             return( -1 );
         }
         
-    }else if (ky1 == CART_OP_POWOFF) {             //shutdown
-        if ( write( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
-            printf( "Error writing network data\n");
-            return( -1 );
+        //requests are small and latency bound, don't let Nagle hold them back
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        servers[s].fd = fd;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_disconnect
+// Description  : Drop the connection to every server, after a failure left
+//                requests or responses in flight on them; the next request
+//                connects again
+//
+// Inputs       : none
+// Outputs      : none
+
+static void client_disconnect(void) {
+    
+    for (int s = 0; s < serverCount; s++) {
+        if (servers[s].fd != -1) {
+            close(servers[s].fd);
+            servers[s].fd = -1;
         }
-        if ( read( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
-            printf( "Error reading network data \n" );
+    }
+    routeCart = CART_NO_CARTRIDGE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : local_cart_bus_pipeline
+// Description  : Execute a sequence of requests one after the other on the
+//                in-process controller, recording each one as the network
+//                pipeline does
+//
+// Inputs       : ops - the requests (reg/buf in, resp out)
+//                count - the number of requests
+// Outputs      : 0 if every request was executed, -1 if failure
+
+static int local_cart_bus_pipeline(CartBusOp *ops, int count) {
+    
+    CART_STAT_INC(busBatches);
+    for (int i = 0; i < count; i++) {
+        uint64_t ky1 = (ops[i].reg >> 56) & 0xff;
+        uint64_t start = cart_stats_now();
+        ops[i].resp = cart_io_bus(ops[i].reg, ops[i].buf);
+        if (ky1 < CART_OP_MAXVAL) {
+            CART_STAT_INC(busOps[ky1]);
+            cart_hist_record(&cartStats->busLatency[ky1], cart_stats_now() - start);
+        }
+        if (ky1 == CART_OP_POWOFF && i + 1 < count)     //nothing may follow a power off
             return( -1 );
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_route
+// Description  : Sort the requests of a batch by the server they go to, in
+//                order; a request goes to the server of its cartridge, or of
+//                the cartridge last loaded if it names none, and INITMS and
+//                POWOFF go to every server
+//
+// Inputs       : ops - the requests
+//                count - the number of requests
+//                first - where each server's requests start in order (output)
+// Outputs      : the indices of the requests by server, NULL if failure
+
+static int *client_route(CartBusOp *ops, int count, int first[CART_MAX_SERVERS + 1]) {
+    
+    int *order = malloc(2 * (size_t)count * serverCount * sizeof(int));
+    int *dest = order + (size_t)count * serverCount;
+    int fill[CART_MAX_SERVERS] = { 0 }, n = 0;
+    
+    if (order == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Cannot route %d bus requests.", count);
+        return( NULL );
+    }
+    for (int i = 0; i < count; i++) {
+        uint64_t ky1 = (ops[i].reg >> 56) & 0xff;
+        CartridgeIndex cart = ops[i].cart;
+        if (ky1 == CART_OP_LDCART)
+            cart = (ops[i].reg >> 31) & 0xffff;
+        if (cart >= CART_MAX_CARTRIDGES)
+            cart = routeCart;
+        if (ky1 == CART_OP_LDCART)
+            routeCart = cart;
+        if (ky1 == CART_OP_INITMS || ky1 == CART_OP_POWOFF) {
+            ops[i].resp = 0;                        //the servers' responses are merged
+            for (int s = 0; s < serverCount; s++) {
+                dest[n++] = s;
+                fill[s]++;
+            }
+            routeCart = CART_NO_CARTRIDGE;
+        } else {
+            dest[n++] = get_cart_server(cart);
+            fill[dest[n - 1]]++;
+        }
+    }
+    first[0] = 0;
+    for (int s = 0; s < serverCount; s++) {
+        first[s + 1] = first[s] + fill[s];
+        fill[s] = first[s];
+    }
+    n = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t ky1 = (ops[i].reg >> 56) & 0xff;
+        int copies = (ky1 == CART_OP_INITMS || ky1 == CART_OP_POWOFF) ? serverCount : 1;
+        for (int c = 0; c < copies; c++, n++)
+            order[fill[dest[n]]++] = i;
+    }
+    return( order );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_pipeline
+// Description  : Send a sequence of requests to the CART servers, keeping up
+//                to CART_PIPELINE_DEPTH of them in flight on each connection,
+//                and match the responses to the requests in order.  Every
+//                server gets its requests in the order of the sequence, and
+//                the servers work on theirs at the same time.  Each request
+//                is encoded exactly as client_cart_bus_request would send it,
+//                and its round trip is recorded in the opcode's histogram.
+//                With the local backend the in-process controller executes
+//                them instead.  On a failure the connections are dropped,
+//                so no stale response is matched to a later request.
+//
+// Inputs       : ops - the requests (reg/buf/cart in, resp out)
+//                count - the number of requests
+// Outputs      : 0 if every request got a response, -1 if failure
+
+int client_cart_bus_pipeline(CartBusOp *ops, int count) {
+    
+    char out[CART_PIPELINE_DEPTH * (CART_NET_HEADER_SIZE + CART_FRAME_SIZE)];
+    uint64_t sentAt[CART_MAX_SERVERS][CART_PIPELINE_DEPTH];  //when each request in flight was sent
+    int first[CART_MAX_SERVERS + 1], sent[CART_MAX_SERVERS], done[CART_MAX_SERVERS];
+    int *order, ret = 0;
+    
+    if (busBackend == CART_BUS_LOCAL)
+        return( local_cart_bus_pipeline(ops, count) );
+    if (client_connect())
+        return( -1 );
+    if ((order = client_route(ops, count, first)) == NULL)
+        return( -1 );
+    CART_STAT_INC(busBatches);
+    for (int s = 0; s < serverCount; s++)
+        sent[s] = done[s] = first[s];
+    
+    for (;;) {
+        
+        //fill every server's window: encode every request we may send into one write
+        struct pollfd pfd[CART_MAX_SERVERS];
+        int waiting = 0;
+        for (int s = 0; s < serverCount && ret == 0; s++) {
+            size_t len = 0;
+            uint64_t now = cart_stats_now();
+            while (sent[s] < first[s + 1] && sent[s] - done[s] < CART_PIPELINE_DEPTH) {
+                CartBusOp *op = &ops[order[sent[s]]];
+                uint64_t ky1 = (op->reg >> 56) & 0xff;
+                uint64_t value = htonll64(op->reg);
+                if (ky1 < CART_OP_MAXVAL)
+                    CART_STAT_INC(busOps[ky1]);
+                sentAt[s][sent[s] % CART_PIPELINE_DEPTH] = now;
+                memcpy(out + len, &value, sizeof(value));
+                len += sizeof(value);
+                if (ky1 == CART_OP_WRFRME) {
+                    memcpy(out + len, op->buf, CART_FRAME_SIZE);
+                    len += CART_FRAME_SIZE;
+                }
+                sent[s]++;
+                if (ky1 == CART_OP_POWOFF)      //nothing may follow a power off
+                    break;
+            }
+            if (len > 0 && client_write_all(servers[s].fd, out, len))
+                ret = -1;
+            if (done[s] < sent[s]) {
+                pfd[waiting].fd = servers[s].fd;
+                pfd[waiting].events = POLLIN;
+                waiting++;
+            }
         }
-        client_socket = -1;
-        close(socket_fd);
+        if (ret != 0 || waiting == 0)
+            break;
         
-    }else{                                          //others
-        if ( write( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
-            printf( "Error writing network data\n");
-            return( -1 );
+        //collect the oldest outstanding response of every server that has one
+        if (waiting > 1 && poll(pfd, waiting, -1) == -1 && errno != EINTR) {
+            ret = -1;
+            break;
         }
-        if ( read( socket_fd, &value, sizeof(value)) != sizeof(value) ) {
-            printf( "Error reading network data \n" );
-            return( -1 );
+        for (int s = 0, w = 0; s < serverCount && ret == 0; s++) {
+            if (done[s] == sent[s])
+                continue;
+            if (waiting > 1 && !(pfd[w++].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            CartBusOp *op = &ops[order[done[s]]];
+            uint64_t ky1 = (op->reg >> 56) & 0xff;
+            uint64_t value;
+            if (client_read_all(servers[s].fd, &value, sizeof(value)) ||
+                (ky1 == CART_OP_RDFRME && client_read_all(servers[s].fd, op->buf, CART_FRAME_SIZE))) {
+                ret = -1;
+                break;
+            }
+            if (ky1 == CART_OP_INITMS || ky1 == CART_OP_POWOFF)
+                op->resp |= ntohll64(value);
+            else
+                op->resp = ntohll64(value);
+            if (ky1 < CART_OP_MAXVAL)
+                cart_hist_record(&cartStats->busLatency[ky1],
+                                 cart_stats_now() - sentAt[s][done[s] % CART_PIPELINE_DEPTH]);
+            done[s]++;
+            
+            if (ky1 == CART_OP_POWOFF) {        //shutdown
+                close(servers[s].fd);
+                servers[s].fd = -1;
+                if (done[s] < first[s + 1])
+                    ret = -1;
+            }
         }
     }
     
-    return ntohll64(value);
+    free(order);
+    if (ret != 0)
+        client_disconnect();
+    return( ret );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_request
+// Description  : This the client operation that sends a request to the CART
+//                server process.   It will:
+//
+//                1) if INIT make a connection to the server
+//                2) send any request to the server, returning results
+//                3) if CLOSE, will close the connection
+//
+// Inputs       : reg - the request reqisters for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
 
+CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
+    
+    CartBusOp op;
+    op.reg = reg;
+    op.buf = buf;
+    op.cart = CART_NO_CARTRIDGE;
+    if (client_cart_bus_pipeline(&op, 1))
+        return( -1 );
+    return op.resp;
+}
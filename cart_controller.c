@@ -0,0 +1,331 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_controller.c
+//  Description    : This is an in-process implementation of the CART
+//                   controller, a stand-in for cart_server when the driver
+//                   is benchmarked on its own.  It keeps the cartridges in
+//                   memory, across power cycles for as long as the process
+//                   runs (saved to a backing store file only when one is
+//                   set), and charges each operation the cost given by a
+//                   simple latency model.  Several
+//                   sessions (the connections of cart_mserver) may share
+//                   the cartridges, each with its own loaded cartridge.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Project Includes
+#include "cart_controller.h"
+#include "cart_stats.h"
+#include "cmpsc311_log.h"
+
+// Defines
+#define CART_CONTROLLER_SPIN_NS 50000   // Shorter delays are spun, not slept
+
+// Global data
+static CartCartridge *memsys = NULL;    //the cartridges, NULL until first needed
+static char *memsysStore = NULL;        //backing store file, NULL to stay in memory
+static int poweredSessions = 0;         //sessions between INITMS and POWOFF
+static pthread_mutex_t powerLock = PTHREAD_MUTEX_INITIALIZER;   //memsys, poweredSessions
+static pthread_rwlock_t cartLocks[CART_MAX_CARTRIDGES];         //contents of each cartridge
+static pthread_once_t cartLocksOnce = PTHREAD_ONCE_INIT;
+static CartControllerSession busSession = { CART_NO_CARTRIDGE, 0 }; //the one cart_io_bus uses
+static CartLatencyModel latency;        //all zero: no modelled delay
+
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_controller_latency
+// Description  : Set the cost charged for each kind of operation
+//
+// Inputs       : model - the latency model
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_controller_latency(const CartLatencyModel *model) {
+    latency = *model;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_controller_store
+// Description  : Set the file the cartridges are loaded from at the first
+//                power on and saved to at the last power off, or keep them
+//                in memory only (the default)
+//
+// Inputs       : path - the backing store file, NULL for none
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_controller_store(const char *path) {
+
+    char *store = NULL;
+    if (path != NULL && (store = strdup(path)) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART controller failed to allocate store name.");
+        return -1;
+    }
+    pthread_mutex_lock(&powerLock);
+    free(memsysStore);
+    memsysStore = store;
+    pthread_mutex_unlock(&powerLock);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : controller_delay
+// Description  : Hold the caller for the modelled cost of an operation,
+//                sleeping for long delays and spinning out short ones
+//
+// Inputs       : ns - the cost in nanoseconds
+// Outputs      : none
+
+static void controller_delay(uint64_t ns) {
+    if (ns == 0)
+        return;
+    uint64_t deadline = cart_stats_now() + ns;
+    if (ns >= CART_CONTROLLER_SPIN_NS) {
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000;
+        ts.tv_nsec = deadline % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+    while (cart_stats_now() < deadline)
+        ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_cart_locks
+// Description  : Create the locks of the cartridges (once)
+//
+// Inputs       : none
+// Outputs      : none
+
+static void init_cart_locks(void) {
+    for (int i = 0; i < CART_MAX_CARTRIDGES; i++)
+        pthread_rwlock_init(&cartLocks[i], NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : memsys_load / memsys_save
+// Description  : Create the cartridges, loading the backing store if there
+//                is one / save them to the backing store and release them.
+//                Without a store the cartridges are kept from one power
+//                cycle to the next instead (called with the power lock held)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int memsys_load(void) {
+
+    if (memsys != NULL)
+        return 0;
+    if ((memsys = calloc(CART_MAX_CARTRIDGES, sizeof(CartCartridge))) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART controller failed to allocate memory system.");
+        return -1;
+    }
+
+    struct stat st;
+    if (memsysStore == NULL || stat(memsysStore, &st) == -1 || !S_ISREG(st.st_mode))
+        return 0;
+    int fd = open(memsysStore, O_RDONLY);
+    if (fd == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening cart backing store [%s], error=[%s]",
+                   memsysStore, strerror(errno));
+        free(memsys);
+        memsys = NULL;
+        return -1;
+    }
+    for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
+        if (read(fd, memsys[i], sizeof(CartCartridge)) != sizeof(CartCartridge)) {
+            logMessage(LOG_ERROR_LEVEL, "Failure reading CART backing store [%s], error=[%s]",
+                       memsysStore, strerror(errno));
+            close(fd);
+            free(memsys);
+            memsys = NULL;
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int memsys_save(void) {
+
+    if (memsysStore == NULL)
+        return 0;
+    int ret = 0;
+    int fd = open(memsysStore, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening cart backing store [%s], error=[%s]",
+                   memsysStore, strerror(errno));
+        ret = -1;
+    }
+    for (int i = 0; i < CART_MAX_CARTRIDGES && fd != -1; i++) {
+        if (write(fd, memsys[i], sizeof(CartCartridge)) != sizeof(CartCartridge)) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing CART backing store [%s], error=[%s]",
+                       memsysStore, strerror(errno));
+            ret = -1;
+            break;
+        }
+    }
+    if (fd != -1)
+        close(fd);
+    free(memsys);
+    memsys = NULL;
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : controller_init / controller_poweroff
+// Description  : Power on a session, loading the cartridges for the first
+//                one / power it off, saving them after the last one
+//
+// Inputs       : session - the session
+// Outputs      : 0 if successful, -1 if failure
+
+static int controller_init(CartControllerSession *session) {
+
+    if (session->powered) {
+        logMessage(LOG_ERROR_LEVEL, "CART controller already initialized.");
+        return -1;
+    }
+    pthread_once(&cartLocksOnce, init_cart_locks);
+    pthread_mutex_lock(&powerLock);
+    if (poweredSessions == 0 && memsys_load()) {
+        pthread_mutex_unlock(&powerLock);
+        return -1;
+    }
+    poweredSessions++;
+    pthread_mutex_unlock(&powerLock);
+    session->powered = 1;
+    session->loaded = CART_NO_CARTRIDGE;
+    return 0;
+}
+
+static int controller_poweroff(CartControllerSession *session) {
+
+    int ret = 0;
+    session->powered = 0;
+    session->loaded = CART_NO_CARTRIDGE;
+    pthread_mutex_lock(&powerLock);
+    if (--poweredSessions == 0)
+        ret = memsys_save();
+    pthread_mutex_unlock(&powerLock);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_controller_bus
+// Description  : Execute one request of a session against the shared
+//                cartridges, the way cart_server does for a request from
+//                the network.  The session keeps the cartridge it loaded,
+//                frame accesses hold the lock of that cartridge.
+//
+// Inputs       : session - the session making the request
+//                regstate - the request registers
+//                buf - the frame to read into / write from (RDFRME/WRFRME)
+// Outputs      : the request registers with RT1 set if it failed
+
+CartXferRegister cart_controller_bus(CartControllerSession *session, CartXferRegister regstate, void *buf) {
+
+    uint64_t ky1 = (regstate >> 56) & 0xff;
+    uint64_t ct1 = (regstate >> 31) & 0xffff;
+    uint64_t fm1 = (regstate >> 15) & 0xffff;
+    CartridgeIndex cart = session->loaded;
+    int ret = 0;
+
+    if (!session->powered && ky1 != CART_OP_INITMS) {
+        logMessage(LOG_ERROR_LEVEL, "CART controller used before init (op %d).", (int)ky1);
+        return regstate | ((uint64_t)1 << 47);
+    }
+
+    switch (ky1) {
+    case CART_OP_INITMS:
+        ret = controller_init(session);
+        break;
+
+    case CART_OP_BZERO:
+        if (cart == CART_NO_CARTRIDGE) {
+            logMessage(LOG_ERROR_LEVEL, "CART controller zero without a loaded cartridge.");
+            ret = -1;
+        } else {
+            pthread_rwlock_wrlock(&cartLocks[cart]);
+            memset(memsys[cart], 0, sizeof(CartCartridge));
+            pthread_rwlock_unlock(&cartLocks[cart]);
+        }
+        break;
+
+    case CART_OP_LDCART:
+        if (ct1 >= CART_MAX_CARTRIDGES) {
+            logMessage(LOG_ERROR_LEVEL, "CART controller bad cartridge [%d].", (int)ct1);
+            ret = -1;
+        } else if (ct1 != cart) {
+            controller_delay(latency.ldcartNs);
+            session->loaded = ct1;
+        }
+        break;
+
+    case CART_OP_RDFRME:
+    case CART_OP_WRFRME:
+        if (cart == CART_NO_CARTRIDGE || fm1 >= CART_CARTRIDGE_SIZE || buf == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CART controller bad frame access [%d/%d].",
+                       (int)cart, (int)fm1);
+            ret = -1;
+        } else if (ky1 == CART_OP_RDFRME) {
+            controller_delay(latency.rdfrmeNs);
+            pthread_rwlock_rdlock(&cartLocks[cart]);
+            memcpy(buf, memsys[cart][fm1], CART_FRAME_SIZE);
+            pthread_rwlock_unlock(&cartLocks[cart]);
+        } else {
+            controller_delay(latency.wrfrmeNs);
+            pthread_rwlock_wrlock(&cartLocks[cart]);
+            memcpy(memsys[cart][fm1], buf, CART_FRAME_SIZE);
+            pthread_rwlock_unlock(&cartLocks[cart]);
+        }
+        break;
+
+    case CART_OP_POWOFF:
+        ret = controller_poweroff(session);
+        break;
+
+    default:
+        logMessage(LOG_ERROR_LEVEL, "CART controller bad opcode [%d].", (int)ky1);
+        ret = -1;
+    }
+
+    regstate &= ~((uint64_t)1 << 47);
+    if (ret)
+        regstate |= (uint64_t)1 << 47;
+    return regstate;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_io_bus
+// Description  : Execute one request as the single session of this process
+//
+// Inputs       : regstate - the request registers
+//                buf - the frame to read into / write from (RDFRME/WRFRME)
+// Outputs      : the request registers with RT1 set if it failed
+
+CartXferRegister cart_io_bus(CartXferRegister regstate, void *buf) {
+    return cart_controller_bus(&busSession, regstate, buf);
+}
@@ -19,6 +19,7 @@
 #define CART_CARTRIDGE_SIZE 1024
 #define CART_FRAME_SIZE 1024
 #define CART_NO_CARTRIDGE (CART_MAX_CARTRIDGES+0xff)
+#define CART_MEMSYS_BACKING_STORE "cart_memsys.bck"  // Backing store of cart_server
 
 // Type definitions
 typedef uint64_t CartXferRegister; // This is the value passed through the 
@@ -68,6 +69,19 @@ typedef enum {
 
 } CartOpCodes;
 
+// Cost charged by the in-process controller for each kind of operation
+typedef struct {
+	uint64_t ldcartNs;  // Switching to another cartridge
+	uint64_t rdfrmeNs;  // Reading a frame
+	uint64_t wrfrmeNs;  // Writing a frame
+} CartLatencyModel;
+
+// The state the controller keeps for each of its users
+typedef struct {
+	CartridgeIndex loaded;   // Cartridge this session loaded
+	int            powered;  // Between INITMS and POWOFF
+} CartControllerSession;
+
 //
 // Global Data 
 
@@ -82,6 +96,17 @@ extern unsigned long CartSimulatorLLevel;   // Driver log level
 CartXferRegister cart_io_bus(CartXferRegister regstate, void *buf);
 	// This is the bus interface for communicating with controller
 
+CartXferRegister cart_controller_bus(CartControllerSession *session, CartXferRegister regstate, void *buf);
+	// Execute a request of one of several sessions sharing the in-process
+	// controller (cart_controller.c)
+
+int set_cart_controller_latency(const CartLatencyModel *model);
+	// Set the operation costs of the in-process controller (cart_controller.c)
+
+int set_cart_controller_store(const char *path);
+	// Keep the cartridges of the in-process controller in a backing store
+	// file between runs, NULL (the default) to keep them in memory only
+
 int cart_unit_test(void);
 	// This function runs the unit tests for the cart controller.
 
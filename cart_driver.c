@@ -11,31 +11,175 @@
 // Includes
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 // Project Includes
 #include "cart_driver.h"
+#include "cart_async.h"
 #include "cart_controller.h"
 #include "cmpsc311_log.h"
 #include "cart_cache.h"
 #include "cart_network.h"
+#include "cart_stats.h"
 
 // Implementation
-uint64_t ky1, ky2, rt1, ct1, fm1;
+
+//a sequence of bus operations sent through the pipelined client
+typedef struct {
+    CartBusOp *ops;
+    int count;
+    int capacity;
+    int cart;           //cartridge loaded once the batch has run
+    int elided;         //LDCART requests skipped while building the batch
+} CartBusBatch;
+
+//a run of frames of a file that are consecutive on one cartridge
+typedef struct {
+    int64_t first;                  //index of the run's first frame within the file
+    uint16_t cart;
+    uint16_t frame;                 //first frame of the run on the cartridge
+    uint32_t length;                //number of frames in the run
+} CartExtent;
+
+//the superblock, in frame 0 of cartridge 0 when the file table persists;
+//the table it points to lists, for every file, its name, length, frames
+//kept by cart_fallocate and runs of frames
+#define CART_META_MAGIC 0x46545243          //"CRTF"
+#define CART_META_VERSION 1
+#define CART_META_EXTENTS 120               //runs of frames the table may take
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;                    //times the table was written
+    uint32_t fileCount;
+    uint32_t extCount;                      //runs of frames holding the table
+    uint64_t tableBytes;
+    uint32_t tableSum;                      //FNV-1a of the table
+    uint32_t sum;                           //FNV-1a of the superblock, taken with sum 0
+    struct {
+        uint16_t cart;
+        uint16_t frame;
+        uint32_t length;
+    } ext[CART_META_EXTENTS];
+} CartSuperblock;
+
+//the part of a segment of a vectored request that falls in one frame
+typedef struct {
+    int cart;
+    int frame;
+    int seg;                        //index of the segment
+    int start;                      //offset of the piece in the frame
+    int len;
+    uint64_t bufOff;                //offset of the piece in the segment's buffer
+    int past;                       //frame starts past the end of the file
+} CartVecPiece;
+
+//the file table while it is written
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} CartMetaBuffer;
 
 //a file is a struct containing many attributes
 struct cartFile{
-    char* fName;
-    int fLength;
+    char* fName;                    //the driver's own copy of the name
+    uint32_t fHash;                 //hash of the name
+    struct cartFile *hnext;         //next file in the same name bucket
+    uint64_t fLength;
     int isOpen;
-    int16_t fHandle;
-    uint32_t pos;
-    int fCart[CART_CARTRIDGE_SIZE];
-    int fFrame[CART_CARTRIDGE_SIZE];
+    int16_t fHandle;                //handle while open, -1 when closed
+    uint64_t pos;
+    int64_t fAlloc;                 //number of frames allocated to the file
+    int64_t fReserve;               //frames kept past the end by cart_fallocate
+    CartExtent *ext;                //where the frames are, in file order
+    int extCount;
+    int extCapacity;
+    int extHint;                    //extent of the last frame looked up
+    uint64_t raNextPos;             //position a sequential read would start at
+    int raWindow;                   //read-ahead window (frames), 0 when random
+    int64_t raLast;                 //last frame read or prefetched
+    pthread_mutex_t lock;           //serialises the operations on the file
+    int refs;                       //handle lookups waiting for the lock (atomic)
+    int deleted;                    //deleted while looked up, the last of them frees it
 };
 
-struct cartFile allFile[CART_MAX_TOTAL_FILES];
-int fileCount = 0;
-int currentFrame = -1;
-int currentCart = 0;
+//everything the driver owns, each part under its own lock so that threads
+//working on different files only meet in the cache and on the bus; locks
+//are always taken in the order table, file, allocator, cache, bus, and
+//vectored requests take several file locks in handle order
+typedef struct {
+    struct cartFile **names;                //hash table of all files by name
+    int nameMask;                           //number of name buckets minus one
+    int fileCount;                          //number of files ever created
+    struct cartFile **handles;              //open files by handle
+    int16_t *freeHandles;                   //closed handles, handed out again first
+    int freeCount;
+    int handleCount;                        //handles ever handed out
+    int handleCapacity;
+    pthread_mutex_t fileLock;               //the namespace and the handle table
+    
+    uint64_t frameMap[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE / 64];   //allocated frames, a bit each
+    int cartUsed[CART_MAX_CARTRIDGES];      //allocated frames per cartridge
+    int currentCart;                        //cartridge frames are allocated from
+    char cartZeroed[CART_MAX_CARTRIDGES];   //cartridges zeroed since poweron or since they emptied
+    char cartEmptied[CART_MAX_CARTRIDGES];  //cartridges that emptied, waiting for the zeroer
+    int zeroingCart;                        //cartridge being zeroed (one at a time), -1 if none
+    pthread_mutex_t allocLock;              //the frame allocator and the cartridge flags
+    pthread_cond_t zeroerCond;
+    pthread_cond_t zeroedCond;              //signalled when a cartridge has been zeroed
+    pthread_t zeroerThread;
+    int zeroerRunning;
+    
+    CartMountPolicy mountPolicy;
+    CartSuperblock super;                   //superblock of the file table on the cartridges
+    
+    int servers;                            //servers the cartridges are striped across
+    int loadedCarts[CART_MAX_SERVERS];      //cartridge currently loaded in each server
+    char cartWritten[CART_MAX_CARTRIDGES];  //cartridges written since poweron
+    uint64_t elidedLoads;                   //LDCART requests skipped because the cart was loaded
+    pthread_mutex_t busLock;                //the controller connection and the fields above
+    
+    uint64_t prefetchIssued;                //frames fetched by read-ahead (atomic)
+    int pinBudget;                          //cache frames reads and writes may still pin
+    pthread_mutex_t pinLock;
+    pthread_cond_t pinCond;
+    
+    CartInitPolicy initPolicy;
+    CartShutdownPolicy shutdownPolicy;
+    CartWritePolicy writePolicy;
+    uint32_t flushHighPct;                  //dirty ratio that wakes the flusher (0 = no flusher)
+    uint32_t flushLowPct;                   //dirty ratio the flusher drains down to
+    uint32_t flushMaxAgeMs;                 //age at which a dirty frame is flushed
+    pthread_mutex_t flusherLock;
+    pthread_cond_t flusherCond;
+    pthread_t flusherThread;
+    int flusherRunning;
+} CartContext;
+
+static int32_t mount_filesystem(void);
+static int32_t save_filesystem(void);
+static void unmount_filesystem(void);
+
+static CartContext drv = {
+    .fileCount = 0,
+    .fileLock = PTHREAD_MUTEX_INITIALIZER,
+    .currentCart = 0,
+    .allocLock = PTHREAD_MUTEX_INITIALIZER,
+    .zeroerCond = PTHREAD_COND_INITIALIZER,
+    .zeroedCond = PTHREAD_COND_INITIALIZER,
+    .zeroingCart = -1,
+    .servers = 1,
+    .busLock = PTHREAD_MUTEX_INITIALIZER,
+    .pinLock = PTHREAD_MUTEX_INITIALIZER,
+    .pinCond = PTHREAD_COND_INITIALIZER,
+    .mountPolicy = CART_MOUNT_FORMAT,
+    .initPolicy = CART_INIT_LAZY,
+    .shutdownPolicy = CART_SHUTDOWN_FAST,
+    .writePolicy = CART_WRITE_THROUGH,
+    .flusherLock = PTHREAD_MUTEX_INITIALIZER,
+    .flusherCond = PTHREAD_COND_INITIALIZER,
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -88,491 +232,3163 @@ int32_t extract_cart_opcode
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_poweron
-// Description  : Startup up the CART interface, initialize filesystem
+// Function     : batch_add
+// Description  : append a request to a batch of pipelined bus operations
 //
-// Inputs       : none
+// Inputs       : b - the batch
+//                reg - the request registers
+//                buf - the frame buffer (RDFRME/WRFRME), or NULL
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_poweron(void) {
-    uint64_t initms;
-    uint64_t ldcart;
-    uint64_t bzero;
-    
-    //initialize
-    if ((initms = create_cart_opcode(CART_OP_INITMS, 0, 0, 0, 0)) == -1) {
-        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail on init (cons)");
-        return(-1);
+static int32_t batch_add(CartBusBatch *b, CartXferRegister reg, void *buf) {
+    if (b->count == b->capacity) {
+        int capacity = (b->capacity == 0) ? 16 : b->capacity * 2;
+        CartBusOp *ops = realloc(b->ops, capacity * sizeof(CartBusOp));
+        if (ops == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot grow bus batch.");
+            return(-1);
+        }
+        b->ops = ops;
+        b->capacity = capacity;
     }
-    CartXferRegister oinitms = client_cart_bus_request(initms, NULL);
-    if (extract_cart_opcode(oinitms, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail on init (decon).");
-        return(-1);
+    b->ops[b->count].reg = reg;
+    b->ops[b->count].buf = buf;
+    b->ops[b->count].cart = b->cart;
+    b->count++;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : batch_load
+// Description  : append a LDCART to a batch unless the batch already leaves
+//                that cart loaded
+//
+// Inputs       : b - the batch
+//                cart - the cartridge to load
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t batch_load(CartBusBatch *b, int cart) {
+    if (b->cart == cart) {
+        b->elided++;
+        return(0);
     }
-    if (rt1) {
-        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail on init (return).");
+    b->cart = cart;
+    return(batch_add(b, create_cart_opcode(CART_OP_LDCART, 0, 0, cart, 0), NULL));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : batch_frame
+// Description  : append a frame read or write to a batch, preceded by a
+//                LDCART only if the batch leaves a different cart loaded
+//
+// Inputs       : b - the batch
+//                op - CART_OP_RDFRME or CART_OP_WRFRME
+//                cart - the cartridge of the frame
+//                frm - the frame
+//                buf - the frame buffer
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t batch_frame(CartBusBatch *b, int op, int cart, int frm, void *buf) {
+    if (batch_load(b, cart))
         return(-1);
-    }
+    return(batch_add(b, create_cart_opcode(op, 0, 0, 0, frm), buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : batch_run
+// Description  : send a batch through the pipelined client, check every
+//                response and release the batch; the batch owns the bus
+//                while it runs, and a LDCART is dropped if its server still
+//                has that cart loaded
+//
+// Inputs       : b - the batch
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t batch_run(CartBusBatch *b) {
+    static const char *what[CART_OP_MAXVAL] = {
+        "init", "zero memory", "load cartridge", "read frame", "write frame", "power off" };
+    uint64_t ky1, ky2, rt1, ct1, fm1;
+    int32_t ret = 0;
     
-    for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
-        //load cart
-        if ((ldcart = create_cart_opcode(CART_OP_LDCART, 0, 0, i, 0)) == -1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (cons)");
-            return(-1);
-        }
-        CartXferRegister oldcart = client_cart_bus_request(ldcart, NULL);
-        if (extract_cart_opcode(oldcart, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (decon).");
-            return(-1);
-        }
-        if (rt1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (return).");
-            return(-1);
-        }
-        
-        //zero memory
-        if ((bzero = create_cart_opcode(CART_OP_BZERO, 0, 0, 0, 0)) == -1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to zero memory (cons)");
-            return(-1);
+    if (b->count > 0) {
+        pthread_mutex_lock(&drv.busLock);
+        CartBusOp *ops = b->ops;
+        int count = 0;
+        int loaded[CART_MAX_SERVERS];
+        memcpy(loaded, drv.loadedCarts, sizeof(loaded));
+        for (int i = 0; i < b->count; i++) {
+            if (((ops[i].reg >> 56) & 0xff) == CART_OP_LDCART) {
+                int server = get_cart_server(ops[i].cart);
+                if (loaded[server] == ops[i].cart) {
+                    b->elided++;
+                    continue;
+                }
+                loaded[server] = ops[i].cart;
+            }
+            ops[count++] = ops[i];
         }
-        CartXferRegister obzero = client_cart_bus_request(bzero, NULL);
-        if (extract_cart_opcode(obzero, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to zero memory (decon).");
-            return(-1);
+        for (int s = 0; s < CART_MAX_SERVERS; s++)
+            drv.loadedCarts[s] = CART_NO_CARTRIDGE;
+        if (count > 0 && client_cart_bus_pipeline(ops, count)) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: bus pipeline failed.");
+            ret = -1;
         }
-        if (rt1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to zero memory (return).");
-            return(-1);
+        for (int i = 0; i < count && ret == 0; i++) {
+            uint64_t op = (ops[i].reg >> 56) & 0xff;
+            extract_cart_opcode(ops[i].resp, &ky1, &ky2, &rt1, &ct1, &fm1);
+            if (rt1) {
+                logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to %s (return).",
+                           (op < CART_OP_MAXVAL) ? what[op] : "execute");
+                ret = -1;
+            } else if (op == CART_OP_WRFRME && ops[i].cart != CART_NO_CARTRIDGE) {
+                drv.cartWritten[ops[i].cart] = 1;
+            }
         }
-        
+        if (ret == 0)
+            memcpy(drv.loadedCarts, loaded, sizeof(loaded));
+        drv.elidedLoads += b->elided;
+        CART_STAT_ADD(loadsElided, b->elided);
+        pthread_mutex_unlock(&drv.busLock);
     }
-    
-    init_cart_cache();
-    
-    // Return successfully
-    return(0);
+    free(b->ops);
+    b->ops = NULL;
+    b->count = b->capacity = b->elided = 0;
+    b->cart = CART_NO_CARTRIDGE;
+    return(ret);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_poweroff
-// Description  : Shut down the CART interface, close all files
+// Function     : zero_cartridge
+// Description  : load a cartridge and zero all of its frames (the caller
+//                marks it zeroed, under the allocator lock where needed)
 //
-// Inputs       : none
+// Inputs       : cart - the cartridge to zero
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_poweroff(void) {
-    uint64_t ldcart;
-    uint64_t bzero;
-    uint64_t powoff;
+int32_t zero_cartridge(int cart) {
+    CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
     
-    for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
-        //load cart
-        if ((ldcart = create_cart_opcode(CART_OP_LDCART, 0, 0, i, 0)) == -1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (cons)");
-            return(-1);
-        }
-        CartXferRegister oldcart = client_cart_bus_request(ldcart, NULL);
-        if (extract_cart_opcode(oldcart, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (decon).");
-            return(-1);
+    //load cart, then zero memory
+    if (batch_load(&batch, cart) ||
+        batch_add(&batch, create_cart_opcode(CART_OP_BZERO, 0, 0, 0, 0), NULL)) {
+        free(batch.ops);
+        return(-1);
+    }
+    return(batch_run(&batch));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_run
+// Description  : find the longest run of free frames on a cartridge
+//
+// Inputs       : c - the cartridge to search
+//                start - the first frame of the run (output)
+// Outputs      : the length of the run, 0 if the cartridge is full
+
+static int free_run(int c, int *start) {
+    int best = 0, run = 0;
+    
+    for (int j = 0; j < CART_CARTRIDGE_SIZE; j++) {
+        if (j % 64 == 0 && drv.frameMap[c][j / 64] == UINT64_MAX) {    //skip full words
+            run = 0;
+            j += 63;
+        } else if (drv.frameMap[c][j / 64] & (1ULL << (j % 64))) {
+            run = 0;
+        } else if (++run > best) {
+            best = run;
+            *start = j - run + 1;
         }
-        if (rt1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (return).");
-            return(-1);
+    }
+    return(best);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : place_frames
+// Description  : choose where allocate_frames puts a run, waiting for a
+//                cartridge being zeroed if nothing else has room (called
+//                with the allocator lock held)
+//
+// Inputs       : prefCart, prefFrm, server, want - as for allocate_frames
+//                start - the first frame of the run (output)
+//                length - the number of frames in the run (output)
+// Outputs      : the cartridge of the run, -1 if there is no room
+
+static int place_frames(int prefCart, int prefFrm, int server, int want, int *start, int *length) {
+    int c = -1;
+    
+    *start = *length = 0;
+    
+    //grow the file's last run in place
+    if (prefCart >= 0) {
+        while (prefFrm + *length < CART_CARTRIDGE_SIZE && *length < want &&
+               !(drv.frameMap[prefCart][(prefFrm + *length) / 64] & (1ULL << ((prefFrm + *length) % 64))))
+            (*length)++;
+        if (*length > 0) {
+            c = prefCart;
+            *start = prefFrm;
         }
-        
-        //zero memory
-        if ((bzero = create_cart_opcode(CART_OP_BZERO, 0, 0, 0, 0)) == -1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to zero memory (cons)");
-            return(-1);
+    }
+    
+    //else the file's cartridge, or the next one, with a gap long enough; on
+    //a fragmented device the longest gap there is, on the server if it has one
+    int from = (prefCart >= 0) ? prefCart : drv.currentCart;
+    int best = -1;
+    while (c < 0) {
+        for (int n = 0; n < 2 * CART_MAX_CARTRIDGES && *length < want; n++) {
+            int i = (from + n) % CART_MAX_CARTRIDGES;
+            if (n < CART_MAX_CARTRIDGES && server >= 0 && get_cart_server(i) != server)
+                continue;
+            if (n == CART_MAX_CARTRIDGES && (server < 0 || best >= 0))
+                break;
+            int s = 0, l = (drv.cartUsed[i] < CART_CARTRIDGE_SIZE && i != drv.zeroingCart) ? free_run(i, &s) : 0;
+            if (l > *length) {
+                if (s > 0 && l - want >= 2 * CART_RUN_GAP)     //split a large gap
+                    s += CART_RUN_GAP;
+                best = i;
+                *start = s;
+                *length = (l < want) ? l : want;
+            }
         }
-        CartXferRegister obzero = client_cart_bus_request(bzero, NULL);
-        if (extract_cart_opcode(obzero, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to zero memory (decon).");
-            return(-1);
+        c = best;
+        if (c >= 0 || drv.zeroingCart < 0)
+            break;
+        pthread_cond_wait(&drv.zeroedCond, &drv.allocLock);
+    }
+    return(c);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocate_frames
+// Description  : hand out a run of consecutive frames for a file, placed to
+//                keep each file in long runs on as few cartridges as
+//                possible: right after the file's last frame if that is
+//                free, else in the longest gap of the file's cartridge or of
+//                the next cartridge with a gap long enough; a run starting
+//                a large gap that follows used frames goes CART_RUN_GAP
+//                frames into it, so that the file before it still has room
+//                to grow in place, while small gaps are filled from the
+//                start; a cartridge is zeroed before its first frame is used,
+//                with the allocator lock dropped as in the zeroer, and one
+//                being zeroed is passed over (or waited for, if nothing else
+//                has room).  Given a server, cartridges on it are preferred.
+//
+// Inputs       : prefCart - the cartridge of the file's last frame, or -1
+//                prefFrm - the frame after the file's last frame
+//                server - the server to place the run on, or -1
+//                want - the number of frames wanted
+//                cart - the cartridge of the run (output)
+//                frm - the first frame of the run (output)
+// Outputs      : the number of frames allocated (1 to want), -1 if failure
+
+static int32_t allocate_frames(int prefCart, int prefFrm, int server, int want, int *cart, int *frm) {
+    int c, start, length;
+    
+    if (want > CART_CARTRIDGE_SIZE)
+        want = CART_CARTRIDGE_SIZE;
+    
+    //a fresh cartridge is zeroed with the lock dropped, one at a time, then
+    //the run is placed again as the frames may have moved on meanwhile
+    pthread_mutex_lock(&drv.allocLock);
+    while ((c = place_frames(prefCart, prefFrm, server, want, &start, &length)) >= 0 &&
+           drv.cartUsed[c] == 0 && !drv.cartZeroed[c]) {
+        if (drv.zeroingCart >= 0) {
+            pthread_cond_wait(&drv.zeroedCond, &drv.allocLock);
+            continue;
         }
-        if (rt1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to zero memory (return).");
+        drv.zeroingCart = c;
+        pthread_mutex_unlock(&drv.allocLock);
+        int32_t ret = zero_cartridge(c);
+        pthread_mutex_lock(&drv.allocLock);
+        if (ret == 0)
+            drv.cartZeroed[c] = 1;
+        drv.zeroingCart = -1;
+        pthread_cond_broadcast(&drv.zeroedCond);
+        if (ret) {
+            pthread_mutex_unlock(&drv.allocLock);
             return(-1);
         }
-        
     }
     
-    //close all open files
-    for (int i = 0; i < fileCount; i++)
-        if (allFile[i].isOpen == 1)
-            cart_close(allFile[i].fHandle);
-    
-    //power off
-    if ((powoff = create_cart_opcode(CART_OP_POWOFF, 0, 0, 0, 0)) == -1) {
-        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off (cons)");
-        return(-1);
-    }
-    CartXferRegister opowoff = client_cart_bus_request(powoff, NULL);
-    if (extract_cart_opcode(opowoff, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off (decon).");
-        return(-1);
-    }
-    if (rt1) {
-        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off (return).");
+    if (c < 0) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: out of frames.");
+        pthread_mutex_unlock(&drv.allocLock);
         return(-1);
     }
+    drv.cartEmptied[c] = 0;
     
-    close_cart_cache();
-    // Return successfully
-    return(0);
+    for (int j = start; j < start + length; j++)
+        drv.frameMap[c][j / 64] |= 1ULL << (j % 64);
+    drv.cartUsed[c] += length;
+    drv.currentCart = c;
+    pthread_mutex_unlock(&drv.allocLock);
+    CART_STAT_ADD(framesAllocated, length);
+    *cart = c;
+    *frm = start;
+    return(length);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_open
-// Description  : This function opens the file and returns a file handle
+// Function     : free_frames
+// Description  : give a run of frames back to the allocator, dropping them
+//                from the cache first; a cartridge that empties is handed
+//                to the zeroer.  A run with a frame the cache would not
+//                drop stays allocated, its next owner could see the copy.
 //
-// Inputs       : path - filename of the file to open
-// Outputs      : file handle if successful, -1 if failure
+// Inputs       : cart - the cartridge of the run
+//                frm - the first frame of the run
+//                length - the number of frames in the run
+// Outputs      : none
 
-int16_t cart_open(char *path) {
-    for (int i = 0; i < fileCount; i++) {
-        if(strcmp(allFile[i].fName, path) == 0){  //if the file exist
-            if (allFile[i].isOpen == 1) {         //if the file is already open
-                logMessage(LOG_ERROR_LEVEL, "file already open.");
-                return -1;
-            }
-            allFile[i].pos = 0;
-            allFile[i].isOpen = 1;
-            return allFile[i].fHandle;
+static void free_frames(int cart, int frm, int length) {
+    for (int j = 0; j < length; j++) {
+        if (drop_cart_cache(cart, frm + j)) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed to drop frame [%d/%d], %d frames not freed.",
+                       cart, frm + j, length);
+            return;
         }
     }
     
-    //if not exist
-    allFile[fileCount].fName = path;
-    allFile[fileCount].fHandle = fileCount;
-    allFile[fileCount].fLength = 0;
-    allFile[fileCount].pos = 0;
-    allFile[fileCount].isOpen = 1;
-    fileCount++;
-    currentFrame++;
-    if (currentFrame == 1024) {
-        currentCart++;
-        currentFrame = 0;
+    pthread_mutex_lock(&drv.allocLock);
+    for (int j = frm; j < frm + length; j++)
+        drv.frameMap[cart][j / 64] &= ~(1ULL << (j % 64));
+    drv.cartUsed[cart] -= length;
+    if (drv.cartUsed[cart] == 0) {
+        drv.cartZeroed[cart] = 0;
+        drv.cartEmptied[cart] = 1;
+        pthread_cond_signal(&drv.zeroerCond);
     }
-    return allFile[fileCount - 1].fHandle;
+    pthread_mutex_unlock(&drv.allocLock);
+    CART_STAT_ADD(framesFreed, length);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_close
-// Description  : This function closes the file
+// Function     : zeroer_main
+// Description  : background thread that zeroes cartridges once all of
+//                their frames have been freed, so deleted data does not
+//                linger and the next allocation does not wait for a BZERO;
+//                the allocator lock is dropped while the BZERO runs, the
+//                allocator passing over the cartridge meanwhile
 //
-// Inputs       : fd - the file descriptor
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : arg - unused
+// Outputs      : NULL
 
-int16_t cart_close(int16_t fd) {
-    if (fd > fileCount || fd < 0) {
-        logMessage(LOG_ERROR_LEVEL, "Invalid file Handle.");
-        return -1;
-    }
-    if (allFile[fd].isOpen == 0) {
-        logMessage(LOG_ERROR_LEVEL, "file not open.");
-        return -1;
+static void *zeroer_main(void *arg) {
+    pthread_mutex_lock(&drv.allocLock);
+    while (drv.zeroerRunning) {
+        int c;
+        if (drv.zeroingCart >= 0) {         //an allocator is zeroing a cartridge
+            pthread_cond_wait(&drv.zeroedCond, &drv.allocLock);
+            continue;
+        }
+        for (c = 0; c < CART_MAX_CARTRIDGES && !drv.cartEmptied[c]; c++)
+            ;
+        if (c == CART_MAX_CARTRIDGES) {
+            pthread_cond_wait(&drv.zeroerCond, &drv.allocLock);
+            continue;
+        }
+        drv.cartEmptied[c] = 0;
+        if (drv.cartUsed[c] != 0 || drv.cartZeroed[c])
+            continue;
+        drv.zeroingCart = c;
+        pthread_mutex_unlock(&drv.allocLock);
+        int32_t ret = zero_cartridge(c);
+        pthread_mutex_lock(&drv.allocLock);
+        if (ret)
+            logMessage(LOG_ERROR_LEVEL, "CART driver zeroer failed on cartridge %d.", c);
+        else
+            drv.cartZeroed[c] = 1;
+        drv.zeroingCart = -1;
+        pthread_cond_broadcast(&drv.zeroedCond);
     }
-    allFile[fd].isOpen = 0;
-    
-    // Return successfully
-    return (0);
+    pthread_mutex_unlock(&drv.allocLock);
+    return(NULL);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_read
-// Description  : Reads "count" bytes from the file handle "fh" into the
-//                buffer "buf"
+// Function     : read_frame
+// Description  : load a frame's cartridge and read the frame from it
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame to read
+//                buf - the buffer to read into
+// Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_read(int16_t fd, void *buf, int32_t count) {
-    if (fd > fileCount || fd < 0) {
-        logMessage(LOG_ERROR_LEVEL, "Invalid file Handle.");
-        return -1;
-    }
-    if (allFile[fd].isOpen == 0) {
-        logMessage(LOG_ERROR_LEVEL, "file not open.");
-        return -1;
-    }
-    if (count < 0) {
-        logMessage(LOG_ERROR_LEVEL, "Invalid length");
-        return -1;
-    }
+int read_frame(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
+    CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
     
-    uint64_t ldcart;
-    uint64_t rdfrme;
-    char tmp[CART_FRAME_SIZE];
-    int originPos = allFile[fd].pos;
-    int posFrame = originPos / CART_FRAME_SIZE;                         //record which frame the pos is in
-    int lenFrame = allFile[fd].fLength / CART_FRAME_SIZE;               //record which frame the length is in
-    int countFrame = (originPos + count) / CART_FRAME_SIZE;             //record which frame the count plus the pos is in
-    int remains = CART_FRAME_SIZE - originPos % CART_FRAME_SIZE;        //remaining space of the original position frame
-    
-    for (int i = posFrame, j = 0; i <= lenFrame; i++, j++) {
-        
-        if (get_cart_cache(allFile[fd].fCart[i], allFile[fd].fFrame[i]) != NULL) {              //hit
-            memcpy(tmp, get_cart_cache(allFile[fd].fCart[i], allFile[fd].fFrame[i]), CART_FRAME_SIZE);
-        }else{                                                              //miss
-            //load cart
-            if ((ldcart = create_cart_opcode(CART_OP_LDCART, 0, 0, allFile[fd].fCart[i], 0)) == -1) {
-                logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (cons)");
-                return(-1);
-            }
-            CartXferRegister oldcart = client_cart_bus_request(ldcart, NULL);
-            if (extract_cart_opcode(oldcart, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-                logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (decon).");
-                return(-1);
-            }
-            if (rt1) {
-                logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (return).");
-                return(-1);
-            }
-            //read frame
-            if ((rdfrme = create_cart_opcode(CART_OP_RDFRME, 0, 0, 0, allFile[fd].fFrame[i])) == -1) {
-                logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to read frame (cons)");
-                return(-1);
-            }
-            CartXferRegister ordfrme = client_cart_bus_request(rdfrme, tmp);
-            if (extract_cart_opcode(ordfrme, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-                logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to read frame (decon).");
-                return(-1);
-            }
-            if (rt1) {
-                logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to read frame (return).");
-                return(-1);
-            }
-            
-            put_cart_cache(allFile[fd].fCart[i], allFile[fd].fFrame[i], tmp);           //if miss, copy frame to cache
-        }
-        
-        if (i < lenFrame) {             //not reach length frame yet
-            if (i == posFrame) {        //the first(pos) frame
-                if (i == countFrame) {
-                    memcpy(buf, tmp + originPos % CART_FRAME_SIZE, count);
-                    allFile[fd].pos += count;
-                    return count;
-                }else{                  //if not the first frame, copy the remaing data from the first frame
-                    memcpy(buf, tmp + originPos % CART_FRAME_SIZE, remains);
-                    allFile[fd].pos += remains;
-                    j--;
-                }
-            }else{
-                if (i == countFrame) {  //the last(count) frame
-                    memcpy(buf + remains + CART_FRAME_SIZE * j, tmp, (originPos + count) % CART_FRAME_SIZE);
-                    allFile[fd].pos += (count + originPos) % CART_FRAME_SIZE;
-                    return count;
-                }else{                  //if not the last frame, copy the all data from that frame
-                    memcpy(buf + remains + CART_FRAME_SIZE * j, tmp, CART_FRAME_SIZE);
-                    allFile[fd].pos += CART_FRAME_SIZE;
-                }
-            }
-            
-        }else{                          //reach lenframe, compare length and count
-            if (i == posFrame){
-                if (originPos + count > allFile[fd].fLength){   //should read to the end of the file
-                    memcpy(buf, tmp + originPos % CART_FRAME_SIZE, allFile[fd].fLength - originPos);
-                    allFile[fd].pos += allFile[fd].fLength - originPos;
-                    return allFile[fd].fLength - originPos;
-                }else{                                          //enough bytes to read
-                    memcpy(buf, tmp + originPos % CART_FRAME_SIZE, count);
-                    allFile[fd].pos += count;
-                    return count;
-                }
-            }else{
-                if (originPos + count > allFile[fd].fLength){   //should read to the end of the file
-                    memcpy(buf + remains + CART_FRAME_SIZE * j, tmp, allFile[fd].fLength % CART_FRAME_SIZE);
-                    allFile[fd].pos += allFile[fd].fLength % CART_FRAME_SIZE;
-                    return allFile[fd].fLength - originPos;
-                }else{                                          //enough bytes to read
-                    memcpy(buf + remains + CART_FRAME_SIZE * j, tmp, (originPos + count) % CART_FRAME_SIZE);
-                    allFile[fd].pos += (count + originPos) % CART_FRAME_SIZE;
-                    return count;
-                }
-            }
-        }
+    if (batch_frame(&batch, CART_OP_RDFRME, cart, frm, buf)) {
+        free(batch.ops);
+        return(-1);
     }
-    return 0;
+    return(batch_run(&batch));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_write
-// Description  : Writes "count" bytes to the file handle "fh" from the
-//                buffer  "buf"
+// Function     : write_frame
+// Description  : load a frame's cartridge and write the frame to it
 //
-// Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
-// Outputs      : bytes written if successful, -1 if failure
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame to write
+//                buf - the frame contents
+// Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_write(int16_t fd, void *buf, int32_t count) {
+int write_frame(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
+    CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
     
-    if (fd > fileCount || fd < 0) {
-        logMessage(LOG_ERROR_LEVEL, "Invalid file Handle.");
-        return -1;
-    }
-    if (allFile[fd].isOpen == 0) {
-        logMessage(LOG_ERROR_LEVEL, "file not open.");
-        return -1;
-    }
-    if (count < 0) {
-        logMessage(LOG_ERROR_LEVEL, "Invalid length");
-        return -1;
+    if (batch_frame(&batch, CART_OP_WRFRME, cart, frm, buf)) {
+        free(batch.ops);
+        return(-1);
     }
+    return(batch_run(&batch));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_frames
+// Description  : write a batch of frames back to back, loading each
+//                cartridge once (the write-back function of the frame
+//                cache, which orders them by cartridge)
+//
+// Inputs       : frames - the frames and their contents
+//                count - the number of frames
+// Outputs      : 0 if successful, -1 if failure
+
+static int write_frames(CartCacheFrameRef *frames, int count) {
+    CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
     
-    uint64_t ldcart;
-    uint64_t rdfrme;
-    uint64_t wrfrme;
-    char tmp[CART_FRAME_SIZE];
-    const int originPos = allFile[fd].pos;
-    const int posFrame = originPos / CART_FRAME_SIZE;                   //record which frame the pos is in
-    const int lenFrame = allFile[fd].fLength / CART_FRAME_SIZE;         //record which frame the len is in
-    const int countFrame = (originPos + count) / CART_FRAME_SIZE;       //record which frame the count plus the pos is in
-    int remains = CART_FRAME_SIZE - originPos % CART_FRAME_SIZE;        //remaining space of the original position frame
-    
-    //create a frame for a file's first write
-    if (allFile[fd].pos == 0 && allFile[fd].fLength == 0) {
-        allFile[fd].fFrame[0] = currentFrame;
-        allFile[fd].fCart[0] = currentCart;
-    }
-    
-    for (int i = posFrame, j = 0; i <= countFrame; i++, j++) {
-         if (get_cart_cache(allFile[fd].fCart[i], allFile[fd].fFrame[i]) != NULL) {              //hit
-                memcpy(tmp, get_cart_cache(allFile[fd].fCart[i], allFile[fd].fFrame[i]), CART_FRAME_SIZE);
-            }else{                                                              //miss
-                //load cart
-                if ((ldcart = create_cart_opcode(CART_OP_LDCART, 0, 0, allFile[fd].fCart[i], 0)) == -1) {
-                    logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (cons)");
-                    return(-1);
-                }
-                CartXferRegister oldcart = client_cart_bus_request(ldcart, NULL);
-                if (extract_cart_opcode(oldcart, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-                    logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (decon).");
-                    return(-1);
-                }
-                if (rt1) {
-                    logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to load cartridge (return).");
-                    return(-1);
-                }
-                //read frame
-                if ((rdfrme = create_cart_opcode(CART_OP_RDFRME, 0, 0, 0, allFile[fd].fFrame[i])) == -1) {
-                    logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to read frame (cons)");
-                    return(-1);
-                }
-                CartXferRegister ordfrme = client_cart_bus_request(rdfrme, tmp);
-                if (extract_cart_opcode(ordfrme, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-                    logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to read frame (decon).");
-                    return(-1);
-                }
-                if (rt1) {
-                    logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to read frame (return).");
-                    return(-1);
-                }
-            }
-        if (i <= lenFrame) {                    //not reach length frame yet
-            if (i == posFrame) {                            //the first(pos) frame
-                if (i == countFrame) {
-                    
-                    memcpy(tmp + originPos % CART_FRAME_SIZE, buf, count);
-                    allFile[fd].pos += count;
-                    if (originPos + count > allFile[fd].fLength)
-                        allFile[fd].fLength = originPos + count;
-                    
-                }else{                                      //if not the first frame, write the remaing data for the first frame
-                    
-                    memcpy(tmp + originPos % CART_FRAME_SIZE, buf, remains);
-                    allFile[fd].pos += remains;
-                    j--;
-                }
-            }else{                                          //the last(count) frame
-                if (i == countFrame) {
-                    memcpy(tmp, buf + remains + j * CART_FRAME_SIZE, (count + originPos) % CART_FRAME_SIZE);
-                    allFile[fd].pos += (count + originPos) % CART_FRAME_SIZE;
-                    if (originPos + count > allFile[fd].fLength)
-                        allFile[fd].fLength = originPos + count;
-                }else{                                      //if not the last frame, write to that frame until it is full
-                    memcpy(tmp, buf + remains + j * CART_FRAME_SIZE, CART_FRAME_SIZE);
-                    allFile[fd].pos += CART_FRAME_SIZE;
-                }
-            }
-        } else {                                            //reach length frame
-            
-            currentFrame++;
-            if (currentFrame == 1024) {
-                currentCart++;
-                currentFrame = 0;
-            }
-            allFile[fd].fFrame[i] = currentFrame;                      //create a new frame
-            allFile[fd].fCart[i] = currentCart;
-           
-            if (i != countFrame) {                          //check if i reach the count's frame
-                memcpy(tmp, buf + remains + j * CART_FRAME_SIZE, CART_FRAME_SIZE);
-                allFile[fd].pos += CART_FRAME_SIZE;
-            }else{
-                memcpy(tmp, buf + remains + j * CART_FRAME_SIZE, (count + originPos) % CART_FRAME_SIZE);
-                allFile[fd].pos += (count + originPos) % CART_FRAME_SIZE;
-                allFile[fd].fLength = originPos + count;
-            }
-        }
-        
-        
-        
-        //write frame
-        if ((wrfrme = create_cart_opcode(CART_OP_WRFRME, 0, 0, 0, allFile[fd].fFrame[i])) == -1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to write frame (cons)");
-            return(-1);
-        }
-        CartXferRegister owrfrme = client_cart_bus_request(wrfrme, tmp);
-        if (extract_cart_opcode(owrfrme, &ky1, &ky2, &rt1, &ct1, &fm1)) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to write frame (decon).");
-            return(-1);
-        }
-        if (rt1) {
-            logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to write frame (return).");
+    for (int k = 0; k < count; k++) {
+        if (batch_frame(&batch, CART_OP_WRFRME, frames[k].cart, frames[k].frm, frames[k].frame)) {
+            free(batch.ops);
             return(-1);
         }
-        put_cart_cache(allFile[fd].fCart[i], allFile[fd].fFrame[i], tmp);
-        
-        
     }
-    return count;
+    return(batch_run(&batch));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_seek
-// Description  : Seek to specific point in the file
+// Function     : io_chunk
+// Description  : number of frames a read or write pins at once, leaving at
+//                least half of the cache free for eviction
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
+// Inputs       : none
+// Outputs      : the chunk size in frames
+
+static int io_chunk(void) {
+    int chunk = get_cart_cache_size() / 2;
+    if (chunk > CART_IO_CHUNK)
+        chunk = CART_IO_CHUNK;
+    return (chunk < 1) ? 1 : chunk;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reserve_pins / release_pins
+// Description  : take / return part of the pin budget, so that threads
+//                pinning chunks together can never pin the whole cache
+//
+// Inputs       : n - number of frames (at most io_chunk())
+// Outputs      : none
+
+static void reserve_pins(int n) {
+    pthread_mutex_lock(&drv.pinLock);
+    while (drv.pinBudget < n)
+        pthread_cond_wait(&drv.pinCond, &drv.pinLock);
+    drv.pinBudget -= n;
+    pthread_mutex_unlock(&drv.pinLock);
+}
+
+static void release_pins(int n) {
+    pthread_mutex_lock(&drv.pinLock);
+    drv.pinBudget += n;
+    pthread_cond_broadcast(&drv.pinCond);
+    pthread_mutex_unlock(&drv.pinLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flusher_main
+// Description  : background thread that writes back dirty frames when the
+//                dirty ratio passes the high watermark or frames get old
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void *flusher_main(void *arg) {
+    struct timespec deadline;
+    
+    pthread_mutex_lock(&drv.flusherLock);
+    while (drv.flusherRunning) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CART_FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&drv.flusherCond, &drv.flusherLock, &deadline);
+        if (!drv.flusherRunning)
+            break;
+        pthread_mutex_unlock(&drv.flusherLock);
+        
+        //drain to the low watermark once past the high one, else only flush old frames
+        uint32_t size = get_cart_cache_size();
+        uint32_t keep = UINT32_MAX;
+        if (get_cart_cache_dirty() * 100 > (uint64_t)size * drv.flushHighPct)
+            keep = (uint32_t)((uint64_t)size * drv.flushLowPct / 100);
+        if (flush_cart_cache(keep, drv.flushMaxAgeMs))
+            logMessage(LOG_ERROR_LEVEL, "CART driver flusher failed to write back frames.");
+        pthread_mutex_lock(&drv.flusherLock);
+    }
+    pthread_mutex_unlock(&drv.flusherLock);
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_write_policy
+// Description  : Choose between write-through and write-back caching (must
+//                be called before poweron)
+//
+// Inputs       : policy - CART_WRITE_THROUGH or CART_WRITE_BACK
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_seek(int16_t fd, uint32_t loc) {
-    if (fd > fileCount || fd < 0) {
-        logMessage(LOG_ERROR_LEVEL, "Invalid file Handle.");
-        return -1;
+int32_t cart_set_write_policy(CartWritePolicy policy) {
+    if (policy != CART_WRITE_THROUGH && policy != CART_WRITE_BACK) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid write policy.");
+        return(-1);
     }
-    if (loc > allFile[fd].fLength) {
-        logMessage(LOG_ERROR_LEVEL, "loc is beyond the end of the file");
+    drv.writePolicy = policy;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_flusher
+// Description  : Configure the background flusher used in write-back mode
+//                (must be called before poweron)
+//
+// Inputs       : high_pct - dirty percentage of the cache that starts a flush
+//                           (0 disables the flusher)
+//                low_pct - dirty percentage a flush drains down to
+//                max_age_ms - age at which a dirty frame is flushed (0 = none)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_flusher(uint32_t high_pct, uint32_t low_pct, uint32_t max_age_ms) {
+    if (high_pct > 100 || low_pct > high_pct) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid flusher watermarks.");
+        return(-1);
+    }
+    drv.flushHighPct = high_pct;
+    drv.flushLowPct = low_pct;
+    drv.flushMaxAgeMs = max_age_ms;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_init_policy
+// Description  : Choose how cartridges are zeroed (must be called before
+//                poweron)
+//
+// Inputs       : policy - CART_INIT_EAGER or CART_INIT_LAZY
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_init_policy(CartInitPolicy policy) {
+    if (policy != CART_INIT_EAGER && policy != CART_INIT_LAZY) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid cartridge init policy.");
+        return(-1);
+    }
+    drv.initPolicy = policy;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_mount_policy
+// Description  : Choose whether the file table survives a power cycle (must
+//                be called before poweron)
+//
+// Inputs       : policy - CART_MOUNT_FORMAT or CART_MOUNT_PERSIST
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_mount_policy(CartMountPolicy policy) {
+    if (policy != CART_MOUNT_FORMAT && policy != CART_MOUNT_PERSIST) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid mount policy.");
+        return(-1);
+    }
+    drv.mountPolicy = policy;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_shutdown_policy
+// Description  : Choose what cart_poweroff erases before powering off
+//
+// Inputs       : policy - CART_SHUTDOWN_FAST or CART_SHUTDOWN_SECURE
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_shutdown_policy(CartShutdownPolicy policy) {
+    if (policy != CART_SHUTDOWN_FAST && policy != CART_SHUTDOWN_SECURE) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid shutdown policy.");
+        return(-1);
+    }
+    drv.shutdownPolicy = policy;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poweron
+// Description  : Startup up the CART interface, initialize filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_poweron(void) {
+    uint64_t initms;
+    uint64_t ky1, ky2, rt1, ct1, fm1;
+    
+    //initialize
+    if ((initms = create_cart_opcode(CART_OP_INITMS, 0, 0, 0, 0)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail on init (cons)");
+        return(-1);
+    }
+    CartXferRegister oinitms = client_cart_bus_request(initms, NULL);
+    if (extract_cart_opcode(oinitms, &ky1, &ky2, &rt1, &ct1, &fm1)) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail on init (decon).");
+        return(-1);
+    }
+    if (rt1) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail on init (return).");
+        return(-1);
+    }
+    drv.servers = get_cart_server_count();
+    for (int s = 0; s < CART_MAX_SERVERS; s++)
+        drv.loadedCarts[s] = CART_NO_CARTRIDGE;
+    drv.elidedLoads = 0;
+    drv.prefetchIssued = 0;
+    memset(drv.cartZeroed, 0, sizeof(drv.cartZeroed));
+    memset(drv.cartEmptied, 0, sizeof(drv.cartEmptied));
+    memset(drv.cartWritten, 0, sizeof(drv.cartWritten));
+    
+    //a persistent file table costs a read of the superblock and the table
+    if (drv.mountPolicy == CART_MOUNT_PERSIST && mount_filesystem())
+        return(-1);
+    
+    //in lazy mode cartridges are zeroed by allocate_frames on first use
+    if (drv.initPolicy == CART_INIT_EAGER) {
+        for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
+            if (drv.cartUsed[i] == 0) {
+                if (zero_cartridge(i))
+                    return(-1);
+                drv.cartZeroed[i] = 1;
+            }
+        }
+    }
+    
+    if (init_cart_cache())
+        return(-1);
+    set_cart_cache_writeback(write_frames);
+    drv.pinBudget = io_chunk();
+    
+    drv.zeroerRunning = 1;
+    if (pthread_create(&drv.zeroerThread, NULL, zeroer_main, NULL)) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot start zeroer.");
+        drv.zeroerRunning = 0;
+        return(-1);
+    }
+    
+    if (drv.writePolicy == CART_WRITE_BACK && drv.flushHighPct > 0) {
+        drv.flusherRunning = 1;
+        if (pthread_create(&drv.flusherThread, NULL, flusher_main, NULL)) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot start flusher.");
+            drv.flusherRunning = 0;
+            return(-1);
+        }
+    }
+    
+    // Return successfully
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poweroff
+// Description  : Shut down the CART interface, close all files
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_poweroff(void) {
+    uint64_t powoff;
+    uint64_t ky1, ky2, rt1, ct1, fm1;
+    uint64_t prefetchHits, prefetchWasted;
+    uint64_t cacheHits, cacheMisses;
+    const char *policyName;
+    
+    //finish any queued asynchronous requests first
+    cart_async_drain();
+    
+    //stop the flusher, then write back everything it left behind
+    if (drv.flusherRunning) {
+        pthread_mutex_lock(&drv.flusherLock);
+        drv.flusherRunning = 0;
+        pthread_cond_signal(&drv.flusherCond);
+        pthread_mutex_unlock(&drv.flusherLock);
+        pthread_join(drv.flusherThread, NULL);
+    }
+    
+    //close all open files
+    for (int i = 0; i < drv.handleCount; i++)
+        if (drv.handles[i] != NULL)
+            cart_close(i);
+    if (flush_cart_cache(0, 0))
+        return(-1);
+    
+    //emptied cartridges not zeroed yet stay as they are
+    if (drv.zeroerRunning) {
+        pthread_mutex_lock(&drv.allocLock);
+        drv.zeroerRunning = 0;
+        pthread_cond_signal(&drv.zeroerCond);
+        pthread_mutex_unlock(&drv.allocLock);
+        pthread_join(drv.zeroerThread, NULL);
+    }
+    
+    //a secure shutdown erases the table along with everything else
+    if (drv.mountPolicy == CART_MOUNT_PERSIST && drv.shutdownPolicy != CART_SHUTDOWN_SECURE &&
+        save_filesystem())
+        return(-1);
+    
+    //secure erase only needs to touch cartridges that hold data
+    if (drv.shutdownPolicy == CART_SHUTDOWN_SECURE) {
+        for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
+            if (drv.cartWritten[i] && zero_cartridge(i))
+                return(-1);
+        }
+        scrub_cart_cache();
+    }
+    
+    //power off
+    if ((powoff = create_cart_opcode(CART_OP_POWOFF, 0, 0, 0, 0)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off (cons)");
+        return(-1);
+    }
+    CartXferRegister opowoff = client_cart_bus_request(powoff, NULL);
+    if (extract_cart_opcode(opowoff, &ky1, &ky2, &rt1, &ct1, &fm1)) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off (decon).");
+        return(-1);
+    }
+    if (rt1) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: fail to power off (return).");
+        return(-1);
+    }
+    for (int s = 0; s < CART_MAX_SERVERS; s++)
+        drv.loadedCarts[s] = CART_NO_CARTRIDGE;
+    logMessage(LOG_INFO_LEVEL, "CART driver elided %llu redundant cartridge loads.",
+               (unsigned long long)drv.elidedLoads);
+    get_cart_cache_prefetch_stats(&prefetchHits, &prefetchWasted);
+    logMessage(LOG_INFO_LEVEL, "CART driver read-ahead: %llu frames prefetched, %llu hit, %llu wasted.",
+               (unsigned long long)drv.prefetchIssued, (unsigned long long)prefetchHits,
+               (unsigned long long)prefetchWasted);
+    policyName = get_cart_cache_stats(&cacheHits, &cacheMisses);
+    logMessage(LOG_INFO_LEVEL, "CART driver cache (%s): %llu hits, %llu misses, %.2f%% miss ratio.",
+               policyName, (unsigned long long)cacheHits, (unsigned long long)cacheMisses,
+               (cacheHits + cacheMisses) ? 100.0 * cacheMisses / (cacheHits + cacheMisses) : 0.0);
+    cart_stats_log_latency();
+    
+    close_cart_cache();
+    unmount_filesystem();
+    // Return successfully
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : name_hash
+// Description  : hash a file name (FNV-1a)
+//
+// Inputs       : name - the file name
+// Outputs      : the hash
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++)
+        h = (h ^ *c) * 16777619u;
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_file
+// Description  : look a file up by name
+//
+// Inputs       : name - the file name
+//                h - the hash of the name
+// Outputs      : the file, NULL if it does not exist
+
+static struct cartFile *find_file(const char *name, uint32_t h) {
+    if (drv.names == NULL)
+        return NULL;
+    for (struct cartFile *f = drv.names[h & drv.nameMask]; f != NULL; f = f->hnext) {
+        if (f->fHash == h && strcmp(f->fName, name) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_file
+// Description  : create an empty file under a copy of the name, doubling
+//                the name table when it holds as many files as buckets
+//
+// Inputs       : name - the file name
+//                h - the hash of the name
+// Outputs      : the file, NULL if failure
+
+static struct cartFile *create_file(const char *name, uint32_t h) {
+    struct cartFile *f;
+    
+    if (drv.fileCount == CART_MAX_TOTAL_FILES) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: too many files.");
+        return NULL;
+    }
+    if (drv.names == NULL || drv.fileCount > drv.nameMask) {
+        int nbuckets = (drv.names == NULL) ? 64 : (drv.nameMask + 1) * 2;
+        struct cartFile **names = calloc(nbuckets, sizeof(struct cartFile *));
+        if (names == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot grow file table.");
+            return NULL;
+        }
+        for (int i = 0; drv.names != NULL && i <= drv.nameMask; i++) {
+            while ((f = drv.names[i]) != NULL) {
+                drv.names[i] = f->hnext;
+                f->hnext = names[f->fHash & (nbuckets - 1)];
+                names[f->fHash & (nbuckets - 1)] = f;
+            }
+        }
+        free(drv.names);
+        drv.names = names;
+        drv.nameMask = nbuckets - 1;
+    }
+    
+    if ((f = calloc(1, sizeof(struct cartFile))) == NULL || (f->fName = strdup(name)) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate file.");
+        free(f);
+        return NULL;
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    f->fHash = h;
+    f->fHandle = -1;
+    f->fLength = 0;
+    f->fAlloc = 0;      //frames are allocated by the first write
+    f->fReserve = 0;
+    f->raLast = -1;
+    f->hnext = drv.names[h & drv.nameMask];
+    drv.names[h & drv.nameMask] = f;
+    drv.fileCount++;
+    return f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_file
+// Description  : release a file no longer in the namespace
+//
+// Inputs       : f - the file
+// Outputs      : none
+
+static void free_file(struct cartFile *f) {
+    pthread_mutex_destroy(&f->lock);
+    free(f->ext);
+    free(f->fName);
+    free(f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_handle / free_handle
+// Description  : hand out a file handle, reusing closed ones first / give a
+//                handle back
+//
+// Inputs       : f - the file the handle refers to
+//                fd - the handle
+// Outputs      : the handle, -1 if failure / none
+
+static int16_t alloc_handle(struct cartFile *f) {
+    int16_t fd;
+    
+    if (drv.freeCount > 0) {
+        fd = drv.freeHandles[--drv.freeCount];
+    } else {
+        if (drv.handleCount == CART_MAX_OPEN_FILES) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: too many open files.");
+            return -1;
+        }
+        if (drv.handleCount == drv.handleCapacity) {
+            int capacity = (drv.handleCapacity == 0) ? 64 : drv.handleCapacity * 2;
+            if (capacity > CART_MAX_OPEN_FILES)
+                capacity = CART_MAX_OPEN_FILES;
+            struct cartFile **handles = realloc(drv.handles, capacity * sizeof(struct cartFile *));
+            if (handles != NULL)
+                drv.handles = handles;
+            int16_t *freeHandles = realloc(drv.freeHandles, capacity * sizeof(int16_t));
+            if (freeHandles != NULL)
+                drv.freeHandles = freeHandles;
+            if (handles == NULL || freeHandles == NULL) {
+                logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot grow handle table.");
+                return -1;
+            }
+            drv.handleCapacity = capacity;
+        }
+        fd = drv.handleCount++;
+    }
+    drv.handles[fd] = f;
+    return fd;
+}
+
+static void free_handle(int16_t fd) {
+    drv.handles[fd] = NULL;
+    drv.freeHandles[drv.freeCount++] = fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_open
+// Description  : This function opens the file and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+
+static int16_t do_cart_open(char *path) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= CART_MAX_PATH_LENGTH) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid file name.");
         return -1;
     }
-    if (allFile[fd].isOpen == 0) {
-        logMessage(LOG_ERROR_LEVEL, "file not open.");
+    
+    uint32_t h = name_hash(path);
+    struct cartFile *f = find_file(path, h);
+    if (f == NULL && (f = create_file(path, h)) == NULL)      //if not exist
         return -1;
+    
+    pthread_mutex_lock(&f->lock);
+    int16_t fd = -1;
+    if (f->isOpen == 1) {                   //if the file is already open
+        logMessage(LOG_ERROR_LEVEL, "file already open.");
+    } else if ((fd = alloc_handle(f)) != -1) {
+        f->fHandle = fd;
+        f->pos = 0;
+        f->isOpen = 1;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_frame
+// Description  : find where a frame of a file lives; the last extent used
+//                and the one after it are tried before a binary search
+//
+// Inputs       : f - the file
+//                i - the index of the frame within the file (< fAlloc)
+//                cart - the cartridge of the frame (output)
+//                frm - the frame on the cartridge (output)
+// Outputs      : none
+
+static void file_frame(struct cartFile *f, int64_t i, int *cart, int *frm) {
+    int e = f->extHint;
+    
+    if (i < f->ext[e].first || i >= f->ext[e].first + f->ext[e].length) {
+        if (e + 1 < f->extCount && i >= f->ext[e + 1].first &&
+            i < f->ext[e + 1].first + f->ext[e + 1].length) {
+            e++;
+        } else {
+            int lo = 0, hi = f->extCount - 1;       //last extent starting at or before i
+            while (lo < hi) {
+                int mid = (lo + hi + 1) / 2;
+                if (f->ext[mid].first <= i)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+            e = lo;
+        }
+        f->extHint = e;
     }
-    allFile[fd].pos = loc;  //change the current position to loc
+    *cart = f->ext[e].cart;
+    *frm = f->ext[e].frame + (int)(i - f->ext[e].first);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_append
+// Description  : add a newly allocated run of frames to the end of a file,
+//                growing the last extent when the run follows it on the
+//                cartridge
+//
+// Inputs       : f - the file
+//                cart - the cartridge of the run
+//                frm - the first frame of the run on the cartridge
+//                length - the number of frames in the run
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t file_append(struct cartFile *f, int cart, int frm, int length) {
+    CartExtent *last = (f->extCount > 0) ? &f->ext[f->extCount - 1] : NULL;
     
-    // Return successfully
-    return (0);
+    if (last != NULL && last->cart == cart && last->frame + last->length == (uint32_t)frm) {
+        last->length += length;
+    } else {
+        if (f->extCount == f->extCapacity) {
+            int capacity = (f->extCapacity == 0) ? 4 : f->extCapacity * 2;
+            CartExtent *ext = realloc(f->ext, capacity * sizeof(CartExtent));
+            if (ext == NULL) {
+                logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot grow file extents.");
+                return(-1);
+            }
+            f->ext = ext;
+            f->extCapacity = capacity;
+        }
+        f->ext[f->extCount].first = f->fAlloc;
+        f->ext[f->extCount].cart = cart;
+        f->ext[f->extCount].frame = frm;
+        f->ext[f->extCount].length = length;
+        f->extCount++;
+    }
+    f->fAlloc += length;
+    return(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_trim
+// Description  : free the frames of a file from a given frame on
+//
+// Inputs       : f - the file
+//                keep - the number of frames the file keeps
+// Outputs      : none
+
+static void file_trim(struct cartFile *f, int64_t keep) {
+    while (f->extCount > 0) {
+        CartExtent *e = &f->ext[f->extCount - 1];
+        if (e->first >= keep) {                             //the whole run goes
+            free_frames(e->cart, e->frame, e->length);
+            f->extCount--;
+        } else {                                            //maybe its tail
+            int cut = (int)(e->first + e->length - keep);
+            if (cut > 0) {
+                free_frames(e->cart, e->frame + e->length - cut, cut);
+                e->length -= cut;
+            }
+            break;
+        }
+    }
+    if (f->fAlloc > keep)
+        f->fAlloc = keep;
+    f->extHint = 0;
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_grow
+// Description  : allocate frames to a file until it has a given number,
+//                in as few runs as the free space allows; with several
+//                servers the file is striped across them in stripes of
+//                CART_STRIPE_FRAMES, each continuing the file's last run on
+//                its server, so that long transfers keep every server busy;
+//                if the frames run out, the file gets none of them
+//
+// Inputs       : f - the file
+//                frames - the number of frames the file needs
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t file_grow(struct cartFile *f, int64_t frames) {
+    const int64_t alloc = f->fAlloc;
+    
+    while (f->fAlloc < frames) {
+        CartExtent *last = (f->extCount > 0) ? &f->ext[f->extCount - 1] : NULL;
+        int64_t want = frames - f->fAlloc;
+        int server = -1, cart, frm;
+        if (drv.servers > 1) {
+            int64_t stripe = f->fAlloc / CART_STRIPE_FRAMES;
+            server = (int)((f->fHash + stripe) % drv.servers);
+            if (want > (stripe + 1) * CART_STRIPE_FRAMES - f->fAlloc)
+                want = (stripe + 1) * CART_STRIPE_FRAMES - f->fAlloc;
+            for (last = (f->extCount > 0) ? &f->ext[f->extCount - 1] : NULL;
+                 last != NULL && get_cart_server(last->cart) != server; )
+                last = (last > f->ext) ? last - 1 : NULL;
+        }
+        int32_t length = allocate_frames(last ? last->cart : -1, last ? (int)(last->frame + last->length) : 0,
+                                         server, (want < CART_CARTRIDGE_SIZE) ? (int)want : CART_CARTRIDGE_SIZE,
+                                         &cart, &frm);
+        if (length == -1) {
+            file_trim(f, alloc);
+            return(-1);
+        }
+        if (file_append(f, cart, frm, length)) {
+            free_frames(cart, frm, length);
+            file_trim(f, alloc);
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_sum
+// Description  : checksum a block of metadata (FNV-1a)
+//
+// Inputs       : data - the metadata
+//                len - its length in bytes
+// Outputs      : the checksum
+
+static uint32_t meta_sum(const void *data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ ((const unsigned char *)data)[i]) * 16777619u;
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_put / meta_get
+// Description  : append a field to the file table being written / take the
+//                next field of the file table being read
+//
+// Inputs       : m - the table being written
+//                p - the read position in the table (updated)
+//                end - the end of the table
+//                data - the field
+//                len - the length of the field
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t meta_put(CartMetaBuffer *m, const void *data, size_t len) {
+    if (m->len + len > m->capacity) {
+        size_t capacity = (m->capacity == 0) ? CART_FRAME_SIZE : m->capacity * 2;
+        while (capacity < m->len + len)
+            capacity *= 2;
+        char *buf = realloc(m->data, capacity);
+        if (buf == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot grow file table.");
+            return(-1);
+        }
+        m->data = buf;
+        m->capacity = capacity;
+    }
+    memcpy(m->data + m->len, data, len);
+    m->len += len;
+    return(0);
+}
+
+static int32_t meta_get(const char **p, const char *end, void *data, size_t len) {
+    if ((size_t)(end - *p) < len)
+        return(-1);
+    memcpy(data, *p, len);
+    *p += len;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_valid / mark_frames
+// Description  : check that a run of frames read from the file table lies on
+//                the device / take a run of frames that the file table says
+//                are in use
+//
+// Inputs       : cart - the cartridge of the run
+//                frm - the first frame of the run
+//                length - the number of frames in the run
+// Outputs      : 1 if valid, 0 if not / 0 if successful, -1 if the run is
+//                invalid or already used
+
+static int extent_valid(uint32_t cart, uint32_t frm, uint32_t length) {
+    return(cart < CART_MAX_CARTRIDGES && length > 0 && (uint64_t)frm + length <= CART_CARTRIDGE_SIZE);
+}
+
+static int32_t mark_frames(uint32_t cart, uint32_t frm, uint32_t length) {
+    if (!extent_valid(cart, frm, length))
+        return(-1);
+    for (uint32_t j = frm; j < frm + length; j++) {
+        if (drv.frameMap[cart][j / 64] & (1ULL << (j % 64)))
+            return(-1);
+        drv.frameMap[cart][j / 64] |= 1ULL << (j % 64);
+    }
+    drv.cartUsed[cart] += length;
+    drv.cartWritten[cart] = 1;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : save_filesystem
+// Description  : write the file table to newly allocated frames, then point
+//                the superblock at it and free the previous table; the
+//                superblock is a single frame, so a poweroff at any point
+//                leaves either the old table or the new one in place
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t save_filesystem(void) {
+    CartMetaBuffer m = { NULL, 0, 0 };
+    CartSuperblock sb;
+    int32_t ret = 0;
+    
+    memset(&sb, 0, sizeof(sb));
+    for (int b = 0; drv.names != NULL && b <= drv.nameMask && ret == 0; b++) {
+        for (struct cartFile *f = drv.names[b]; f != NULL && ret == 0; f = f->hnext) {
+            uint16_t nameLen = strlen(f->fName);
+            uint32_t extCount;
+            pthread_mutex_lock(&f->lock);
+            extCount = f->extCount;
+            if (meta_put(&m, &nameLen, sizeof(nameLen)) || meta_put(&m, f->fName, nameLen) ||
+                meta_put(&m, &f->fLength, sizeof(f->fLength)) || meta_put(&m, &f->fReserve, sizeof(f->fReserve)) ||
+                meta_put(&m, &extCount, sizeof(extCount)))
+                ret = -1;
+            for (int e = 0; e < f->extCount && ret == 0; e++) {
+                if (meta_put(&m, &f->ext[e].cart, sizeof(f->ext[e].cart)) ||
+                    meta_put(&m, &f->ext[e].frame, sizeof(f->ext[e].frame)) ||
+                    meta_put(&m, &f->ext[e].length, sizeof(f->ext[e].length)))
+                    ret = -1;
+            }
+            pthread_mutex_unlock(&f->lock);
+            sb.fileCount++;
+        }
+    }
+    int64_t frames = (m.len + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+    if (ret == 0 && frames * CART_FRAME_SIZE > (int64_t)m.len) {
+        char pad[CART_FRAME_SIZE] = { 0 };
+        ret = meta_put(&m, pad, frames * CART_FRAME_SIZE - m.len);
+    }
+    sb.magic = CART_META_MAGIC;
+    sb.version = CART_META_VERSION;
+    sb.generation = drv.super.generation + 1;
+    sb.tableBytes = m.len;
+    sb.tableSum = meta_sum(m.data, m.len);
+    
+    //the table goes in runs as long as the free space allows
+    CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
+    for (int64_t done = 0; done < frames && ret == 0; ) {
+        int cart, frm, n;
+        if (sb.extCount == CART_META_EXTENTS) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: no room for the file table.");
+            ret = -1;
+            break;
+        }
+        n = allocate_frames(-1, 0, -1, (frames - done < CART_CARTRIDGE_SIZE) ? (int)(frames - done) : CART_CARTRIDGE_SIZE,
+                            &cart, &frm);
+        if (n == -1) {
+            ret = -1;
+            break;
+        }
+        sb.ext[sb.extCount].cart = cart;
+        sb.ext[sb.extCount].frame = frm;
+        sb.ext[sb.extCount].length = n;
+        sb.extCount++;
+        for (int j = 0; j < n && ret == 0; j++)
+            ret = batch_frame(&batch, CART_OP_WRFRME, cart, frm + j, m.data + (done + j) * CART_FRAME_SIZE);
+        done += n;
+    }
+    if (ret == 0) {
+        ret = batch_run(&batch);
+    } else {
+        free(batch.ops);
+    }
+    
+    if (ret == 0) {
+        char frame[CART_FRAME_SIZE] = { 0 };
+        sb.sum = meta_sum(&sb, sizeof(sb));
+        memcpy(frame, &sb, sizeof(sb));
+        ret = write_frame(0, 0, frame);
+    }
+    
+    //free whichever table is no longer in use
+    CartSuperblock *old = (ret == 0) ? &drv.super : &sb;
+    for (uint32_t i = 0; i < old->extCount; i++)
+        free_frames(old->ext[i].cart, old->ext[i].frame, old->ext[i].length);
+    if (ret == 0)
+        drv.super = sb;
+    free(m.data);
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mount_filesystem
+// Description  : read the superblock and the file table it points to, and
+//                rebuild the files and the frame allocator from them; a
+//                device without a valid superblock starts empty
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t mount_filesystem(void) {
+    char frame[CART_FRAME_SIZE];
+    CartSuperblock sb;
+    uint32_t sum;
+    
+    if (read_frame(0, 0, frame))
+        return(-1);
+    memcpy(&sb, frame, sizeof(sb));
+    sum = sb.sum;
+    sb.sum = 0;
+    if (sb.magic != CART_META_MAGIC || sb.version != CART_META_VERSION ||
+        sb.extCount > CART_META_EXTENTS || meta_sum(&sb, sizeof(sb)) != sum) {
+        logMessage(LOG_INFO_LEVEL, "CART driver found no file table, starting empty.");
+        memset(&drv.super, 0, sizeof(drv.super));
+        if (!drv.cartZeroed[0]) {
+            if (zero_cartridge(0))
+                return(-1);
+            drv.cartZeroed[0] = 1;
+        }
+        return(mark_frames(0, 0, 1));
+    }
+    
+    //read the table back to back, once every run of it is known to be on the device
+    int64_t frames = 0;
+    for (uint32_t i = 0; i < sb.extCount; i++) {
+        if (!extent_valid(sb.ext[i].cart, sb.ext[i].frame, sb.ext[i].length)) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: file table run %u [%u/%u+%u] is off the device.",
+                       i, sb.ext[i].cart, sb.ext[i].frame, sb.ext[i].length);
+            return(-1);
+        }
+        frames += sb.ext[i].length;
+    }
+    if ((uint64_t)frames * CART_FRAME_SIZE < sb.tableBytes) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: file table is corrupt.");
+        return(-1);
+    }
+    char *table = malloc(frames * CART_FRAME_SIZE + 1);
+    if (table == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate file table.");
+        return(-1);
+    }
+    CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
+    int32_t ret = 0;
+    for (uint32_t i = 0, done = 0; i < sb.extCount && ret == 0; i++) {
+        for (uint32_t j = 0; j < sb.ext[i].length && ret == 0; j++, done++)
+            ret = batch_frame(&batch, CART_OP_RDFRME, sb.ext[i].cart, sb.ext[i].frame + j, table + done * CART_FRAME_SIZE);
+    }
+    if (ret == 0) {
+        ret = batch_run(&batch);
+    } else {
+        free(batch.ops);
+    }
+    if (ret == 0 && meta_sum(table, sb.tableBytes) != sb.tableSum)
+        ret = -1;
+    
+    //rebuild the files, taking their frames from the allocator
+    ret = (ret == 0) ? mark_frames(0, 0, 1) : ret;
+    for (uint32_t i = 0; i < sb.extCount && ret == 0; i++)
+        ret = mark_frames(sb.ext[i].cart, sb.ext[i].frame, sb.ext[i].length);
+    const char *p = table, *end = table + sb.tableBytes;
+    for (uint32_t i = 0; i < sb.fileCount && ret == 0; i++) {
+        char name[CART_MAX_PATH_LENGTH];
+        uint16_t nameLen;
+        uint32_t extCount;
+        struct cartFile *f;
+        if (meta_get(&p, end, &nameLen, sizeof(nameLen)) || nameLen == 0 || nameLen >= CART_MAX_PATH_LENGTH ||
+            meta_get(&p, end, name, nameLen)) {
+            ret = -1;
+            break;
+        }
+        name[nameLen] = '\0';
+        uint32_t h = name_hash(name);
+        if (find_file(name, h) != NULL || (f = create_file(name, h)) == NULL) {
+            ret = -1;
+            break;
+        }
+        if (meta_get(&p, end, &f->fLength, sizeof(f->fLength)) || meta_get(&p, end, &f->fReserve, sizeof(f->fReserve)) ||
+            meta_get(&p, end, &extCount, sizeof(extCount)) || extCount > (uint32_t)(end - p) ||
+            (extCount > 0 && (f->ext = malloc(extCount * sizeof(CartExtent))) == NULL)) {
+            ret = -1;
+            break;
+        }
+        f->extCapacity = extCount;
+        for (uint32_t e = 0; e < extCount && ret == 0; e++) {
+            CartExtent *x = &f->ext[e];
+            x->first = f->fAlloc;
+            if (meta_get(&p, end, &x->cart, sizeof(x->cart)) || meta_get(&p, end, &x->frame, sizeof(x->frame)) ||
+                meta_get(&p, end, &x->length, sizeof(x->length))) {
+                ret = -1;
+                break;
+            }
+            if (mark_frames(x->cart, x->frame, x->length)) {
+                logMessage(LOG_ERROR_LEVEL, "CART driver failed: run %u [%u/%u+%u] of file %s is off the device or used twice.",
+                           e, x->cart, x->frame, x->length, name);
+                ret = -1;
+                break;
+            }
+            f->extCount++;
+            f->fAlloc += x->length;
+        }
+        
+        //the length and the frames kept by cart_fallocate must lie within the frames the file holds
+        if (ret == 0 && (f->fReserve < 0 || f->fReserve > f->fAlloc ||
+                         (uint64_t)f->fAlloc * CART_FRAME_SIZE < f->fLength)) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: file %s has length %lld and %lld frames kept but %lld frames.",
+                       name, (long long)f->fLength, (long long)f->fReserve, (long long)f->fAlloc);
+            ret = -1;
+        }
+    }
+    free(table);
+    if (ret != 0) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: file table is corrupt.");
+        unmount_filesystem();
+        return(-1);
+    }
+    drv.super = sb;
+    logMessage(LOG_INFO_LEVEL, "CART driver mounted %u files from %lld frames of file table.",
+               sb.fileCount, (long long)frames);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unmount_filesystem
+// Description  : forget every file and every allocated frame
+//
+// Inputs       : none
+// Outputs      : none
+
+static void unmount_filesystem(void) {
+    for (int b = 0; drv.names != NULL && b <= drv.nameMask; b++) {
+        struct cartFile *f;
+        while ((f = drv.names[b]) != NULL) {
+            drv.names[b] = f->hnext;
+            free_file(f);
+        }
+    }
+    free(drv.names);
+    free(drv.handles);
+    free(drv.freeHandles);
+    drv.names = NULL;
+    drv.nameMask = 0;
+    drv.fileCount = 0;
+    drv.handles = NULL;
+    drv.freeHandles = NULL;
+    drv.freeCount = drv.handleCount = drv.handleCapacity = 0;
+    memset(drv.frameMap, 0, sizeof(drv.frameMap));
+    memset(drv.cartUsed, 0, sizeof(drv.cartUsed));
+    memset(&drv.super, 0, sizeof(drv.super));
+    drv.currentCart = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_close
+// Description  : This function closes the file
+//
+// Inputs       : f - the file
+// Outputs      : 0 if successful, -1 if failure
+
+static int16_t do_cart_close(struct cartFile *f) {
+    if (f->isOpen == 0) {
+        logMessage(LOG_ERROR_LEVEL, "file not open.");
+        return -1;
+    }
+    
+    //write back the file's dirty frames, an extent at a time
+    for (int e = 0; e < f->extCount; e++) {
+        if (flush_cart_cache_run(f->ext[e].cart, f->ext[e].frame, f->ext[e].length))
+            return -1;
+    }
+    f->isOpen = 0;
+    f->fHandle = -1;
+    
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_frame_range
+// Description  : copy the part of one file frame covered by a read into the
+//                caller's buffer
+//
+// Inputs       : f - the file being read
+//                i - the index of the frame within the file
+//                frame - the frame contents
+//                buf - the caller's buffer
+//                originPos - the file position the read starts at
+//                count - the length of the read
+// Outputs      : none
+
+static void read_frame_range(struct cartFile *f, int64_t i, const char *frame, void *buf, uint64_t originPos, int count) {
+    uint64_t start = (uint64_t)i * CART_FRAME_SIZE;     //file offset of the frame
+    uint64_t from = (originPos > start) ? originPos : start;
+    uint64_t to = (originPos + count < start + CART_FRAME_SIZE) ? originPos + count : start + CART_FRAME_SIZE;
+    memcpy((char *)buf + (from - originPos), frame + (from - start), to - from);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readahead_plan
+// Description  : update a file's sequential-access detector for a read and
+//                pick the frames to prefetch after it; the window doubles
+//                while reads stay sequential and collapses on a random read
+//
+// Inputs       : f - the file being read
+//                originPos - the file position the read starts at
+//                lastFrame - the last frame the read touches
+//                first - first frame to prefetch (output)
+//                last - last frame to prefetch (output)
+// Outputs      : the number of frames to prefetch
+
+static int readahead_plan(struct cartFile *f, uint64_t originPos, int64_t lastFrame, int64_t *first, int64_t *last) {
+    int64_t end = (f->fLength - 1) / CART_FRAME_SIZE;   //last frame holding data
+    int limit = get_cart_cache_size() / 4;              //never let read-ahead flush the cache
+    
+    if (originPos == f->raNextPos) {
+        f->raWindow = (f->raWindow == 0) ? CART_READAHEAD_MIN : f->raWindow * 2;
+        if (f->raWindow > CART_READAHEAD_MAX)
+            f->raWindow = CART_READAHEAD_MAX;
+        if (f->raWindow > limit)
+            f->raWindow = limit;
+    } else {
+        f->raWindow = 0;
+        f->raLast = lastFrame;
+    }
+    
+    *first = (f->raLast >= lastFrame) ? f->raLast + 1 : lastFrame + 1;
+    *last = lastFrame + f->raWindow;
+    if (*last > end)
+        *last = end;
+    if (*last > f->raLast)
+        f->raLast = *last;
+    return (*last >= *first) ? (int)(*last - *first + 1) : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fetch_frames
+// Description  : read file frames from the device straight into pinned cache
+//                entries, a chunk at a time, and copy the part covered by
+//                the read out of the ones the read asked for
+//
+// Inputs       : f - the file being read
+//                fetch - the frame indexes to fetch (misses, then read-ahead)
+//                nfetch - number of frames to fetch
+//                nmissed - number of leading frames the read asked for
+//                buf - the caller's buffer
+//                originPos - the file position the read starts at
+//                count - the length of the read
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t fetch_frames(struct cartFile *f, const int64_t *fetch, int nfetch, int nmissed,
+                            void *buf, uint64_t originPos, int count) {
+    char *slots[CART_IO_CHUNK];
+    int created[CART_IO_CHUNK];
+    int carts[CART_IO_CHUNK], frms[CART_IO_CHUNK];
+    const int chunk = io_chunk();
+    int32_t ret = 0;
+    
+    for (int base = 0; base < nfetch && ret == 0; base += chunk) {
+        int n = (nfetch - base < chunk) ? nfetch - base : chunk;
+        int reserved = n;
+        
+        //pin first: making room may write back frames
+        reserve_pins(reserved);
+        for (int k = 0; k < n; k++) {
+            file_frame(f, fetch[base + k], &carts[k], &frms[k]);
+            slots[k] = pin_cart_cache(carts[k], frms[k], &created[k]);
+            if (slots[k] == NULL) {
+                n = k;
+                ret = -1;
+                break;
+            }
+        }
+        CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
+        for (int k = 0; k < n && ret == 0; k++) {
+            if (created[k] && batch_frame(&batch, CART_OP_RDFRME, carts[k], frms[k], slots[k]))
+                ret = -1;
+        }
+        if (batch_run(&batch))
+            ret = -1;
+        
+        for (int k = 0; k < n; k++) {
+            if (ret != 0) {
+                unpin_cart_cache(slots[k], created[k] ? CART_CACHE_INVALID : CART_CACHE_UNCHANGED);
+            } else if (base + k < nmissed) {
+                read_frame_range(f, fetch[base + k], slots[k], buf, originPos, count);
+                unpin_cart_cache(slots[k], created[k] ? CART_CACHE_CLEAN : CART_CACHE_UNCHANGED);
+            } else {
+                __atomic_fetch_add(&drv.prefetchIssued, created[k], __ATOMIC_RELAXED);
+                unpin_cart_cache(slots[k], created[k] ? CART_CACHE_PREFETCH : CART_CACHE_UNCHANGED);
+            }
+        }
+        release_pins(reserved);
+    }
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_read
+// Description  : Reads "count" bytes from the file handle "fh" into the
+//                buffer "buf"
+//
+// Inputs       : f - the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t do_cart_read(struct cartFile *f, void *buf, int32_t count) {
+    if (f->isOpen == 0) {
+        logMessage(LOG_ERROR_LEVEL, "file not open.");
+        return -1;
+    }
+    if (count < 0) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid length");
+        return -1;
+    }
+    
+    const uint64_t originPos = f->pos;
+    if (originPos >= f->fLength)
+        return 0;
+    if ((uint64_t)count > f->fLength - originPos)                       //read up to the end of the file
+        count = f->fLength - originPos;
+    if (count == 0)
+        return 0;
+    const int64_t posFrame = originPos / CART_FRAME_SIZE;               //record which frame the pos is in
+    const int64_t lastFrame = (originPos + count - 1) / CART_FRAME_SIZE;    //record which frame the last byte is in
+    const int maxFetch = (int)(lastFrame - posFrame) + 1 + CART_READAHEAD_MAX;
+    int64_t *fetch = NULL;                                              //frames to fetch: misses, then read-ahead
+    int nmissed = 0, nfetch = 0;
+    int64_t aheadFirst, aheadLast;
+    int cart, frm;
+    char *cached;
+    int32_t ret = count;
+    
+    //copy the hits straight away, note the misses
+    for (int64_t i = posFrame; i <= lastFrame; i++) {
+        file_frame(f, i, &cart, &frm);
+        if ((cached = pin_cart_cache(cart, frm, NULL)) != NULL) {       //hit
+            read_frame_range(f, i, cached, buf, originPos, count);
+            unpin_cart_cache(cached, CART_CACHE_UNCHANGED);
+        } else {                                                        //miss
+            if (fetch == NULL && (fetch = malloc(maxFetch * sizeof(int64_t))) == NULL) {
+                logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate read buffer.");
+                return(-1);
+            }
+            fetch[nfetch++] = i;
+        }
+    }
+    nmissed = nfetch;
+    
+    //add the read-ahead frames that are not cached yet
+    if (readahead_plan(f, originPos, lastFrame, &aheadFirst, &aheadLast) > 0) {
+        if (fetch == NULL && (fetch = malloc(maxFetch * sizeof(int64_t))) == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate read buffer.");
+            return(-1);
+        }
+        for (int64_t i = aheadFirst; i <= aheadLast; i++) {
+            file_frame(f, i, &cart, &frm);
+            if (!has_cart_cache(cart, frm))
+                fetch[nfetch++] = i;
+        }
+    }
+    
+    //fetch everything straight into the cache, copying out the misses
+    if (nfetch > 0 && fetch_frames(f, fetch, nfetch, nmissed, buf, originPos, count))
+        ret = -1;
+    free(fetch);
+    
+    if (ret != -1) {
+        f->pos = originPos + count;
+        f->raNextPos = f->pos;
+    }
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_write
+// Description  : Writes "count" bytes to the file handle "fh" from the
+//                buffer  "buf"
+//
+// Inputs       : f - the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+static int32_t do_cart_write(struct cartFile *f, void *buf, int32_t count) {
+    
+    if (f->isOpen == 0) {
+        logMessage(LOG_ERROR_LEVEL, "file not open.");
+        return -1;
+    }
+    if (count < 0) {
+        logMessage(LOG_ERROR_LEVEL, "Invalid length");
+        return -1;
+    }
+    
+    if (count == 0)
+        return 0;
+    
+    char *slots[CART_IO_CHUNK];
+    int created[CART_IO_CHUNK];
+    int partial[CART_IO_CHUNK];                                         //frames whose old contents are needed
+    int carts[CART_IO_CHUNK], frms[CART_IO_CHUNK];
+    const int chunk = io_chunk();
+    const uint64_t originPos = f->pos;
+    const int64_t posFrame = originPos / CART_FRAME_SIZE;               //record which frame the pos is in
+    const int64_t lastFrame = (originPos + count - 1) / CART_FRAME_SIZE;    //record which frame the last byte is in
+    const int64_t alloc = f->fAlloc;                                    //frames the file had before
+    int32_t ret = count;
+    int done = 0;                                                       //bytes copied so far
+    
+    if (file_grow(f, lastFrame + 1))
+        return -1;
+    
+    for (int64_t first = posFrame; first <= lastFrame && ret != -1; first += chunk) {
+        int n = (lastFrame - first + 1 < chunk) ? (int)(lastFrame - first + 1) : chunk;
+        int reserved = n;
+        int copied = done;
+        int modified = 0;
+        
+        //modify the frames in place in the cache, pinned so they stay put
+        reserve_pins(reserved);
+        for (int k = 0; k < n; k++) {
+            int64_t i = first + k;
+            int start = (i == posFrame) ? originPos % CART_FRAME_SIZE : 0;  //offset of the write in this frame
+            int len = CART_FRAME_SIZE - start;                              //bytes written to this frame
+            if (len > count - done)
+                len = count - done;
+            done += len;
+            
+            file_frame(f, i, &carts[k], &frms[k]);
+            slots[k] = pin_cart_cache(carts[k], frms[k], &created[k]);
+            if (slots[k] != NULL && (uint64_t)i * CART_FRAME_SIZE >= f->fLength) {
+                //a frame past the end holds no data, there is nothing to read
+                memset(slots[k], 0, CART_FRAME_SIZE);
+                partial[k] = 0;
+            } else {
+                //the old contents only matter if the frame is partly overwritten
+                partial[k] = created[k] && len < CART_FRAME_SIZE;
+            }
+            if (slots[k] == NULL) {
+                n = k;
+                ret = -1;
+                break;
+            }
+        }
+        
+        //fetch the partly overwritten frames that were not cached
+        CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
+        for (int k = 0; k < n && ret != -1; k++) {
+            if (partial[k] && batch_frame(&batch, CART_OP_RDFRME, carts[k], frms[k], slots[k]))
+                ret = -1;
+        }
+        if (batch_run(&batch))
+            ret = -1;
+        
+        if (ret != -1) {
+            modified = 1;
+            for (int k = 0; k < n; k++) {
+                int start = (first + k == posFrame) ? originPos % CART_FRAME_SIZE : 0;
+                int len = CART_FRAME_SIZE - start;
+                if (len > count - copied)
+                    len = count - copied;
+                memcpy(slots[k] + start, (char *)buf + copied, len);
+                copied += len;
+            }
+            
+            //write the frames back to back, or leave them dirty in write-back mode
+            for (int k = 0; k < n && ret != -1 && drv.writePolicy != CART_WRITE_BACK; k++) {
+                if (batch_frame(&batch, CART_OP_WRFRME, carts[k], frms[k], slots[k]))
+                    ret = -1;
+            }
+            if (batch_run(&batch))
+                ret = -1;
+        }
+        
+        //on failure drop whatever may not match the device
+        for (int k = 0; k < n; k++) {
+            if (ret == -1)
+                unpin_cart_cache(slots[k], (modified || created[k]) ? CART_CACHE_INVALID : CART_CACHE_UNCHANGED);
+            else
+                unpin_cart_cache(slots[k], (drv.writePolicy == CART_WRITE_BACK) ? CART_CACHE_DIRTY : CART_CACHE_CLEAN);
+        }
+        release_pins(reserved);
+    }
+    
+    if (ret != -1) {
+        f->pos = originPos + count;
+        if (f->pos > f->fLength)
+            f->fLength = f->pos;
+    } else {
+        file_trim(f, alloc);        //a failed write does not grow the file
+    }
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : f - the file to seek in
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t do_cart_seek(struct cartFile *f, uint64_t loc) {
+    if (loc > f->fLength) {
+        logMessage(LOG_ERROR_LEVEL, "loc is beyond the end of the file");
+        return -1;
+    }
+    if (f->isOpen == 0) {
+        logMessage(LOG_ERROR_LEVEL, "file not open.");
+        return -1;
+    }
+    f->pos = loc;  //change the current position to loc
+    
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_truncate
+// Description  : Set the length of a file, freeing the frames past a new,
+//                shorter end or filling up to a new, longer end with zeros;
+//                the frames of a longer end are allocated before anything
+//                is written, and the file keeps its length if that fails
+//
+// Inputs       : f - the file to truncate
+//                length - the new length of the file
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t do_cart_truncate(struct cartFile *f, uint64_t length) {
+    static char zeros[CART_FRAME_SIZE];
+    
+    if (f->isOpen == 0) {
+        logMessage(LOG_ERROR_LEVEL, "file not open.");
+        return -1;
+    }
+    
+    if (length > f->fLength) {
+        const int64_t alloc = f->fAlloc;
+        const uint64_t pos = f->pos, oldLength = f->fLength;
+        const int64_t lastFrame = (length - 1) / CART_FRAME_SIZE;
+        int64_t i = (oldLength + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;  //first frame wholly past the end
+        int32_t ret = 0;
+        
+        if (file_grow(f, lastFrame + 1))
+            return -1;
+        
+        //zero the rest of the frame the old end is in
+        if (oldLength % CART_FRAME_SIZE != 0) {
+            int32_t n = CART_FRAME_SIZE - oldLength % CART_FRAME_SIZE;
+            if (n > length - oldLength)
+                n = (int32_t)(length - oldLength);
+            f->pos = oldLength;
+            if (do_cart_write(f, zeros, n) != n)
+                ret = -1;
+            f->pos = pos;
+        }
+        
+        //then write the frames past it as zeros, CART_CARTRIDGE_SIZE at a time
+        while (i <= lastFrame && ret == 0) {
+            CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
+            for (int k = 0; k < CART_CARTRIDGE_SIZE && i <= lastFrame && ret == 0; k++, i++) {
+                int cart, frm;
+                file_frame(f, i, &cart, &frm);
+                if (drop_cart_cache(cart, frm) || batch_frame(&batch, CART_OP_WRFRME, cart, frm, zeros))
+                    ret = -1;
+            }
+            if (batch_run(&batch))
+                ret = -1;
+        }
+        
+        if (ret == -1) {
+            f->fLength = oldLength;
+            file_trim(f, (alloc > f->fReserve) ? alloc : f->fReserve);
+            return -1;
+        }
+        f->fLength = length;
+    } else {
+        int64_t keep = (length + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+        file_trim(f, keep);
+        if (f->fReserve > keep)
+            f->fReserve = keep;
+        f->fLength = length;
+        if (f->pos > length)
+            f->pos = length;
+    }
+    f->raWindow = 0;
+    f->raLast = -1;
+    
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_fallocate
+// Description  : Allocate the frames a file will need up front, in one run
+//                where the free space allows, so that it does not end up
+//                scattered across cartridges; the length of the file is
+//                unchanged and the frames stay with it until truncated
+//
+// Inputs       : f - the file
+//                bytes - the size the file is expected to reach
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t do_cart_fallocate(struct cartFile *f, uint64_t bytes) {
+    int64_t frames = (bytes + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+    
+    if (f->isOpen == 0) {
+        logMessage(LOG_ERROR_LEVEL, "file not open.");
+        return -1;
+    }
+    
+    if (file_grow(f, frames))
+        return -1;
+    if (f->fReserve < frames)
+        f->fReserve = frames;
+    
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_delete
+// Description  : Remove a closed file and free its frames
+//
+// Inputs       : path - filename of the file to delete
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t do_cart_delete(char *path) {
+    uint32_t h = name_hash(path);
+    struct cartFile *f = find_file(path, h);
+    
+    if (f == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "file not found.");
+        return -1;
+    }
+    pthread_mutex_lock(&f->lock);
+    if (f->isOpen == 1) {
+        logMessage(LOG_ERROR_LEVEL, "file is open.");
+        pthread_mutex_unlock(&f->lock);
+        return -1;
+    }
+    
+    //unlink it from the namespace, nothing can reach it after that
+    struct cartFile **link = &drv.names[h & drv.nameMask];
+    while (*link != f)
+        link = &(*link)->hnext;
+    *link = f->hnext;
+    drv.fileCount--;
+    
+    //a lookup of its old handle may still be waiting for the lock, then the
+    //last of them frees it (refs only rises under the table lock, held here)
+    file_trim(f, 0);
+    f->deleted = 1;
+    int refs = __atomic_load_n(&f->refs, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&f->lock);
+    if (refs == 0)
+        free_file(f);
+    
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : vec_piece_cmp
+// Description  : order the pieces of a vectored request by cartridge, then
+//                frame, then segment, so that later segments win overlaps
+//
+// Inputs       : a, b - the pieces to compare
+// Outputs      : <0, 0, >0 as a sorts before, with or after b
+
+static int vec_piece_cmp(const void *a, const void *b) {
+    const CartVecPiece *x = a, *y = b;
+    if (x->cart != y->cart)
+        return x->cart - y->cart;
+    if (x->frame != y->frame)
+        return x->frame - y->frame;
+    return x->seg - y->seg;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : vec_pieces
+// Description  : split the segments of a vectored request into one piece per
+//                frame each touches and sort them cartridge by cartridge
+//
+// Inputs       : vec - the segments, with their lengths already clamped
+//                files - the file of each segment
+//                count - the number of segments
+//                npieces - the number of pieces (output)
+// Outputs      : the pieces, NULL if failure
+
+static CartVecPiece *vec_pieces(CartIoVec *vec, struct cartFile **files, int count, int *npieces) {
+    CartVecPiece *pieces;
+    int64_t n = 0;
+    
+    for (int s = 0; s < count; s++) {
+        if (vec[s].result > 0)
+            n += (vec[s].offset + vec[s].result - 1) / CART_FRAME_SIZE - vec[s].offset / CART_FRAME_SIZE + 1;
+    }
+    *npieces = 0;
+    if (n == 0)
+        return(NULL);
+    if (n > INT32_MAX || (pieces = malloc(n * sizeof(CartVecPiece))) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate vectored request.");
+        return(NULL);
+    }
+    for (int s = 0; s < count; s++) {
+        uint64_t pos = vec[s].offset, end = vec[s].offset + vec[s].result;
+        while (pos < end) {
+            CartVecPiece *p = &pieces[(*npieces)++];
+            uint64_t frameEnd = (pos / CART_FRAME_SIZE + 1) * CART_FRAME_SIZE;
+            file_frame(files[s], pos / CART_FRAME_SIZE, &p->cart, &p->frame);
+            p->seg = s;
+            p->start = pos % CART_FRAME_SIZE;
+            p->len = ((end < frameEnd) ? end : frameEnd) - pos;
+            p->bufOff = pos - vec[s].offset;
+            p->past = (pos - p->start >= files[s]->fLength);
+            pos += p->len;
+        }
+    }
+    qsort(pieces, *npieces, sizeof(CartVecPiece), vec_piece_cmp);
+    return(pieces);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : vec_transfer
+// Description  : move the pieces of a vectored request, a chunk of distinct
+//                frames at a time: the frames are pinned, the misses read
+//                (and, for a write, the modified frames written) in one
+//                batch in cartridge order, so each cartridge is loaded at
+//                most once per chunk
+//
+// Inputs       : vec - the segments
+//                pieces - the sorted pieces
+//                npieces - the number of pieces
+//                write - 0 to read the segments, 1 to write them
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t vec_transfer(CartIoVec *vec, CartVecPiece *pieces, int npieces, int write) {
+    char *slots[CART_IO_CHUNK];
+    int created[CART_IO_CHUNK];
+    int fetch[CART_IO_CHUNK];                                           //frames whose old contents are needed
+    int first[CART_IO_CHUNK + 1];                                       //first piece of each frame
+    const int chunk = io_chunk();
+    int32_t ret = 0;
+    
+    for (int base = 0; base < npieces && ret == 0; ) {
+        int n = 0, modified = 0;
+        
+        //the next chunk of distinct frames
+        int p;
+        for (p = base; p < npieces; p++) {
+            if (p > base && pieces[p].cart == pieces[p - 1].cart && pieces[p].frame == pieces[p - 1].frame)
+                continue;
+            if (n == chunk)
+                break;
+            first[n++] = p;
+        }
+        first[n] = p;
+        int reserved = n;
+        
+        //pin first: making room may write back frames
+        reserve_pins(reserved);
+        for (int k = 0; k < n; k++) {
+            CartVecPiece *q = &pieces[first[k]];
+            slots[k] = pin_cart_cache(q->cart, q->frame, &created[k]);
+            if (slots[k] == NULL) {
+                n = k;
+                ret = -1;
+                break;
+            }
+            if (write && q->past) {
+                //a frame past the end holds no data, there is nothing to read
+                memset(slots[k], 0, CART_FRAME_SIZE);
+                fetch[k] = 0;
+            } else {
+                //a write only needs the old contents of a partly overwritten frame
+                fetch[k] = created[k] && !(write && q->len == CART_FRAME_SIZE);
+            }
+        }
+        
+        CartBusBatch batch = { NULL, 0, 0, CART_NO_CARTRIDGE, 0 };
+        for (int k = 0; k < n && ret == 0; k++) {
+            if (fetch[k] && batch_frame(&batch, CART_OP_RDFRME, pieces[first[k]].cart, pieces[first[k]].frame, slots[k]))
+                ret = -1;
+        }
+        if (batch_run(&batch))
+            ret = -1;
+        
+        if (ret == 0) {
+            modified = write;
+            for (int k = 0; k < n; k++) {
+                for (int q = first[k]; q < first[k + 1]; q++) {
+                    char *data = (char *)vec[pieces[q].seg].buf + pieces[q].bufOff;
+                    if (write)
+                        memcpy(slots[k] + pieces[q].start, data, pieces[q].len);
+                    else
+                        memcpy(data, slots[k] + pieces[q].start, pieces[q].len);
+                }
+            }
+            
+            //write the frames back to back, or leave them dirty in write-back mode
+            for (int k = 0; k < n && ret == 0 && write && drv.writePolicy != CART_WRITE_BACK; k++) {
+                if (batch_frame(&batch, CART_OP_WRFRME, pieces[first[k]].cart, pieces[first[k]].frame, slots[k]))
+                    ret = -1;
+            }
+            if (batch_run(&batch))
+                ret = -1;
+        }
+        
+        //on failure drop whatever may not match the device
+        for (int k = 0; k < n; k++) {
+            if (ret != 0)
+                unpin_cart_cache(slots[k], (modified || created[k]) ? CART_CACHE_INVALID : CART_CACHE_UNCHANGED);
+            else if (write)
+                unpin_cart_cache(slots[k], (drv.writePolicy == CART_WRITE_BACK) ? CART_CACHE_DIRTY : CART_CACHE_CLEAN);
+            else
+                unpin_cart_cache(slots[k], created[k] ? CART_CACHE_CLEAN : CART_CACHE_UNCHANGED);
+        }
+        release_pins(reserved);
+        base = p;
+    }
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_readv
+// Description  : Read several segments, possibly of different files, with
+//                every frame they need fetched cartridge by cartridge; the
+//                file positions are neither used nor moved
+//
+// Inputs       : vec - the segments, each (fd, offset, buf, length); the
+//                      bytes read into each are left in its result
+//                files - the locked file of each segment
+//                count - the number of segments
+// Outputs      : total bytes read if successful, -1 if failure
+
+static int64_t do_cart_readv(CartIoVec *vec, struct cartFile **files, int count) {
+    CartVecPiece *pieces;
+    int64_t total = 0;
+    int npieces;
+    
+    for (int s = 0; s < count; s++) {
+        uint64_t len = files[s]->fLength;
+        if (vec[s].length < 0) {
+            logMessage(LOG_ERROR_LEVEL, "Invalid length");
+            return -1;
+        }
+        vec[s].result = (vec[s].offset >= len) ? 0 :                    //read up to the end of the file
+                        ((uint64_t)vec[s].length > len - vec[s].offset) ? (int32_t)(len - vec[s].offset) : vec[s].length;
+        total += vec[s].result;
+    }
+    
+    if ((pieces = vec_pieces(vec, files, count, &npieces)) == NULL && total > 0)
+        return -1;
+    int32_t ret = vec_transfer(vec, pieces, npieces, 0);
+    free(pieces);
+    return (ret == 0) ? total : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_writev
+// Description  : Write several segments, possibly of different files, with
+//                every frame they touch fetched and written cartridge by
+//                cartridge; a segment may extend its file but not leave a
+//                hole past its end, and the file positions are neither used
+//                nor moved; if it fails, no file keeps frames it grew by
+//
+// Inputs       : vec - the segments, each (fd, offset, buf, length); the
+//                      bytes written from each are left in its result
+//                files - the locked file of each segment
+//                count - the number of segments
+// Outputs      : total bytes written if successful, -1 if failure
+
+static int64_t do_cart_writev(CartIoVec *vec, struct cartFile **files, int count) {
+    CartVecPiece *pieces;
+    int64_t total = 0;
+    int npieces;
+    
+    //the end each file will have, checked segment by segment for holes, and
+    //the frames it had before
+    uint64_t *ends = malloc(count * sizeof(uint64_t));
+    int64_t *allocs = malloc(count * sizeof(int64_t));
+    if (ends == NULL || allocs == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate vectored request.");
+        free(ends);
+        free(allocs);
+        return -1;
+    }
+    for (int s = 0; s < count; s++)
+        allocs[s] = files[s]->fAlloc;
+    for (int s = 0; s < count; s++) {
+        int prev = s - 1;
+        while (prev >= 0 && files[prev] != files[s])
+            prev--;
+        ends[s] = (prev >= 0) ? ends[prev] : files[s]->fLength;
+        if (vec[s].length < 0 || vec[s].offset > ends[s]) {
+            logMessage(LOG_ERROR_LEVEL, (vec[s].length < 0) ? "Invalid length" : "Invalid seek.");
+            free(ends);
+            free(allocs);
+            return -1;
+        }
+        if (vec[s].offset + vec[s].length > ends[s])
+            ends[s] = vec[s].offset + vec[s].length;
+        vec[s].result = vec[s].length;
+        total += vec[s].length;
+    }
+    int32_t ret = 0;
+    for (int s = 0; s < count && ret == 0; s++) {
+        if (ends[s] > 0 && file_grow(files[s], (ends[s] - 1) / CART_FRAME_SIZE + 1))
+            ret = -1;
+    }
+    
+    pieces = NULL;
+    if (ret == 0 && ((pieces = vec_pieces(vec, files, count, &npieces)) != NULL || total == 0))
+        ret = vec_transfer(vec, pieces, npieces, 1);
+    else
+        ret = -1;
+    free(pieces);
+    
+    //the last segment of each file knows its new end; on failure every file
+    //goes back to the frames it had
+    for (int s = 0; s < count; s++) {
+        if (ret == -1)
+            file_trim(files[s], allocs[s]);
+        else if (ends[s] > files[s]->fLength)
+            files[s]->fLength = ends[s];
+    }
+    free(ends);
+    free(allocs);
+    return (ret == 0) ? total : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_ref
+// Description  : Take the lock of a file looked up under the table lock,
+//                which took a reference to keep the file from being freed
+//                until then, and drop the reference; the last reference to
+//                a file deleted meanwhile frees it
+//
+// Inputs       : f - the file
+// Outputs      : the locked file, NULL if it was deleted
+
+static struct cartFile *lock_ref(struct cartFile *f) {
+    pthread_mutex_lock(&f->lock);
+    int refs = __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL);
+    if (f->deleted) {
+        pthread_mutex_unlock(&f->lock);
+        if (refs == 0)
+            free_file(f);
+        return NULL;
+    }
+    return f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_file
+// Description  : Find the open file behind a handle and take its lock
+//
+// Inputs       : fd - the file handle
+// Outputs      : the locked file, NULL if failure
+
+static struct cartFile *lock_file(int16_t fd) {
+    struct cartFile *f = NULL;
+    
+    pthread_mutex_lock(&drv.fileLock);
+    if (fd >= 0 && fd < drv.handleCount && (f = drv.handles[fd]) != NULL)
+        __atomic_add_fetch(&f->refs, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&drv.fileLock);
+    if (f != NULL && (f = lock_ref(f)) != NULL && f->fHandle != fd) {  //closed (and maybe reopened) meanwhile
+        pthread_mutex_unlock(&f->lock);
+        f = NULL;
+    }
+    if (f == NULL)
+        logMessage(LOG_ERROR_LEVEL, "Invalid file Handle.");
+    return f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_files / unlock_files
+// Description  : Find the open files behind the segments of a vectored
+//                request and take their locks, in handle order so that two
+//                requests never wait on each other / release them
+//
+// Inputs       : vec - the segments
+//                count - the number of segments
+//                files - the file of each segment (output)
+//                locked - the distinct files, in locking order (output)
+//                nlocked - the number of distinct files
+// Outputs      : the number of files locked, -1 if failure / none
+
+static int fd_cmp(const void *a, const void *b) {
+    return *(const int16_t *)a - *(const int16_t *)b;
+}
+
+static void unlock_files(struct cartFile **locked, int nlocked) {
+    while (nlocked > 0)
+        pthread_mutex_unlock(&locked[--nlocked]->lock);
+}
+
+static int lock_files(CartIoVec *vec, int count, struct cartFile **files, struct cartFile **locked) {
+    int16_t *fds = malloc(count * sizeof(int16_t));
+    int nfds = 0, nlocked = 0, ret = 0;
+    
+    if (fds == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate vectored request.");
+        return -1;
+    }
+    for (int s = 0; s < count; s++)
+        fds[s] = vec[s].fd;
+    qsort(fds, count, sizeof(int16_t), fd_cmp);
+    
+    //look the handles up first, the table lock is never taken under a file lock
+    pthread_mutex_lock(&drv.fileLock);
+    for (int s = 0; s < count; s++) {
+        if (s > 0 && fds[s] == fds[s - 1])
+            continue;
+        if (fds[s] < 0 || fds[s] >= drv.handleCount || drv.handles[fds[s]] == NULL) {
+            ret = -1;
+            break;
+        }
+        fds[nfds] = fds[s];
+        locked[nfds] = drv.handles[fds[s]];
+        __atomic_add_fetch(&locked[nfds++]->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    pthread_mutex_unlock(&drv.fileLock);
+    
+    //every reference taken is dropped, past a failure too
+    for (int k = 0; k < nfds; k++) {
+        struct cartFile *f = lock_ref(locked[k]);
+        if (ret == 0 && f != NULL && f->fHandle == fds[k]) {
+            locked[nlocked++] = f;
+        } else {
+            ret = -1;                       //closed (and maybe reopened) meanwhile
+            if (f != NULL)
+                pthread_mutex_unlock(&f->lock);
+        }
+    }
+    if (ret == 0) {
+        for (int s = 0; s < count; s++)
+            files[s] = locked[(int16_t *)bsearch(&vec[s].fd, fds, nfds, sizeof(int16_t), fd_cmp) - fds];
+    } else {
+        unlock_files(locked, nlocked);
+        logMessage(LOG_ERROR_LEVEL, "Invalid file Handle.");
+    }
+    free(fds);
+    return (ret == 0) ? nfds : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_open / cart_close / cart_read / cart_write / cart_seek /
+//                cart_truncate / cart_fallocate / cart_delete / cart_sync /
+//                cart_readv / cart_writev
+// Description  : Public entry points; operations on different files run in
+//                parallel, operations on the same file one at a time
+//
+// Inputs       : see do_cart_open, do_cart_close, do_cart_read, do_cart_write,
+//                do_cart_seek, do_cart_truncate, do_cart_fallocate,
+//                do_cart_delete, do_cart_readv, do_cart_writev; none for
+//                cart_sync
+// Outputs      : see do_cart_open, do_cart_close, do_cart_read, do_cart_write,
+//                do_cart_seek, do_cart_truncate, do_cart_fallocate,
+//                do_cart_delete, do_cart_readv, do_cart_writev; 0 if
+//                successful, -1 if failure for cart_sync
+
+int16_t cart_open(char *path) {
+    pthread_mutex_lock(&drv.fileLock);
+    int16_t ret = do_cart_open(path);
+    pthread_mutex_unlock(&drv.fileLock);
+    if (ret >= 0)
+        CART_STAT_INC(opens);
+    return ret;
+}
+
+int16_t cart_close(int16_t fd) {
+    struct cartFile *f = lock_file(fd);
+    if (f == NULL)
+        return -1;
+    int16_t ret = do_cart_close(f);
+    pthread_mutex_unlock(&f->lock);
+    if (ret == 0) {
+        pthread_mutex_lock(&drv.fileLock);
+        free_handle(fd);
+        pthread_mutex_unlock(&drv.fileLock);
+        CART_STAT_INC(closes);
+    }
+    return ret;
+}
+
+int32_t cart_read(int16_t fd, void *buf, int32_t count) {
+    uint64_t start = cart_stats_now();
+    struct cartFile *f = lock_file(fd);
+    if (f == NULL)
+        return -1;
+    int32_t ret = do_cart_read(f, buf, count);
+    pthread_mutex_unlock(&f->lock);
+    if (ret >= 0) {
+        CART_STAT_INC(reads);
+        CART_STAT_ADD(bytesRead, ret);
+        cart_hist_record(&cartStats->readLatency, cart_stats_now() - start);
+    }
+    return ret;
+}
+
+int32_t cart_write(int16_t fd, void *buf, int32_t count) {
+    uint64_t start = cart_stats_now();
+    struct cartFile *f = lock_file(fd);
+    if (f == NULL)
+        return -1;
+    int32_t ret = do_cart_write(f, buf, count);
+    pthread_mutex_unlock(&f->lock);
+    if (ret >= 0) {
+        CART_STAT_INC(writes);
+        CART_STAT_ADD(bytesWritten, ret);
+        cart_hist_record(&cartStats->writeLatency, cart_stats_now() - start);
+    }
+    if (drv.flusherRunning &&
+        get_cart_cache_dirty() * 100 > (uint64_t)get_cart_cache_size() * drv.flushHighPct) {
+        pthread_mutex_lock(&drv.flusherLock);
+        pthread_cond_signal(&drv.flusherCond);      //past the high watermark, wake the flusher
+        pthread_mutex_unlock(&drv.flusherLock);
+    }
+    return ret;
+}
+
+int32_t cart_seek(int16_t fd, uint64_t loc) {
+    struct cartFile *f = lock_file(fd);
+    if (f == NULL)
+        return -1;
+    int32_t ret = do_cart_seek(f, loc);
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+int32_t cart_truncate(int16_t fd, uint64_t length) {
+    struct cartFile *f = lock_file(fd);
+    if (f == NULL)
+        return -1;
+    int32_t ret = do_cart_truncate(f, length);
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+int32_t cart_fallocate(int16_t fd, uint64_t bytes) {
+    struct cartFile *f = lock_file(fd);
+    if (f == NULL)
+        return -1;
+    int32_t ret = do_cart_fallocate(f, bytes);
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+int64_t cart_readv(CartIoVec *vec, int count) {
+    if (count <= 0)
+        return 0;
+    struct cartFile **files = malloc(2 * count * sizeof(struct cartFile *));
+    if (files == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate vectored request.");
+        return -1;
+    }
+    int nlocked = lock_files(vec, count, files, files + count);
+    int64_t ret = (nlocked < 0) ? -1 : do_cart_readv(vec, files, count);
+    if (nlocked > 0)
+        unlock_files(files + count, nlocked);
+    free(files);
+    if (ret >= 0) {
+        CART_STAT_ADD(reads, count);
+        CART_STAT_ADD(bytesRead, ret);
+    }
+    return ret;
+}
+
+int64_t cart_writev(CartIoVec *vec, int count) {
+    if (count <= 0)
+        return 0;
+    struct cartFile **files = malloc(2 * count * sizeof(struct cartFile *));
+    if (files == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot allocate vectored request.");
+        return -1;
+    }
+    int nlocked = lock_files(vec, count, files, files + count);
+    int64_t ret = (nlocked < 0) ? -1 : do_cart_writev(vec, files, count);
+    if (nlocked > 0)
+        unlock_files(files + count, nlocked);
+    free(files);
+    if (ret >= 0) {
+        CART_STAT_ADD(writes, count);
+        CART_STAT_ADD(bytesWritten, ret);
+    }
+    return ret;
+}
+
+int32_t cart_sync(void) {
+    int32_t ret = 0;
+    pthread_mutex_lock(&drv.fileLock);
+    if (flush_cart_cache(0, 0) ||
+        (drv.mountPolicy == CART_MOUNT_PERSIST && save_filesystem()))
+        ret = -1;
+    pthread_mutex_unlock(&drv.fileLock);
+    return ret;
+}
+
+int32_t cart_delete(char *path) {
+    pthread_mutex_lock(&drv.fileLock);
+    int32_t ret = do_cart_delete(path);
+    pthread_mutex_unlock(&drv.fileLock);
+    return ret;
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_pattern / test_check_pattern
+// Description  : fill a buffer with bytes that depend on their position in
+//                the file and a seed / check that a buffer holds them
+//
+// Inputs       : buf - the buffer
+//                pos - the position in the file of its first byte
+//                len - its length
+//                seed - the seed, 0 for zeros
+// Outputs      : none / 0 if it holds them, -1 if not
+
+static void test_pattern(char *buf, uint64_t pos, int32_t len, int seed) {
+    for (int32_t i = 0; i < len; i++)
+        buf[i] = seed ? (char)((pos + i) * 31 + seed) : 0;
+}
+
+static int test_check_pattern(const char *buf, uint64_t pos, int32_t len, int seed) {
+    for (int32_t i = 0; i < len; i++) {
+        if (buf[i] != (seed ? (char)((pos + i) * 31 + seed) : 0))
+            return(-1);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_free / test_file
+// Description  : count the frames not allocated to anything / get the
+//                length and number of frames of an open file
+//
+// Inputs       : fd - the file handle
+//                alloc - the number of frames of the file (output)
+// Outputs      : the number of free frames / the length, -1 if not open
+
+static int64_t test_free(void) {
+    int64_t used = 0;
+    pthread_mutex_lock(&drv.allocLock);
+    for (int i = 0; i < CART_MAX_CARTRIDGES; i++)
+        used += drv.cartUsed[i];
+    pthread_mutex_unlock(&drv.allocLock);
+    return((int64_t)CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE - used);
+}
+
+static int64_t test_file(int16_t fd, int64_t *alloc) {
+    struct cartFile *f = lock_file(fd);
+    if (f == NULL)
+        return(-1);
+    int64_t length = (int64_t)f->fLength;
+    *alloc = f->fAlloc;
+    pthread_mutex_unlock(&f->lock);
+    return(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_write / test_read
+// Description  : write the pattern to part of a file / read part of a file
+//                and check it holds the pattern
+//
+// Inputs       : fd - the file handle
+//                pos - where to write / read from
+//                len - the number of bytes to write / expected
+//                seed - the pattern's seed, 0 for zeros
+// Outputs      : 0 if it was all written / it does, -1 if not
+
+static int test_write(int16_t fd, uint64_t pos, int32_t len, int seed) {
+    char *buf = malloc(len);
+    int ret = -1;
+    if (buf != NULL && cart_seek(fd, pos) == 0) {
+        test_pattern(buf, pos, len, seed);
+        if (cart_write(fd, buf, len) == len)
+            ret = 0;
+    }
+    free(buf);
+    return(ret);
+}
+
+static int test_read(int16_t fd, uint64_t pos, int32_t len, int seed) {
+    char *buf = malloc(len);
+    int ret = -1;
+    if (buf != NULL && cart_seek(fd, pos) == 0 && cart_read(fd, buf, len) == len)
+        ret = test_check_pattern(buf, pos, len, seed);
+    free(buf);
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_space
+// Description  : check truncate, delete and the frame allocator: shrinking
+//                and extending a file, reusing deleted space, the same
+//                capacity after every cycle of filling and emptying the
+//                device, and failed calls on a full device giving back
+//                every frame they took
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+#define TEST_CHUNK (3 << 20)    // Bytes written to a file at a time, not dividing the device
+
+static int test_space(void) {
+    char name[32];
+    int64_t empty, alloc, length;
+    int64_t capacity = -1;
+    int16_t fd;
+    
+    if (cart_poweron()) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on poweron.");
+        return(-1);
+    }
+    empty = test_free();
+    
+    //shrink then extend: the old bytes past the end read back as zeros
+    fd = cart_open("space0");
+    if (test_write(fd, 0, 10000, 1) || cart_truncate(fd, 3000) ||
+        test_file(fd, &alloc) != 3000 || alloc != 3 || test_free() != empty - 3 ||
+        cart_seek(fd, 3001) == 0 || test_read(fd, 0, 3000, 1)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on shrinking a file.");
+        return(-1);
+    }
+    if (cart_truncate(fd, 5000) || test_file(fd, &alloc) != 5000 || alloc != 5 ||
+        test_read(fd, 0, 3000, 1) || test_read(fd, 3000, 2000, 0) ||
+        cart_truncate(fd, 100000) || test_file(fd, &alloc) != 100000 || alloc != 98 ||
+        test_read(fd, 3000, 97000, 0) || test_free() != empty - 98) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on extending a file.");
+        return(-1);
+    }
+    
+    //delete frees every frame, the name starts over empty
+    if (cart_delete("space0") == 0 || cart_close(fd) || cart_delete("space0") ||
+        cart_delete("space0") == 0 || test_free() != empty) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on delete.");
+        return(-1);
+    }
+    fd = cart_open("space0");
+    if (test_file(fd, &alloc) != 0 || alloc != 0 || cart_close(fd) || cart_delete("space0")) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on reusing a deleted name.");
+        return(-1);
+    }
+    
+    //fill the device and empty it again, it holds as much every time
+    logMessage(LOG_OUTPUT_LEVEL, "Filling the device, expect out of frames errors.");
+    for (int cycle = 0; cycle < 3; cycle++) {
+        int64_t written = 0;
+        int files = 0;
+        for (;;) {
+            sprintf(name, "fill%d", files++);
+            fd = cart_open(name);
+            if (test_write(fd, 0, TEST_CHUNK, files))
+                break;
+            written += TEST_CHUNK;
+            cart_close(fd);
+        }
+        
+        //on the full device failed calls take nothing
+        int64_t left = test_free();
+        if (test_file(fd, &alloc) != 0 || alloc != 0 || left == 0 || left >= TEST_CHUNK / CART_FRAME_SIZE ||
+            test_write(fd, 0, 1000, files) || cart_truncate(fd, 100 << 20) == 0 ||
+            test_file(fd, &alloc) != 1000 || alloc != 1 || test_free() != left - 1 ||
+            test_read(fd, 0, 1000, files)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on rollback when full.");
+            return(-1);
+        }
+        cart_close(fd);
+        
+        if (capacity != -1 && written != capacity) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: %lld bytes fit on cycle %d, %lld at first.",
+                       (long long)written, cycle, (long long)capacity);
+            return(-1);
+        }
+        capacity = written;
+        sprintf(name, "fill%d", files / 2);
+        fd = cart_open(name);
+        length = test_file(fd, &alloc);
+        if (length != TEST_CHUNK || test_read(fd, 0, TEST_CHUNK, files / 2 + 1) || cart_close(fd)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on reading a full device.");
+            return(-1);
+        }
+        for (int i = 0; i < files; i++) {
+            sprintf(name, "fill%d", i);
+            if (cart_delete(name)) {
+                logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on emptying the device.");
+                return(-1);
+            }
+        }
+        if (test_free() != empty) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: %lld frames free after cycle %d, %lld at first.",
+                       (long long)test_free(), cycle, (long long)empty);
+            return(-1);
+        }
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "Device holds %lld bytes on every cycle.", (long long)capacity);
+    
+    return(cart_poweroff());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_fallocate
+// Description  : check that fallocate reserves frames without changing the
+//                length, that they stay with the file until a truncate, and
+//                that a request the device cannot hold reserves nothing
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int test_fallocate(void) {
+    int64_t empty, alloc;
+    int16_t fd;
+    
+    if (cart_poweron()) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on poweron.");
+        return(-1);
+    }
+    empty = test_free();
+    
+    fd = cart_open("reserve0");
+    if (test_write(fd, 0, 1000, 2) || cart_fallocate(fd, 1 << 20) ||
+        test_file(fd, &alloc) != 1000 || alloc != 1024 || test_free() != empty - 1024 ||
+        cart_fallocate(fd, 4096) || test_file(fd, &alloc) != 1000 || alloc != 1024) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on fallocate.");
+        return(-1);
+    }
+    
+    //writes inside the reservation take no more frames, closing keeps them
+    for (int i = 1; i < 500; i++) {
+        if (test_write(fd, i * 1000, 1000, 2))
+            break;
+    }
+    if (cart_close(fd) || (fd = cart_open("reserve0")) == -1 ||
+        test_file(fd, &alloc) != 500000 || alloc != 1024 || test_free() != empty - 1024 ||
+        test_read(fd, 0, 500000, 2)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on writing reserved frames.");
+        return(-1);
+    }
+    
+    //a reservation the device cannot hold fails and takes nothing
+    logMessage(LOG_OUTPUT_LEVEL, "Reserving more than the device, expect out of frames errors.");
+    if (cart_fallocate(fd, 500 << 20) == 0 || test_file(fd, &alloc) != 500000 || alloc != 1024 ||
+        test_free() != empty - 1024) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on fallocate when out of space.");
+        return(-1);
+    }
+    
+    //truncate gives back the frames past the new end
+    if (cart_truncate(fd, 2000) || test_file(fd, &alloc) != 2000 || alloc != 2 ||
+        test_free() != empty - 2 || test_read(fd, 0, 2000, 2) ||
+        cart_close(fd) || cart_delete("reserve0") || test_free() != empty) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on truncating reserved frames.");
+        return(-1);
+    }
+    
+    return(cart_poweroff());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_persist_check
+// Description  : check that the files of the persistence test hold what
+//                was written to them, file 3 deleted and file 4 cut short
+//                once modified is set
+//
+// Inputs       : modified - whether the second round of changes was made
+// Outputs      : 0 if successful, -1 if failure
+
+#define TEST_PERSIST_FILES 10   // Files the persistence test writes
+
+static int test_persist_check(int modified) {
+    char name[32];
+    int64_t alloc;
+    
+    for (int i = 0; i < TEST_PERSIST_FILES; i++) {
+        int32_t length = (modified && i == 3) ? 0 : (modified && i == 4) ? 1500 : i * 7000 + 1;
+        sprintf(name, "persist%d", i);
+        int16_t fd = cart_open(name);
+        if (test_file(fd, &alloc) != length || (length > 0 && test_read(fd, 0, length, 10 + i)) ||
+            cart_close(fd)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on remounted file %s.", name);
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_bus_poweroff
+// Description  : power the controller off without the driver, after a
+//                poweron that failed part way
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int test_bus_poweroff(void) {
+    uint64_t ky1, ky2, rt1, ct1, fm1;
+    
+    CartXferRegister reg = client_cart_bus_request(create_cart_opcode(CART_OP_POWOFF, 0, 0, 0, 0), NULL);
+    if (extract_cart_opcode(reg, &ky1, &ky2, &rt1, &ct1, &fm1) || rt1)
+        return(-1);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_persist
+// Description  : check that cart_sync writes back every dirty frame and the
+//                file table, that a persistent mount finds the files as
+//                they were left, that a secure poweroff leaves no table,
+//                and that a corrupt table is refused
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int test_persist(void) {
+    CartSuperblock sb;
+    char frame[CART_FRAME_SIZE];
+    int16_t fds[TEST_PERSIST_FILES];
+    char name[32];
+    
+    cart_set_mount_policy(CART_MOUNT_PERSIST);
+    cart_set_write_policy(CART_WRITE_BACK);
+    if (cart_poweron()) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on poweron.");
+        return(-1);
+    }
+    
+    //files of several sizes, left open and dirty in the cache until the sync
+    for (int i = 0; i < TEST_PERSIST_FILES; i++) {
+        sprintf(name, "persist%d", i);
+        fds[i] = cart_open(name);
+        if (cart_truncate(fds[i], 0) || test_write(fds[i], 0, i * 7000 + 1, 10 + i)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on writing %s.", name);
+            return(-1);
+        }
+    }
+    if (get_cart_cache_dirty() == 0 || cart_sync() || get_cart_cache_dirty() != 0 ||
+        read_frame(0, 0, frame)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on sync.");
+        return(-1);
+    }
+    memcpy(&sb, frame, sizeof(sb));
+    if (sb.magic != CART_META_MAGIC || sb.fileCount != drv.fileCount || sb.generation != drv.super.generation) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: sync did not write the file table.");
+        return(-1);
+    }
+    
+    //remount, check, change some files, remount again
+    for (int i = 0; i < TEST_PERSIST_FILES; i++)
+        cart_close(fds[i]);
+    if (cart_poweroff() || cart_poweron() || test_persist_check(0)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on the first remount.");
+        return(-1);
+    }
+    int16_t fd = cart_open("persist4");
+    if (cart_truncate(fd, 1500) || cart_close(fd) || cart_delete("persist3") ||
+        cart_poweroff() || cart_poweron() || test_persist_check(1)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on the second remount.");
+        return(-1);
+    }
+    
+    //a secure poweroff erases the table with everything else
+    cart_set_shutdown_policy(CART_SHUTDOWN_SECURE);
+    if (cart_poweroff()) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on secure poweroff.");
+        return(-1);
+    }
+    cart_set_shutdown_policy(CART_SHUTDOWN_FAST);
+    if (cart_poweron() || drv.fileCount != 0 || test_free() != (int64_t)CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE - 1) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: secure poweroff left a file table.");
+        return(-1);
+    }
+    
+    //a table whose frames kept overrun the file's frames is refused, and so
+    //is a superblock pointing off the device (the controller stays powered
+    //after a refused mount, so it is powered off over the bus)
+    fd = cart_open("persist0");
+    if (test_write(fd, 0, 3000, 10) || cart_fallocate(fd, 8000)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on writing persist0.");
+        return(-1);
+    }
+    drv.handles[fd]->fReserve = drv.handles[fd]->fAlloc + 1;
+    if (cart_close(fd) || cart_poweroff() || cart_poweron() == 0 || read_frame(0, 0, frame)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: mounted frames kept past the file's frames.");
+        return(-1);
+    }
+    memcpy(&sb, frame, sizeof(sb));
+    sb.ext[0].cart = CART_MAX_CARTRIDGES;
+    sb.sum = 0;
+    sb.sum = meta_sum(&sb, sizeof(sb));
+    memcpy(frame, &sb, sizeof(sb));
+    if (write_frame(0, 0, frame) || test_bus_poweroff() || cart_poweron() == 0 || test_bus_poweroff()) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: mounted a file table off the device.");
+        return(-1);
+    }
+    
+    cart_set_write_policy(CART_WRITE_THROUGH);
+    cart_set_mount_policy(CART_MOUNT_FORMAT);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_vector
+// Description  : check vectored reads and writes: segments on several
+//                files and on the same file more than once, overlapping
+//                writes resolved in segment order, short reads at the end of
+//                a file, refusing a write that would leave a hole, and a
+//                failed write leaving no frames with any of its files
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int test_vector(void) {
+    char a[5000], b[5000], x[1000], y[1000], c[100];
+    char ra[5000], rb[5000], rc[100], ra2[100];
+    int64_t empty, alloc;
+    
+    if (cart_poweron()) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on poweron.");
+        return(-1);
+    }
+    empty = test_free();
+    int16_t fa = cart_open("vector0"), fb = cart_open("vector1"), fc = cart_open("vector2");
+    
+    //a in two segments, the second extending what the first wrote
+    test_pattern(a, 0, 5000, 30);
+    test_pattern(b, 0, 5000, 31);
+    test_pattern(c, 0, 100, 32);
+    CartIoVec w1[] = { { fa, 0, a, 3000, 0 }, { fb, 0, b, 5000, 0 }, { fa, 3000, a + 3000, 2000, 0 },
+                       { fc, 0, c, 100, 0 } };
+    if (cart_writev(w1, 4) != 10100 || w1[2].result != 2000 || test_file(fa, &alloc) != 5000 ||
+        test_file(fb, &alloc) != 5000 || test_file(fc, &alloc) != 100 || test_free() != empty - 11) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on writev.");
+        return(-1);
+    }
+    
+    //overlapping segments: the later one wins
+    test_pattern(x, 1000, 1000, 33);
+    test_pattern(y, 1500, 1000, 34);
+    CartIoVec w2[] = { { fb, 1000, x, 1000, 0 }, { fb, 1500, y, 1000, 0 } };
+    if (cart_writev(w2, 2) != 2000) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on overlapping writev.");
+        return(-1);
+    }
+    
+    //read it all back, the same file twice and past the end of c
+    CartIoVec r1[] = { { fa, 0, ra, 5000, 0 }, { fb, 0, rb, 5000, 0 }, { fc, 50, rc, 100, 0 },
+                       { fa, 4950, ra2, 100, 0 }, { fc, 200, rc, 10, 0 } };
+    if (cart_readv(r1, 5) != 10100 || r1[2].result != 50 || r1[3].result != 50 || r1[4].result != 0 ||
+        test_check_pattern(ra, 0, 5000, 30) || test_check_pattern(ra2, 4950, 50, 30) ||
+        test_check_pattern(rc, 50, 50, 32) || test_check_pattern(rb, 0, 1000, 31) ||
+        test_check_pattern(rb + 1000, 1000, 500, 33) || test_check_pattern(rb + 1500, 1500, 1000, 34) ||
+        test_check_pattern(rb + 2500, 2500, 2500, 31)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on readv.");
+        return(-1);
+    }
+    
+    //a segment may not start past the end its file has by then
+    CartIoVec w3[] = { { fc, 100, c, 50, 0 }, { fc, 200, c, 10, 0 } };
+    if (cart_writev(w3, 2) != -1 || test_file(fc, &alloc) != 100 || test_free() != empty - 11) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on refusing a hole.");
+        return(-1);
+    }
+    
+    //on a full device the files grown before the one that does not fit give their frames back
+    int16_t fill = cart_open("vector3");
+    logMessage(LOG_OUTPUT_LEVEL, "Filling the device, expect out of frames errors.");
+    if (cart_fallocate(fill, (uint64_t)(test_free() - 2) * CART_FRAME_SIZE)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on filling the device.");
+        return(-1);
+    }
+    CartIoVec w4[] = { { fa, 5000, a, 2000, 0 }, { fc, 100, c, 100, 0 }, { fb, 5000, b, 5000, 0 } };
+    if (cart_writev(w4, 3) != -1 || test_free() != 2 || test_file(fa, &alloc) != 5000 || alloc != 5 ||
+        test_file(fc, &alloc) != 100 || alloc != 1 || test_file(fb, &alloc) != 5000 || alloc != 5 ||
+        test_read(fa, 0, 5000, 30)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on writev rollback when full.");
+        return(-1);
+    }
+    
+    if (cart_close(fa) || cart_close(fb) || cart_close(fc) || cart_close(fill) ||
+        cart_delete("vector0") || cart_delete("vector1") || cart_delete("vector2") ||
+        cart_delete("vector3") || test_free() != empty) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on deleting the vector files.");
+        return(-1);
+    }
+    return(cart_poweroff());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_drain / test_async
+// Description  : drain the IO threads (a thread of its own) / check the
+//                asynchronous interface: every request completes once under
+//                its tag with its result, whether reaped by cart_poll or
+//                cart_wait, the requests on one file run in the order they
+//                were submitted, and drains may overlap
+//
+// Inputs       : arg - unused / none
+// Outputs      : NULL / 0 if successful, -1 if failure
+
+#define TEST_ASYNC_FILES 4      // Files written at the same time
+#define TEST_ASYNC_WRITES 16    // Writes queued to each file
+
+static void *test_drain(void *arg) {
+    cart_async_drain();
+    return(NULL);
+}
+
+static int test_async(void) {
+    static char bufs[TEST_ASYNC_FILES][TEST_ASYNC_WRITES][1000];
+    CartCompletion cqe[TEST_ASYNC_FILES * TEST_ASYNC_WRITES + 1];
+    int seen[TEST_ASYNC_FILES * TEST_ASYNC_WRITES + 1] = { 0 };
+    int16_t fds[TEST_ASYNC_FILES];
+    char name[32];
+    int n = 0, total = TEST_ASYNC_FILES * TEST_ASYNC_WRITES;
+    
+    if (cart_poweron()) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on poweron.");
+        return(-1);
+    }
+    if (cart_wait(cqe, 1, 1) != 0 || cart_poll(cqe, 1) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: completions with nothing in flight.");
+        return(-1);
+    }
+    
+    //sequential writes to several files at once, interleaved, plus one on a bad handle
+    for (int f = 0; f < TEST_ASYNC_FILES; f++) {
+        sprintf(name, "async%d", f);
+        fds[f] = cart_open(name);
+    }
+    for (int i = 0; i < TEST_ASYNC_WRITES; i++) {
+        for (int f = 0; f < TEST_ASYNC_FILES; f++) {
+            test_pattern(bufs[f][i], i * 1000, 1000, 40 + f);
+            if (cart_write_async(fds[f], bufs[f][i], 1000, f * TEST_ASYNC_WRITES + i)) {
+                logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on submitting a write.");
+                return(-1);
+            }
+        }
+    }
+    if (cart_read_async(CART_MAX_OPEN_FILES - 1, bufs[0][0], 1000, total)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on submitting a read.");
+        return(-1);
+    }
+    n = cart_poll(cqe, total + 1);
+    n += cart_wait(cqe + n, total + 1 - n, total + 1 - n);
+    for (int i = 0; i < n; i++) {
+        if (cqe[i].tag > (uint64_t)total || seen[cqe[i].tag]++ ||
+            cqe[i].result != ((cqe[i].tag == (uint64_t)total) ? -1 : 1000))
+            n = -1;
+    }
+    if (n != total + 1) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on async write completions.");
+        return(-1);
+    }
+    for (int f = 0; f < TEST_ASYNC_FILES; f++) {
+        if (test_read(fds[f], 0, TEST_ASYNC_WRITES * 1000, 40 + f)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed: async writes to async%d out of order.", f);
+            return(-1);
+        }
+    }
+    
+    //sequential reads come back in order, after a drain the threads start again
+    cart_async_drain();
+    if (cart_seek(fds[1], 0)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on async read seek.");
+        return(-1);
+    }
+    for (int i = 0; i < TEST_ASYNC_WRITES; i++) {
+        if (cart_read_async(fds[1], bufs[0][i], 1000, 1000 + i)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on submitting a read.");
+            return(-1);
+        }
+    }
+    
+    //two drains at once: each returns with every request done, submissions refused until then
+    pthread_t drainer;
+    if (pthread_create(&drainer, NULL, test_drain, NULL)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on starting a drain.");
+        return(-1);
+    }
+    cart_async_drain();
+    pthread_join(drainer, NULL);
+    if (cart_poll(cqe, TEST_ASYNC_WRITES + 1) != TEST_ASYNC_WRITES) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on concurrent drains.");
+        return(-1);
+    }
+    for (int i = 0; i < TEST_ASYNC_WRITES; i++) {
+        int k = (int)cqe[i].tag - 1000;
+        if (k < 0 || k >= TEST_ASYNC_WRITES || cqe[i].result != 1000 ||
+            test_check_pattern(bufs[0][k], k * 1000, 1000, 41)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on async reads.");
+            return(-1);
+        }
+    }
+    
+    for (int f = 0; f < TEST_ASYNC_FILES; f++) {
+        sprintf(name, "async%d", f);
+        if (cart_close(fds[f]) || cart_delete(name)) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed on deleting %s.", name);
+            return(-1);
+        }
+    }
+    return(cart_poweroff());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cartDriverUnitTest
+// Description  : Run a UNIT test checking the driver against the in-process
+//                controller, kept in memory so no backing store is touched
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cartDriverUnitTest(void) {
+    set_cart_bus_backend(CART_BUS_LOCAL);
+    if (set_cart_controller_store(NULL))
+        return(-1);
+    
+    if (test_space() || test_fallocate() || test_persist() || test_vector() || test_async())
+        return(-1);
+    
+    // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Driver unit test completed successfully.");
+    return(0);
+}
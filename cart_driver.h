@@ -15,12 +15,75 @@
 #include <stdint.h>
 
 // Defines
-#define CART_MAX_TOTAL_FILES 1024 // Maximum number of files ever
+#define CART_MAX_TOTAL_FILES 65536 // Maximum number of files ever
+#define CART_MAX_OPEN_FILES INT16_MAX // Maximum number of files open at once
 #define CART_MAX_PATH_LENGTH 128 // Maximum length of filename length
 
+// How cartridges are zeroed at poweron
+typedef enum {
+	CART_INIT_EAGER = 0,  // Zero every cartridge at poweron
+	CART_INIT_LAZY  = 1,  // Zero a cartridge when its first frame is allocated
+} CartInitPolicy;
+
+// What poweron finds on the cartridges
+typedef enum {
+	CART_MOUNT_FORMAT  = 0,  // Start with no files at every poweron
+	CART_MOUNT_PERSIST = 1,  // Keep the file table on the cartridges across power cycles
+} CartMountPolicy;
+
+// What is erased at poweroff
+typedef enum {
+	CART_SHUTDOWN_FAST   = 0,  // Power off without erasing anything
+	CART_SHUTDOWN_SECURE = 1,  // Zero written cartridges and cached frames
+} CartShutdownPolicy;
+
+// How frame writes reach the cartridges
+typedef enum {
+	CART_WRITE_THROUGH = 0,  // Write every modified frame immediately
+	CART_WRITE_BACK    = 1,  // Keep modified frames dirty in the cache
+} CartWritePolicy;
+
+// A segment of a vectored read or write
+typedef struct {
+	int16_t  fd;      // File handle
+	uint64_t offset;  // Position in the file
+	void    *buf;     // Buffer to read into or write from
+	int32_t  length;  // Bytes to transfer
+	int32_t  result;  // Bytes transferred (output)
+} CartIoVec;
+
+// Background flusher defaults (write-back mode)
+#define CART_FLUSH_INTERVAL_MS 100     // How often the flusher checks the cache
+#define CART_DEFAULT_FLUSH_HIGH 50     // Dirty % of the cache that starts a flush
+#define CART_DEFAULT_FLUSH_LOW 25      // Dirty % a flush drains down to
+#define CART_DEFAULT_FLUSH_AGE 1000    // Age (ms) at which dirty frames are flushed
+
+// Sequential read-ahead window (frames)
+#define CART_READAHEAD_MIN 4           // Window after the first sequential read
+#define CART_READAHEAD_MAX 64          // Largest window
+
+#define CART_IO_CHUNK 64               // Frames a read or write pins in the cache at once
+#define CART_RUN_GAP 32                // Free frames a new run leaves the frames before it
+#define CART_STRIPE_FRAMES 16          // Frames of a file placed on one server before the next
+
 //
 // Interface functions
 
+int32_t cart_set_init_policy(CartInitPolicy policy);
+	// Select the cartridge zeroing policy (call before cart_poweron)
+
+int32_t cart_set_mount_policy(CartMountPolicy policy);
+	// Select whether files survive poweroff (call before cart_poweron)
+
+int32_t cart_set_shutdown_policy(CartShutdownPolicy policy);
+	// Select what cart_poweroff erases before powering off
+
+int32_t cart_set_write_policy(CartWritePolicy policy);
+	// Select write-through or write-back caching (call before cart_poweron)
+
+int32_t cart_set_flusher(uint32_t high_pct, uint32_t low_pct, uint32_t max_age_ms);
+	// Configure the write-back flusher thread, high_pct 0 disables it
+
 int32_t cart_poweron(void);
 	// Startup up the CART interface, initialize filesystem
 
@@ -39,9 +102,33 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count);
 int32_t cart_write(int16_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
-int32_t cart_seek(int16_t fd, uint32_t loc);
+int32_t cart_seek(int16_t fd, uint64_t loc);
 	// Seek to specific point in the file
 
+int32_t cart_truncate(int16_t fd, uint64_t length);
+	// Shrink (freeing frames) or zero-extend a file to "length" bytes
+
+int32_t cart_fallocate(int16_t fd, uint64_t bytes);
+	// Allocate a file's frames up front in one contiguous run where possible
+
+int32_t cart_delete(char *path);
+	// Remove a closed file and give its frames back to the allocator
+
+int64_t cart_readv(CartIoVec *vec, int count);
+	// Read "count" segments, fetching their frames cartridge by cartridge
+
+int64_t cart_writev(CartIoVec *vec, int count);
+	// Write "count" segments, moving their frames cartridge by cartridge
+
+int32_t cart_sync(void);
+	// Write back dirty frames and, when persistent, the file table
+
+//
+// Unit test
+
+int cartDriverUnitTest(void);
+	// Run a UNIT test checking the driver against the in-process controller
+
 
 #endif
 
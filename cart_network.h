@@ -16,10 +16,26 @@
 #include <cart_controller.h>
 
 // Defines
-#define CART_MAX_BACKLOG 5
+#define CART_MAX_BACKLOG 128     // Connections a server lets wait to be accepted
 #define CART_NET_HEADER_SIZE sizeof(CartXferRegister)
 #define CART_DEFAULT_IP "127.0.0.1"
 #define CART_DEFAULT_PORT 21785
+#define CART_PIPELINE_DEPTH 16   // Maximum requests in flight on a connection
+#define CART_MAX_SERVERS 16      // Servers the cartridges may be striped across
+
+// A request sent through the pipelined client
+typedef struct {
+	CartXferRegister reg;   // Request registers
+	void            *buf;   // Frame to read into / write from (RDFRME/WRFRME)
+	CartridgeIndex   cart;  // Cartridge it is for, routes it to that cartridge's server
+	CartXferRegister resp;  // Response registers
+} CartBusOp;
+
+// Where bus requests are executed
+typedef enum {
+	CART_BUS_NETWORK = 0,   // Sent to cart_server over TCP
+	CART_BUS_LOCAL   = 1,   // Executed by the in-process controller
+} CartBusBackend;
 
 // Global data
 extern int            cart_network_shutdown; // Flag indicating shutdown
@@ -32,6 +48,24 @@ extern unsigned short cart_network_port;     // Port of CART server
 CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf);
 	// This is the implementation of the client operation (cart_client.c)
 
+int client_cart_bus_pipeline(CartBusOp *ops, int count);
+	// Send requests back to back, matching responses in order (cart_client.c)
+
+int set_cart_bus_backend(CartBusBackend backend);
+	// Select where bus requests go (must be called before power on)
+
+int parse_cart_bus_backend(const char *name);
+	// Get the backend named "net" or "local", -1 if unknown
+
+int set_cart_servers(const char *list);
+	// Stripe the cartridges across "<ip>[:<port>],..." (must be called before power on)
+
+int get_cart_server_count(void);
+	// Get the number of servers the cartridges are striped across
+
+int get_cart_server(CartridgeIndex cart);
+	// Get the index of the server a cartridge is on
+
 int cart_server( void );
 	// This is the implementation of the server application (cart_server.c)
 
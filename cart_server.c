@@ -0,0 +1,812 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_server.c
+//  Description    : This is a multi-client stand-in for the prebuilt
+//                   cart_server, built as cart_mserver.  It speaks the same
+//                   protocol (an 8 byte big-endian register, followed by a
+//                   frame for RDFRME/WRFRME) to any number of clients at
+//                   once, with non-blocking sockets served by a pool of
+//                   workers sharing one epoll set.  Every connection is a
+//                   session of the in-process controller: the cartridges
+//                   are shared, the loaded cartridge is per connection.
+//                   With -g it is instead a load generator measuring the
+//                   throughput of a server.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Include Files
+#define _GNU_SOURCE                         // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// Project Include Files
+#include <cart_network.h>
+#include <cart_stats.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define CART_SERVER_ARGUMENTS "hvsl:i:p:t:d:f:g:n:"
+#define CART_SERVER_MAX_THREADS 64          // Workers in the pool
+#define CART_SERVER_EVENTS 64               // Events taken by one epoll_wait
+#define CART_SERVER_WAIT_MS 200             // Longest wait before checking for shutdown
+#define CART_SERVER_INPUT 65536             // Bytes read from a connection at a time
+#define CART_SERVER_MAX_OUTPUT 262144       // Responses buffered before reading stops
+#define CART_SERVER_READ_BUDGET 16          // Reads before giving other connections a turn
+#define CART_LOAD_REQUESTS 100000           // Default requests of each generator client
+#define CART_LOAD_MAGIC 0x43534d43          // "CMSC", marks a frame a generator wrote
+#define USAGE \
+	"USAGE: cart_mserver [-h] [-v] [-s] [-l <logfile>] [-i <ip>] [-p <port>] [-t <threads>]\n" \
+	"                    [-d <ldcart>,<rdfrme>,<wrfrme>] [-f <store>]\n" \
+	"       cart_mserver -g <clients> [-n <requests>] [-i <ip>] [-p <port>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -s - publish live statistics for cart_stat while running\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"    -i - IP address to listen on (default any) / of the server to load\n" \
+	"    -p - port number to listen on / of the server to load\n" \
+	"    -t - number of worker threads (default one per processor)\n" \
+	"    -d - microseconds charged per cartridge switch, frame read, frame write\n" \
+	"    -f - keep the cartridges in the file <store> between runs (" CART_MEMSYS_BACKING_STORE "\n" \
+	"         is the one cart_server uses), otherwise only in memory while serving\n" \
+	"    -g - generate load from <clients> concurrent connections instead of serving\n" \
+	"    -n - requests sent by each generator client (default 100000)\n" \
+	"\n" \
+
+// A client connection
+typedef struct {
+	int                   fd;                       // Non-blocking socket
+	CartControllerSession session;                  // Its state in the controller
+	char                  in[CART_SERVER_INPUT];    // Bytes received, not yet executed
+	size_t                inLen;
+	char                 *out;                      // Responses not yet sent
+	size_t                outLen, outOff, outCap;
+} CartConnection;
+
+// A load generator client
+typedef struct {
+	int      id;        // Client number
+	int      clients;   // Number of clients, each owns every clients-th frame
+	int      requests;  // Requests to send
+	uint64_t frames;    // Frames moved
+	uint64_t errors;    // Failed requests and bad frames
+} CartLoadClient;
+
+//
+// Global Data
+static int serverThreads = 0;               // Workers (0 = one per processor)
+static int listenFd = -1;                   // Listening socket
+static int epollFd = -1;                    // Events of the listener and every connection
+static uint64_t connectionsAccepted = 0;    // Connections served so far
+static CartHistogram loadLatency;           // Generator round trips
+
+//
+// Functional Prototypes
+
+int cart_load_generator(int clients, int requests);  // measure the throughput of a server
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_signal
+// Description  : Ask the server to shut down
+//
+// Inputs       : sig - the signal received
+// Outputs      : none
+
+static void server_signal(int sig) {
+	cart_network_shutdown = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function of the multi-client CART server
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0, publish_stats = 0, clients = 0, ret;
+	int requests = CART_LOAD_REQUESTS;
+	unsigned int ldcart_us, rdfrme_us, wrfrme_us;
+	CartLatencyModel model;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_SERVER_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 's': // Statistics Flag
+			publish_stats = 1;
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'i': // Get the IP address
+			if ( inet_addr(optarg) == INADDR_NONE ) {
+				fprintf( stderr, "Bad IP address [%s]\n", optarg );
+				return( -1 );
+			}
+			cart_network_address = (unsigned char *)strdup( optarg );
+			break;
+
+		case 'p': // Set the network port number
+			if ( sscanf(optarg, "%hu", &cart_network_port) != 1 ) {
+				fprintf( stderr, "Bad port number [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 't': // Number of workers
+			if ( sscanf(optarg, "%d", &serverThreads) != 1 || serverThreads < 1 ||
+			     serverThreads > CART_SERVER_MAX_THREADS ) {
+				fprintf( stderr, "Bad number of threads [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'd': // Set the latency model of the controller
+			if ( sscanf(optarg, "%u,%u,%u", &ldcart_us, &rdfrme_us, &wrfrme_us) != 3 ) {
+				fprintf( stderr, "Bad controller latencies [%s]\n", optarg );
+				return( -1 );
+			}
+			model.ldcartNs = (uint64_t)ldcart_us * 1000;
+			model.rdfrmeNs = (uint64_t)rdfrme_us * 1000;
+			model.wrfrmeNs = (uint64_t)wrfrme_us * 1000;
+			set_cart_controller_latency( &model );
+			break;
+
+		case 'f': // Set the backing store
+			if ( set_cart_controller_store(optarg) ) {
+				return( -1 );
+			}
+			break;
+
+		case 'g': // Load generator
+			if ( sscanf(optarg, "%d", &clients) != 1 || clients < 1 || clients > CART_CARTRIDGE_SIZE ) {
+				fprintf( stderr, "Bad number of clients [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'n': // Requests of each generator client
+			if ( sscanf(optarg, "%d", &requests) != 1 || requests < 1 ) {
+				fprintf( stderr, "Bad number of requests [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	if ( verbose ) {
+		enableLogLevels( LOG_INFO_LEVEL );
+	}
+	if ( clients > 0 ) {
+		return( cart_load_generator(clients, requests) );
+	}
+
+	// Serve until interrupted
+	if ( publish_stats && cart_stats_publish() ) {
+		return( -1 );
+	}
+	signal( SIGINT, server_signal );
+	signal( SIGTERM, server_signal );
+	signal( SIGPIPE, SIG_IGN );
+	ret = cart_server();
+	if ( publish_stats ) {
+		cart_stats_unpublish();
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : connection_close
+// Description  : Drop a connection, powering its session off if the client
+//                went away without doing so
+//
+// Inputs       : c - the connection
+// Outputs      : none
+
+static void connection_close(CartConnection *c) {
+	if ( c->session.powered ) {
+		cart_controller_bus( &c->session, (CartXferRegister)CART_OP_POWOFF << 56, NULL );
+	}
+	logMessage( CartControllerLLevel, "Connection %d closed.", c->fd );
+	close( c->fd );
+	free( c->out );
+	free( c );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : connection_execute
+// Description  : Execute the complete requests received on a connection, in
+//                order, queueing their responses until enough are waiting
+//
+// Inputs       : c - the connection
+// Outputs      : 0 if successful, -1 if failure
+
+static int connection_execute(CartConnection *c) {
+
+	// Local variables
+	size_t used = 0;
+	CartFrame frame;
+
+	while ( c->outLen < CART_SERVER_MAX_OUTPUT && c->inLen - used >= CART_NET_HEADER_SIZE ) {
+
+		// Take the next request if all of it is here
+		CartXferRegister reg, resp;
+		memcpy( &reg, c->in + used, sizeof(reg) );
+		reg = ntohll64( reg );
+		uint64_t ky1 = (reg >> 56) & 0xff;
+		size_t len = CART_NET_HEADER_SIZE + ((ky1 == CART_OP_WRFRME) ? CART_FRAME_SIZE : 0);
+		if ( c->inLen - used < len ) {
+			break;
+		}
+		void *buf = NULL;
+		if ( ky1 == CART_OP_WRFRME ) {
+			buf = c->in + used + CART_NET_HEADER_SIZE;
+		} else if ( ky1 == CART_OP_RDFRME ) {
+			memset( frame, 0, sizeof(frame) );
+			buf = frame;
+		}
+		used += len;
+
+		uint64_t start = cart_stats_now();
+		resp = htonll64( cart_controller_bus(&c->session, reg, buf) );
+		if ( ky1 < CART_OP_MAXVAL ) {
+			CART_STAT_INC( busOps[ky1] );
+			cart_hist_record( &cartStats->busLatency[ky1], cart_stats_now() - start );
+		}
+
+		// Queue the response, with the frame for a read
+		size_t need = c->outLen + CART_NET_HEADER_SIZE + CART_FRAME_SIZE;
+		if ( need > c->outCap ) {
+			size_t cap = c->outCap ? c->outCap : 4096;
+			while ( cap < need ) {
+				cap *= 2;
+			}
+			char *out = realloc( c->out, cap );
+			if ( out == NULL ) {
+				logMessage( LOG_ERROR_LEVEL, "Cannot queue a response on connection %d.", c->fd );
+				return( -1 );
+			}
+			c->out = out;
+			c->outCap = cap;
+		}
+		memcpy( c->out + c->outLen, &resp, sizeof(resp) );
+		c->outLen += sizeof(resp);
+		if ( ky1 == CART_OP_RDFRME ) {
+			memcpy( c->out + c->outLen, frame, CART_FRAME_SIZE );
+			c->outLen += CART_FRAME_SIZE;
+		}
+	}
+
+	memmove( c->in, c->in + used, c->inLen - used );
+	c->inLen -= used;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : connection_flush
+// Description  : Send as much of the queued responses as the socket takes
+//
+// Inputs       : c - the connection
+// Outputs      : 0 if successful, -1 if failure
+
+static int connection_flush(CartConnection *c) {
+	while ( c->outOff < c->outLen ) {
+		ssize_t n = write( c->fd, c->out + c->outOff, c->outLen - c->outOff );
+		if ( n == -1 && errno == EINTR ) {
+			continue;
+		}
+		if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+			return( 0 );
+		}
+		if ( n <= 0 ) {
+			return( -1 );
+		}
+		c->outOff += n;
+	}
+	c->outOff = c->outLen = 0;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : connection_serve
+// Description  : Make progress on a connection a worker got an event for:
+//                send waiting responses, then read and execute requests
+//                until the socket is drained, the responses back up or the
+//                connection had its turn.  Connections are armed one shot,
+//                so only one worker serves a connection at a time and its
+//                requests run in the order they were sent.
+//
+// Inputs       : c - the connection
+// Outputs      : none
+
+static void connection_serve(CartConnection *c) {
+
+	// Local variables
+	struct epoll_event ev;
+	int reads = 0;
+
+	ev.data.ptr = c;
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	for (;;) {
+		if ( connection_flush(c) ) {
+			connection_close( c );
+			return;
+		}
+		if ( c->outLen > 0 ) {
+			ev.events = EPOLLOUT | EPOLLONESHOT;      // wait for the client to read
+			break;
+		}
+		if ( connection_execute(c) ) {
+			connection_close( c );
+			return;
+		}
+		if ( c->outLen > 0 ) {
+			continue;
+		}
+		if ( reads++ == CART_SERVER_READ_BUDGET ) {
+			break;
+		}
+		ssize_t n = read( c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen );
+		if ( n == -1 && errno == EINTR ) {
+			continue;
+		}
+		if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+			break;
+		}
+		if ( n <= 0 ) {
+			connection_close( c );
+			return;
+		}
+		c->inLen += n;
+	}
+	if ( epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Cannot rearm connection %d: %s", c->fd, strerror(errno) );
+		connection_close( c );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_accept
+// Description  : Accept every pending connection and add it to the epoll set
+//
+// Inputs       : none
+// Outputs      : none
+
+static void server_accept(void) {
+
+	// Local variables
+	struct epoll_event ev;
+	int fd, one = 1;
+
+	while ( (fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1 ) {
+		CartConnection *c = calloc( 1, sizeof(CartConnection) );
+		if ( c == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "Cannot allocate a connection, dropping it." );
+			close( fd );
+			continue;
+		}
+		c->fd = fd;
+		c->session.loaded = CART_NO_CARTRIDGE;
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+		ev.data.ptr = c;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		if ( epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "Cannot watch connection %d: %s", fd, strerror(errno) );
+			close( fd );
+			free( c );
+			continue;
+		}
+		__atomic_fetch_add( &connectionsAccepted, 1, __ATOMIC_RELAXED );
+		logMessage( CartControllerLLevel, "Connection %d accepted.", fd );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_worker
+// Description  : Serve the events of the epoll set until shutdown
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void *server_worker(void *arg) {
+
+	// Local variables
+	struct epoll_event events[CART_SERVER_EVENTS];
+
+	while ( ! cart_network_shutdown ) {
+		int n = epoll_wait( epollFd, events, CART_SERVER_EVENTS, CART_SERVER_WAIT_MS );
+		for ( int i = 0; i < n; i++ ) {
+			if ( events[i].data.ptr == NULL ) {
+				server_accept();
+			} else {
+				connection_serve( events[i].data.ptr );
+			}
+		}
+	}
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_server
+// Description  : Listen on cart_network_address/cart_network_port and serve
+//                every client with a pool of workers until
+//                cart_network_shutdown is set
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_server( void ) {
+
+	// Local variables
+	struct sockaddr_in saddr;
+	struct epoll_event ev;
+	pthread_t workers[CART_SERVER_MAX_THREADS];
+	int one = 1, nworkers = serverThreads;
+
+	memset( &saddr, 0, sizeof(saddr) );
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons( cart_network_port ? cart_network_port : CART_DEFAULT_PORT );
+	saddr.sin_addr.s_addr = htonl( INADDR_ANY );
+	if ( cart_network_address != NULL ) {
+		inet_aton( (char *)cart_network_address, &saddr.sin_addr );
+	}
+	if ( (listenFd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Cannot create the server socket: %s", strerror(errno) );
+		return( -1 );
+	}
+	setsockopt( listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+	if ( bind(listenFd, (struct sockaddr *)&saddr, sizeof(saddr)) == -1 ||
+	     listen(listenFd, CART_MAX_BACKLOG) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Cannot listen on port %d: %s", ntohs(saddr.sin_port), strerror(errno) );
+		close( listenFd );
+		return( -1 );
+	}
+
+	// The listener is level triggered and wakes one worker at a time
+	if ( (epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Cannot create the epoll set: %s", strerror(errno) );
+		close( listenFd );
+		return( -1 );
+	}
+	ev.data.ptr = NULL;
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	epoll_ctl( epollFd, EPOLL_CTL_ADD, listenFd, &ev );
+
+	if ( nworkers == 0 ) {
+		nworkers = sysconf( _SC_NPROCESSORS_ONLN );
+		if ( nworkers < 1 ) {
+			nworkers = 1;
+		} else if ( nworkers > CART_SERVER_MAX_THREADS ) {
+			nworkers = CART_SERVER_MAX_THREADS;
+		}
+	}
+	logMessage( LOG_INFO_LEVEL, "CART server listening on port %d with %d workers.",
+		ntohs(saddr.sin_port), nworkers );
+	for ( int i = 0; i < nworkers; i++ ) {
+		if ( pthread_create(&workers[i], NULL, server_worker, NULL) ) {
+			logMessage( LOG_ERROR_LEVEL, "Cannot start worker %d.", i );
+			cart_network_shutdown = 1;
+			nworkers = i;
+		}
+	}
+	for ( int i = 0; i < nworkers; i++ ) {
+		pthread_join( workers[i], NULL );
+	}
+
+	logMessage( LOG_INFO_LEVEL, "CART server served %llu connections.",
+		(unsigned long long)connectionsAccepted );
+	cart_stats_log_latency();
+	close( epollFd );
+	close( listenFd );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_write_all / load_read_all
+// Description  : Write / read exactly len bytes on a generator connection
+//
+// Inputs       : fd - the connection
+//                buf - the data to send / the buffer to receive into
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+static int load_write_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while ( len > 0 ) {
+		ssize_t n = write( fd, p, len );
+		if ( n == -1 && errno == EINTR ) {
+			continue;
+		}
+		if ( n <= 0 ) {
+			return( -1 );
+		}
+		p += n;
+		len -= n;
+	}
+	return( 0 );
+}
+
+static int load_read_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+	int one = 1;
+	while ( len > 0 ) {
+		// as in cart_client.c, so cart_server's split responses are not held back
+		setsockopt( fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one) );
+		ssize_t n = read( fd, p, len );
+		if ( n == -1 && errno == EINTR ) {
+			continue;
+		}
+		if ( n <= 0 ) {
+			return( -1 );
+		}
+		p += n;
+		len -= n;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_rand
+// Description  : Get the next value of a generator client's xorshift sequence
+//
+// Inputs       : state - the state of the sequence (updated)
+// Outputs      : a pseudo-random value
+
+static uint64_t load_rand(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return( *state * 2685821657736338717ULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_stamp / load_check
+// Description  : Fill a frame with a pattern naming its cartridge and frame /
+//                check that a frame read back is one the generator wrote to
+//                that place, untorn (frames never written are accepted)
+//
+// Inputs       : frame - the frame
+//                cart, frm - where it is written / was read from
+//                writer, seq - who wrote it and when (load_stamp)
+// Outputs      : load_check: 0 if the frame is good, -1 if not
+
+static void load_stamp(char *frame, uint32_t cart, uint32_t frm, uint32_t writer, uint32_t seq) {
+	uint32_t head[5] = { CART_LOAD_MAGIC, cart, frm, writer, seq };
+	memset( frame, (int)(seq & 0xff), CART_FRAME_SIZE );
+	memcpy( frame, head, sizeof(head) );
+}
+
+static int load_check(const char *frame, uint32_t cart, uint32_t frm) {
+	uint32_t head[5];
+	memcpy( head, frame, sizeof(head) );
+	if ( head[0] != CART_LOAD_MAGIC ) {
+		return( 0 );
+	}
+	if ( head[1] != cart || head[2] != frm ) {
+		return( -1 );
+	}
+	for ( size_t i = sizeof(head); i < CART_FRAME_SIZE; i++ ) {
+		if ( (unsigned char)frame[i] != (head[4] & 0xff) ) {
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_client
+// Description  : One generator client: power on, then send windows of
+//                CART_PIPELINE_DEPTH requests, a cartridge load followed by
+//                reads and writes of random frames the client owns on it,
+//                checking every frame read, then power off
+//
+// Inputs       : arg - the client (CartLoadClient)
+// Outputs      : NULL
+
+static void *load_client(void *arg) {
+
+	// Local variables
+	CartLoadClient *lc = arg;
+	struct sockaddr_in caddr;
+	char out[CART_PIPELINE_DEPTH * (CART_NET_HEADER_SIZE + CART_FRAME_SIZE)];
+	CartFrame frames[CART_PIPELINE_DEPTH];
+	CartXferRegister regs[CART_PIPELINE_DEPTH], value;
+	uint64_t state = 0x9e3779b97f4a7c15ULL * (lc->id + 1), start;
+	uint32_t seq = 0, owned = CART_CARTRIDGE_SIZE / lc->clients;
+	int fd, one = 1, sent = 0, cart = 0, powered = 0;
+
+	memset( &caddr, 0, sizeof(caddr) );
+	caddr.sin_family = AF_INET;
+	caddr.sin_port = htons( cart_network_port ? cart_network_port : CART_DEFAULT_PORT );
+	inet_aton( cart_network_address ? (char *)cart_network_address : CART_DEFAULT_IP, &caddr.sin_addr );
+	if ( (fd = socket(PF_INET, SOCK_STREAM, 0)) == -1 ||
+	     connect(fd, (struct sockaddr *)&caddr, sizeof(caddr)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Load client %d cannot connect: %s", lc->id, strerror(errno) );
+		if ( fd != -1 ) {
+			close( fd );
+		}
+		lc->errors++;
+		return( NULL );
+	}
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+	while ( powered >= 0 ) {
+
+		// Build the next window: power on first, power off last
+		int count = 0;
+		size_t len = 0;
+		if ( ! powered ) {
+			regs[count++] = (CartXferRegister)CART_OP_INITMS << 56;
+			powered = 1;
+		} else if ( sent >= lc->requests ) {
+			regs[count++] = (CartXferRegister)CART_OP_POWOFF << 56;
+			powered = -1;
+		} else {
+			cart = load_rand( &state ) % CART_MAX_CARTRIDGES;
+			regs[count++] = ((CartXferRegister)CART_OP_LDCART << 56) | ((CartXferRegister)cart << 31);
+			sent++;
+			while ( count < CART_PIPELINE_DEPTH && sent < lc->requests ) {
+				uint64_t r = load_rand( &state );
+				uint32_t frm = (r >> 1) % owned * lc->clients + lc->id;
+				uint64_t op = (r & 1) ? CART_OP_WRFRME : CART_OP_RDFRME;
+				regs[count] = (op << 56) | ((CartXferRegister)frm << 15);
+				if ( op == CART_OP_WRFRME ) {
+					load_stamp( frames[count], cart, frm, lc->id, seq++ );
+				}
+				count++;
+				sent++;
+			}
+		}
+		for ( int i = 0; i < count; i++ ) {
+			value = htonll64( regs[i] );
+			memcpy( out + len, &value, sizeof(value) );
+			len += sizeof(value);
+			if ( ((regs[i] >> 56) & 0xff) == CART_OP_WRFRME ) {
+				memcpy( out + len, frames[i], CART_FRAME_SIZE );
+				len += CART_FRAME_SIZE;
+			}
+		}
+
+		// Send it, then collect and check the responses
+		start = cart_stats_now();
+		if ( load_write_all(fd, out, len) ) {
+			logMessage( LOG_ERROR_LEVEL, "Load client %d lost its connection.", lc->id );
+			lc->errors++;
+			break;
+		}
+		for ( int i = 0; i < count; i++ ) {
+			uint64_t op = (regs[i] >> 56) & 0xff;
+			if ( load_read_all(fd, &value, sizeof(value)) ||
+			     (op == CART_OP_RDFRME && load_read_all(fd, frames[i], CART_FRAME_SIZE)) ) {
+				logMessage( LOG_ERROR_LEVEL, "Load client %d lost its connection.", lc->id );
+				lc->errors++;
+				close( fd );
+				return( NULL );
+			}
+			cart_hist_record( &loadLatency, cart_stats_now() - start );
+			if ( (ntohll64(value) >> 47) & 1 ) {
+				lc->errors++;
+			} else if ( op == CART_OP_RDFRME &&
+			            load_check(frames[i], cart, (regs[i] >> 15) & 0xffff) ) {
+				logMessage( LOG_ERROR_LEVEL, "Load client %d read a bad frame %d/%d.",
+					lc->id, cart, (int)((regs[i] >> 15) & 0xffff) );
+				lc->errors++;
+			}
+			if ( op == CART_OP_RDFRME || op == CART_OP_WRFRME ) {
+				lc->frames++;
+			}
+		}
+	}
+
+	close( fd );
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_load_generator
+// Description  : Run concurrent clients against a server and report the
+//                throughput and latency of their requests
+//
+// Inputs       : clients - the number of clients
+//                requests - the requests each one sends
+// Outputs      : 0 if every request succeeded, -1 if failure
+
+int cart_load_generator(int clients, int requests) {
+
+	// Local variables
+	CartLoadClient *lc = calloc( clients, sizeof(CartLoadClient) );
+	pthread_t *threads = calloc( clients, sizeof(pthread_t) );
+	uint64_t frames = 0, errors = 0, start, ns;
+	int started = 0;
+
+	if ( lc == NULL || threads == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "Cannot allocate %d load clients.", clients );
+		free( lc );
+		free( threads );
+		return( -1 );
+	}
+	signal( SIGPIPE, SIG_IGN );
+	start = cart_stats_now();
+	for ( started = 0; started < clients; started++ ) {
+		lc[started].id = started;
+		lc[started].clients = clients;
+		lc[started].requests = requests;
+		if ( pthread_create(&threads[started], NULL, load_client, &lc[started]) ) {
+			logMessage( LOG_ERROR_LEVEL, "Cannot start load client %d.", started );
+			errors++;
+			break;
+		}
+	}
+	for ( int i = 0; i < started; i++ ) {
+		pthread_join( threads[i], NULL );
+		frames += lc[i].frames;
+		errors += lc[i].errors;
+	}
+	ns = cart_stats_now() - start;
+
+	printf( "%d clients, %llu requests in %.3f s: %.0f requests/s, %.2f MB/s of frames, %llu errors\n",
+		clients, (unsigned long long)loadLatency.count, ns / 1e9,
+		loadLatency.count / (ns / 1e9), frames * (double)CART_FRAME_SIZE / 1e6 / (ns / 1e9),
+		(unsigned long long)errors );
+	printf( "round trip us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+		cart_hist_percentile(&loadLatency, 50.0) / 1000.0, cart_hist_percentile(&loadLatency, 99.0) / 1000.0,
+		cart_hist_percentile(&loadLatency, 99.9) / 1000.0, loadLatency.maxNs / 1000.0 );
+	free( lc );
+	free( threads );
+	return( errors ? -1 : 0 );
+}
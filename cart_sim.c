@@ -25,22 +25,32 @@
 #include <cart_driver.h>
 #include <cart_cache.h>
 #include <cart_network.h>
+#include <cart_stats.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define CART_WORKLOAD_DIR "workload"
-#define CART_SIM_MAX_OPEN_FILES 128
-#define CART_ARGUMENTS "huvl:c:i:p:"
+#define CART_SIM_MAX_OPEN_FILES 1024 // Size of the file table (a power of two)
+#define CART_ARGUMENTS "huvwmsl:c:r:b:d:f:i:p:"
 #define USAGE \
-	"USAGE: cart_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n" \
+	"USAGE: cart_sim [-h] [-v] [-w] [-m] [-s] [-l <logfile>] [-c <sz>] [-r <policy>]\n" \
+	"                [-b <backend>] [-d <ldcart>,<rdfrme>,<wrfrme>] [-f <store>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
+	"    -w - write-back frame cache with a background flusher\n" \
+	"    -m - keep the files on the cartridges from one run to the next\n" \
+	"    -s - publish live statistics for cart_stat while running\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
 	"    -c - set the cart block cache to size <sz> (disabled for assign #2)\n" \
-	"    -i - IP address of server to connect to.\n" \
+	"    -r - set the cache replacement policy to lru (default), clock, 2q or arc\n" \
+	"    -b - send bus requests to the server (net, default) or the in-process controller (local)\n" \
+	"    -d - microseconds the local controller charges per cartridge switch, frame read, frame write\n" \
+	"    -f - keep the cartridges of the local controller in the file <store> between runs\n" \
+	"    -i - IP address of server to connect to, or a list of servers\n" \
+	"         <ip>[:<port>],... to stripe the cartridges across.\n" \
 	"    -p - port number of server to connect to.\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
@@ -61,6 +71,7 @@ int verbose;
 
 int simulate_CART( char *wload );             // control loop of the CART simulation
 int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesystem
+int find_sim_file(CartSimulationTable *ftable, char *fname); // Find a file's slot in the file table
 
 //
 // Functions
@@ -77,8 +88,11 @@ int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesyst
 int main( int argc, char *argv[] ) {
 
 	// Local variables
-	int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
+	int ch, verbose = 0, log_initialized = 0, unit_tests = 0, publish_stats = 0;
 	uint32_t cache_size = 0;
+	int policy, backend;
+	unsigned int ldcart_us, rdfrme_us, wrfrme_us;
+	CartLatencyModel model;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, CART_ARGUMENTS)) != -1) {
@@ -92,6 +106,19 @@ int main( int argc, char *argv[] ) {
 			verbose = 1;
 			break;
 
+		case 'w': // Write-back cache Flag
+			cart_set_write_policy(CART_WRITE_BACK);
+			cart_set_flusher(CART_DEFAULT_FLUSH_HIGH, CART_DEFAULT_FLUSH_LOW, CART_DEFAULT_FLUSH_AGE);
+			break;
+
+		case 'm': // Persistent file table Flag
+			cart_set_mount_policy(CART_MOUNT_PERSIST);
+			break;
+
+		case 's': // Statistics Flag
+			publish_stats = 1;
+			break;
+
 		case 'u': // Unit test Flag
 			unit_tests = 1;
 			break;
@@ -107,12 +134,44 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
-        case 'i': // Get the IP address
-            if (inet_addr(optarg) == INADDR_NONE) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", argv[optind] );
+		case 'r': // Set the cache replacement policy
+			if ( (policy = parse_cart_cache_policy(optarg)) == -1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad cache policy [%s]", optarg );
+			    return( -1 );
+			}
+			set_cart_cache_policy(policy);
+			break;
+
+		case 'b': // Set the bus backend
+			if ( (backend = parse_cart_bus_backend(optarg)) == -1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad bus backend [%s]", optarg );
+			    return( -1 );
+			}
+			set_cart_bus_backend(backend);
+			break;
+
+		case 'd': // Set the latency model of the local controller
+			if ( sscanf(optarg, "%u,%u,%u", &ldcart_us, &rdfrme_us, &wrfrme_us) != 3 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad controller latencies [%s]", optarg );
+			    return( -1 );
+			}
+			model.ldcartNs = (uint64_t)ldcart_us * 1000;
+			model.rdfrmeNs = (uint64_t)rdfrme_us * 1000;
+			model.wrfrmeNs = (uint64_t)wrfrme_us * 1000;
+			set_cart_controller_latency(&model);
+			break;
+
+		case 'f': // Set the backing store of the local controller
+			if ( set_cart_controller_store(optarg) ) {
+			    return( -1 );
+			}
+			break;
+
+        case 'i': // Get the IP address, or the servers to stripe the cartridges across
+			if ( set_cart_servers(optarg) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad server list [%s]", optarg );
                 return(-1);
-            }
-            cart_network_address = (unsigned char *)strdup(optarg);
+			}
 			break;
 
         case 'p': // Set the network port number
@@ -141,13 +200,18 @@ int main( int argc, char *argv[] ) {
 		set_cart_cache_size(cache_size);
 	}
 
+	// Publish the statistics as needed
+	if (publish_stats && cart_stats_publish()) {
+		return( -1 );
+	}
+
 	// If exgtracting file from data
 	if (unit_tests) {
 
 		// Run the unit tests
 		enableLogLevels( LOG_INFO_LEVEL );
 		logMessage(LOG_INFO_LEVEL, "Running unit tests ....\n\n");
-		if ( (cartCacheUnitTest() == 0) && (cartCacheUnitTest() == 0) ) {
+		if ( (cartCacheUnitTest() == 0) && (cartCacheUnitTest() == 0) && (cartDriverUnitTest() == 0) ) {
 			logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
 		} else {
 			logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
@@ -171,6 +235,9 @@ int main( int argc, char *argv[] ) {
 			logMessage( LOG_INFO_LEVEL, "CART simulation failed.\n\n" );
 		}
 	}
+	if (publish_stats) {
+		cart_stats_unpublish();
+	}
 
 	// Return successfully
 	return( 0 );
@@ -234,26 +301,15 @@ int simulate_CART( char *wload ) {
 			logMessage(CartSimulatorLLevel, "File [%s], command [%s], len=%d, offset=%d",
 					fname, command, len, off);
 
-			// Now walk the the table looking for the file
-			idx = -1;
-			i = 0;
-			while ( (i < CART_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-				if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-					idx = i;
-				}
-				i++;
-			}
+			// Now look the file up in the table
+			idx = find_sim_file(ftable, fname);
+			CMPSC_ASSERT1(idx!=-1, "Too many open files on CART sim [%d]", CART_SIM_MAX_OPEN_FILES);
 
 			// File is not found, open the file
-			if (idx == -1) {
+			if (ftable[idx].filename == NULL) {
 
-				// Log message, find unused index and save filename for later use
+				// Log message, save filename for later use
 				logMessage(CartSimulatorLLevel, "CART_SIM : Opening file [%s]", fname);
-				idx = 0;
-				while ((ftable[idx].filename != NULL) && (idx < CART_SIM_MAX_OPEN_FILES)) {
-					idx++;
-				}
-				CMPSC_ASSERT1(idx<CART_SIM_MAX_OPEN_FILES, "Too many open files on CART sim [%d]", idx);
 				ftable[idx].filename = strdup(fname);
 
 				// Now perform the open
@@ -390,6 +446,36 @@ int simulate_CART( char *wload ) {
 	return( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_sim_file
+// Description  : Find the slot of a file in the file table, which is an open
+//                addressed hash table on the file name
+//
+// Inputs       : ftable - the file table
+//                fname - the name of the file
+// Outputs      : the slot holding the file, or the empty slot for it,
+//                -1 if the table is full
+
+int find_sim_file(CartSimulationTable *ftable, char *fname) {
+
+	// Local variables
+	uint32_t hash = 2166136261u;
+	int idx, i;
+
+	// Hash the name (FNV-1a), then probe linearly from its slot
+	for (i=0; fname[i]!=0x0; i++) {
+		hash = (hash ^ (unsigned char)fname[i]) * 16777619u;
+	}
+	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
+		idx = (hash + i) & (CART_SIM_MAX_OPEN_FILES - 1);
+		if ( (ftable[idx].filename == NULL) || (strcmp(ftable[idx].filename,fname) == 0) ) {
+			return( idx );
+		}
+	}
+	return( -1 );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : validate_file
@@ -0,0 +1,246 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_stat.c
+//  Description    : This is a tool printing the live statistics of a CART
+//                   process started with -s, one line per interval like
+//                   vmstat, or its latency percentiles.  It only maps the counters, the process is
+//                   never stopped or slowed down.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// Project Include Files
+#include <cart_stats.h>
+
+// Defines
+#define CART_STAT_ARGUMENTS "hali:n:"
+#define CART_STAT_HEADER_EVERY 20   // Lines between two headers
+#define USAGE \
+	"USAGE: cart_stat [-h] [-a] [-l] [-i <sec>] [-n <count>] <pid>\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -a - print every counter once and exit\n" \
+	"    -l - print the latency percentiles once and exit\n" \
+	"    -i - seconds between two lines (default 1)\n" \
+	"    -n - stop after <count> lines (default: until the process exits)\n" \
+	"\n" \
+	"    <pid> - process id of a cart_client started with -s\n" \
+	"\n" \
+
+//
+// Functional Prototypes
+
+void print_all(const CartStats *s);                          // print every counter
+void print_latency(const CartStats *s);                      // print the latency percentiles
+void print_line(const CartStats *now, const CartStats *was); // print one interval
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the CART statistics tool
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, all = 0, latency = 0, interval = 1, count = -1, pid, fd;
+	char name[32];
+	CartStats *stats, now, was;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_STAT_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'a': // Print all counters
+			all = 1;
+			break;
+
+		case 'l': // Print the latencies
+			latency = 1;
+			break;
+
+		case 'i': // Interval between lines
+			if ( sscanf(optarg, "%d", &interval) != 1 || interval <= 0 ) {
+				fprintf( stderr, "Bad interval [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'n': // Number of lines
+			if ( sscanf(optarg, "%d", &count) != 1 || count <= 0 ) {
+				fprintf( stderr, "Bad count [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+	if ( optind >= argc || sscanf(argv[optind], "%d", &pid) != 1 ) {
+		fprintf( stderr, "Missing process id, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+
+	// Map the counters of the process
+	snprintf( name, sizeof(name), CART_STATS_NAME, pid );
+	if ( (fd = shm_open(name, O_RDONLY, 0)) == -1 ) {
+		fprintf( stderr, "No statistics for process %d (started without -s?)\n", pid );
+		return( -1 );
+	}
+	stats = mmap( NULL, sizeof(CartStats), PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( stats == MAP_FAILED || __atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != CART_STATS_MAGIC ||
+	     stats->version != CART_STATS_VERSION ) {
+		fprintf( stderr, "Statistics of process %d are not readable.\n", pid );
+		return( -1 );
+	}
+
+	// Print every counter, or one line per interval until the process exits
+	memcpy( &now, stats, sizeof(CartStats) );
+	if ( all || latency ) {
+		if ( all ) {
+			print_all( &now );
+		}
+		if ( latency ) {
+			print_latency( &now );
+		}
+		return( 0 );
+	}
+	memset( &was, 0, sizeof(CartStats) );
+	for ( int line = 0; count < 0 || line < count; line++ ) {
+		if ( line % CART_STAT_HEADER_EVERY == 0 ) {
+			printf( "%6s %6s %7s %7s %9s %9s %6s %7s %7s %6s %7s %7s %7s %6s %7s %7s\n",
+				"open", "close", "read", "write", "rd_kb", "wr_kb", "ldcart", "rdfrme", "wrfrme",
+				"rtt", "hit", "miss", "evict", "wback", "alloc", "free" );
+		}
+		print_line( &now, &was );
+		fflush( stdout );
+		if ( count > 0 && line + 1 == count ) {
+			break;
+		}
+		sleep( interval );
+		if ( kill(pid, 0) == -1 && errno == ESRCH ) {
+			break;
+		}
+		was = now;
+		memcpy( &now, stats, sizeof(CartStats) );
+	}
+
+	munmap( stats, sizeof(CartStats) );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : print_line
+// Description  : Print the counters that changed during one interval (the
+//                first line shows the totals since the process started)
+//
+// Inputs       : now - the counters at the end of the interval
+//                was - the counters at its start
+// Outputs      : none
+
+void print_line(const CartStats *now, const CartStats *was) {
+	printf( "%6llu %6llu %7llu %7llu %9llu %9llu %6llu %7llu %7llu %6llu %7llu %7llu %7llu %6llu %7llu %7llu\n",
+		(unsigned long long)(now->opens - was->opens),
+		(unsigned long long)(now->closes - was->closes),
+		(unsigned long long)(now->reads - was->reads),
+		(unsigned long long)(now->writes - was->writes),
+		(unsigned long long)((now->bytesRead - was->bytesRead) / 1024),
+		(unsigned long long)((now->bytesWritten - was->bytesWritten) / 1024),
+		(unsigned long long)(now->busOps[CART_OP_LDCART] - was->busOps[CART_OP_LDCART]),
+		(unsigned long long)(now->busOps[CART_OP_RDFRME] - was->busOps[CART_OP_RDFRME]),
+		(unsigned long long)(now->busOps[CART_OP_WRFRME] - was->busOps[CART_OP_WRFRME]),
+		(unsigned long long)(now->busBatches - was->busBatches),
+		(unsigned long long)(now->cacheHits - was->cacheHits),
+		(unsigned long long)(now->cacheMisses - was->cacheMisses),
+		(unsigned long long)(now->cacheEvictions - was->cacheEvictions),
+		(unsigned long long)(now->cacheWritebacks - was->cacheWritebacks),
+		(unsigned long long)(now->framesAllocated - was->framesAllocated),
+		(unsigned long long)(now->framesFreed - was->framesFreed) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : print_all
+// Description  : Print every counter with its name
+//
+// Inputs       : s - the counters
+// Outputs      : none
+
+void print_all(const CartStats *s) {
+	static const char *opNames[CART_OP_MAXVAL] = {
+		"INITMS", "BZERO", "LDCART", "RDFRME", "WRFRME", "POWOFF" };
+
+	printf( "process            %d\n", s->pid );
+	printf( "opens              %llu\n", (unsigned long long)s->opens );
+	printf( "closes             %llu\n", (unsigned long long)s->closes );
+	printf( "reads              %llu\n", (unsigned long long)s->reads );
+	printf( "writes             %llu\n", (unsigned long long)s->writes );
+	printf( "bytes read         %llu\n", (unsigned long long)s->bytesRead );
+	printf( "bytes written      %llu\n", (unsigned long long)s->bytesWritten );
+	for ( int i = 0; i < CART_OP_MAXVAL; i++ ) {
+		printf( "bus %-14s %llu\n", opNames[i], (unsigned long long)s->busOps[i] );
+	}
+	printf( "bus round trips    %llu\n", (unsigned long long)s->busBatches );
+	printf( "loads elided       %llu\n", (unsigned long long)s->loadsElided );
+	printf( "cache hits         %llu\n", (unsigned long long)s->cacheHits );
+	printf( "cache misses       %llu\n", (unsigned long long)s->cacheMisses );
+	printf( "cache insertions   %llu\n", (unsigned long long)s->cacheInsertions );
+	printf( "cache evictions    %llu\n", (unsigned long long)s->cacheEvictions );
+	printf( "cache writebacks   %llu\n", (unsigned long long)s->cacheWritebacks );
+	printf( "frames allocated   %llu\n", (unsigned long long)s->framesAllocated );
+	printf( "frames freed       %llu\n", (unsigned long long)s->framesFreed );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : print_latency
+// Description  : Print the p50/p99/p99.9 latency of every bus opcode used
+//                and of cart_read / cart_write
+//
+// Inputs       : s - the counters
+// Outputs      : none
+
+void print_latency(const CartStats *s) {
+	static const char *opNames[CART_OP_MAXVAL] = {
+		"INITMS", "BZERO", "LDCART", "RDFRME", "WRFRME", "POWOFF" };
+	char line[160];
+
+	for ( int i = 0; i < CART_OP_MAXVAL; i++ ) {
+		if ( cart_stats_format_latency(line, sizeof(line), opNames[i], &s->busLatency[i]) ) {
+			printf( "%s\n", line );
+		}
+	}
+	if ( cart_stats_format_latency(line, sizeof(line), "read", &s->readLatency) ) {
+		printf( "%s\n", line );
+	}
+	if ( cart_stats_format_latency(line, sizeof(line), "write", &s->writeLatency) ) {
+		printf( "%s\n", line );
+	}
+}
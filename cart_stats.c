@@ -0,0 +1,228 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_stats.c
+//  Description    : This is the implementation of the live statistics of
+//                   the CART driver, kept in process memory until they are
+//                   published in a POSIX shared memory segment.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Project Includes
+#include "cart_stats.h"
+#include "cmpsc311_log.h"
+
+// Global data
+static CartStats localStats;             //counters while nothing is published
+CartStats *cartStats = &localStats;
+static char statsName[32];              //name of the published segment
+
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_stats_publish
+// Description  : Create the shared memory segment of this process, copy the
+//                counters so far into it and update them there from now on
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_stats_publish(void) {
+    
+    if (cartStats != &localStats)
+        return 0;
+    snprintf(statsName, sizeof(statsName), CART_STATS_NAME, (int)getpid());
+    int fd = shm_open(statsName, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to create statistics segment %s.", statsName);
+        return -1;
+    }
+    CartStats *shared = MAP_FAILED;
+    if (ftruncate(fd, sizeof(CartStats)) == 0)
+        shared = mmap(NULL, sizeof(CartStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to map statistics segment %s.", statsName);
+        shm_unlink(statsName);
+        return -1;
+    }
+    
+    memcpy(shared, &localStats, sizeof(CartStats));
+    shared->version = CART_STATS_VERSION;
+    shared->pid = (int32_t)getpid();
+    __atomic_store_n(&shared->magic, CART_STATS_MAGIC, __ATOMIC_RELEASE);   //readers check it last
+    cartStats = shared;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_stats_unpublish
+// Description  : Take the counters back into process memory and remove the
+//                shared memory segment
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cart_stats_unpublish(void) {
+    
+    if (cartStats == &localStats)
+        return 0;
+    CartStats *shared = cartStats;
+    memcpy(&localStats, shared, sizeof(CartStats));
+    localStats.magic = 0;
+    cartStats = &localStats;
+    munmap(shared, sizeof(CartStats));
+    if (shm_unlink(statsName)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to remove statistics segment %s.", statsName);
+        return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_stats_now
+// Description  : Get a monotonic timestamp for latency measurements
+//
+// Inputs       : none
+// Outputs      : the current time in nanoseconds
+
+uint64_t cart_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_hist_bucket / cart_hist_bucket_top
+// Description  : Map a latency to its bucket: values below 2^SUB_BITS get a
+//                bucket each, larger ones 2^SUB_BITS buckets per power of
+//                two / get the largest latency a bucket holds
+//
+// Inputs       : ns - the latency
+//                b - the bucket
+// Outputs      : the bucket / the latency
+
+static int cart_hist_bucket(uint64_t ns) {
+    if (ns >= (1ULL << CART_HIST_MAX_BITS))
+        ns = (1ULL << CART_HIST_MAX_BITS) - 1;
+    if (ns < (1 << CART_HIST_SUB_BITS))
+        return (int)ns;
+    int shift = 63 - __builtin_clzll(ns) - CART_HIST_SUB_BITS;
+    return ((shift + 1) << CART_HIST_SUB_BITS) + (int)((ns >> shift) & ((1 << CART_HIST_SUB_BITS) - 1));
+}
+
+static uint64_t cart_hist_bucket_top(int b) {
+    if (b < (1 << CART_HIST_SUB_BITS))
+        return b;
+    int shift = (b >> CART_HIST_SUB_BITS) - 1;
+    uint64_t sub = (b & ((1 << CART_HIST_SUB_BITS) - 1)) + (1 << CART_HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_hist_record
+// Description  : Add a latency to a histogram, with relaxed atomic updates
+//                so that concurrent recorders and readers never wait
+//
+// Inputs       : h - the histogram
+//                ns - the latency
+// Outputs      : none
+
+void cart_hist_record(CartHistogram *h, uint64_t ns) {
+    __atomic_fetch_add(&h->buckets[cart_hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sumNs, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->maxNs, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&h->maxNs, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_hist_percentile
+// Description  : Find the latency below which a share of the recorded ones
+//                fall, to the precision of the buckets
+//
+// Inputs       : h - the histogram
+//                pct - the share, in percent
+// Outputs      : the latency in nanoseconds, 0 if the histogram is empty
+
+uint64_t cart_hist_percentile(const CartHistogram *h, double pct) {
+    uint64_t total = 0, seen = 0;
+    for (int b = 0; b < CART_HIST_BUCKETS; b++)
+        total += h->buckets[b];
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * total + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    for (int b = 0; b < CART_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t top = cart_hist_bucket_top(b);
+            return (top < h->maxNs) ? top : h->maxNs;
+        }
+    }
+    return h->maxNs;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_stats_format_latency
+// Description  : Write the count, mean, p50, p99, p99.9 and maximum of a
+//                histogram on one line, in microseconds
+//
+// Inputs       : buf, len - where to write the line
+//                name - what the histogram measures
+//                h - the histogram
+// Outputs      : 1 if a line was written, 0 if the histogram is empty
+
+int cart_stats_format_latency(char *buf, size_t len, const char *name, const CartHistogram *h) {
+    uint64_t count = h->count;
+    if (count == 0)
+        return 0;
+    snprintf(buf, len, "%-8s %9llu ops  mean %9.1f  p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us",
+             name, (unsigned long long)count, h->sumNs / 1000.0 / count,
+             cart_hist_percentile(h, 50.0) / 1000.0, cart_hist_percentile(h, 99.0) / 1000.0,
+             cart_hist_percentile(h, 99.9) / 1000.0, h->maxNs / 1000.0);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_stats_log_latency
+// Description  : Log the latency summary of every bus opcode used and of
+//                cart_read / cart_write
+//
+// Inputs       : none
+// Outputs      : none
+
+void cart_stats_log_latency(void) {
+    static const char *opNames[CART_OP_MAXVAL] = {
+        "INITMS", "BZERO", "LDCART", "RDFRME", "WRFRME", "POWOFF" };
+    char line[160];
+    
+    for (int op = 0; op < CART_OP_MAXVAL; op++) {
+        if (cart_stats_format_latency(line, sizeof(line), opNames[op], &cartStats->busLatency[op]))
+            logMessage(LOG_INFO_LEVEL, "CART latency %s", line);
+    }
+    if (cart_stats_format_latency(line, sizeof(line), "read", &cartStats->readLatency))
+        logMessage(LOG_INFO_LEVEL, "CART latency %s", line);
+    if (cart_stats_format_latency(line, sizeof(line), "write", &cartStats->writeLatency))
+        logMessage(LOG_INFO_LEVEL, "CART latency %s", line);
+}
@@ -0,0 +1,96 @@
+#ifndef CART_STATS_INCLUDED
+#define CART_STATS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_stats.h
+//  Description    : This is the header file for the live statistics of the
+//                   CART driver.  The counters are updated without locks and
+//                   can be published in a shared memory segment, where
+//                   cart_stat reads them while the process runs.
+//
+//  Author         : Huaxin Li
+//  Last Modified  : 10/16/26
+//
+
+// Include files
+#include <stddef.h>
+#include <stdint.h>
+#include <cart_controller.h>
+
+// Defines
+#define CART_STATS_MAGIC 0x54534443      // "CDST"
+#define CART_STATS_VERSION 2
+#define CART_STATS_NAME "/cart_stat.%d"  // Shared memory name, by process id
+#define CART_HIST_SUB_BITS 4             // 16 buckets per power of two (6% precision)
+#define CART_HIST_MAX_BITS 40            // Latencies up to 2^40 ns (18 minutes)
+#define CART_HIST_BUCKETS ((CART_HIST_MAX_BITS - CART_HIST_SUB_BITS + 1) << CART_HIST_SUB_BITS)
+
+// Type definitions
+typedef struct {
+	uint64_t count;                     // Latencies recorded
+	uint64_t sumNs;                     // Their total
+	uint64_t maxNs;                     // The longest one
+	uint64_t buckets[CART_HIST_BUCKETS];// Log-linear buckets, see cart_hist_bucket
+} CartHistogram;
+
+typedef struct {
+	uint32_t magic;                     // CART_STATS_MAGIC once published
+	uint32_t version;                   // CART_STATS_VERSION
+	int32_t  pid;                       // Process updating the counters
+	uint32_t reserved;
+	uint64_t opens;                     // Files opened (cart_driver.c)
+	uint64_t closes;                    // Files closed
+	uint64_t reads;                     // Read requests, a vector counts each segment
+	uint64_t writes;                    // Write requests
+	uint64_t bytesRead;                 // Bytes returned by reads
+	uint64_t bytesWritten;              // Bytes accepted by writes
+	uint64_t framesAllocated;           // Frames given to files
+	uint64_t framesFreed;               // Frames taken back from files
+	uint64_t loadsElided;               // LDCART requests not sent, cart already loaded
+	uint64_t busOps[CART_OP_MAXVAL];    // Bus requests sent, by opcode (cart_client.c)
+	uint64_t busBatches;                // Pipelined round trips to the server
+	uint64_t cacheHits;                 // Lookups served by the cache (cart_cache.c)
+	uint64_t cacheMisses;               // Frames not cached when demanded
+	uint64_t cacheInsertions;           // Frames put in the cache, read-ahead included
+	uint64_t cacheEvictions;            // Frames replaced to make room
+	uint64_t cacheWritebacks;           // Dirty frames written back
+	CartHistogram busLatency[CART_OP_MAXVAL]; // Bus round trips, by opcode (cart_client.c)
+	CartHistogram readLatency;          // cart_read calls (cart_driver.c)
+	CartHistogram writeLatency;         // cart_write calls
+} CartStats;
+
+// Global data
+extern CartStats *cartStats;            // Counters of this process (published or not)
+
+// Update a counter, readers in other processes never block the writer
+#define CART_STAT_ADD(field, n) __atomic_fetch_add(&cartStats->field, (n), __ATOMIC_RELAXED)
+#define CART_STAT_SUB(field, n) __atomic_fetch_sub(&cartStats->field, (n), __ATOMIC_RELAXED)
+#define CART_STAT_INC(field)    CART_STAT_ADD(field, 1)
+
+//
+// Interface functions
+
+int cart_stats_publish(void);
+	// Move the counters into a shared memory segment named after the process
+	// (call before starting any IO)
+
+int cart_stats_unpublish(void);
+	// Copy the counters back into the process and remove the segment
+
+uint64_t cart_stats_now(void);
+	// Get a monotonic timestamp in nanoseconds for latency measurements
+
+void cart_hist_record(CartHistogram *h, uint64_t ns);
+	// Add a latency to a histogram
+
+uint64_t cart_hist_percentile(const CartHistogram *h, double pct);
+	// Get the latency (ns) below which pct percent of the recorded ones fall
+
+int cart_stats_format_latency(char *buf, size_t len, const char *name, const CartHistogram *h);
+	// Write a one line p50/p99/p99.9 summary of a histogram, 0 if it is empty
+
+void cart_stats_log_latency(void);
+	// Log the latency summary of every opcode and of cart_read / cart_write
+
+#endif